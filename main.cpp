@@ -1,11 +1,19 @@
+#include "src/CogeGen/peephole.hpp"
+#include "src/IR/lower.hpp"
+#include "src/IR/pass.hpp"
 #include "src/ast.hpp"
+#include "src/ast_cache.hpp"
 #include "src/code_gen.hpp"
 #include "src/lexer.hpp"
+#include "src/sema.hpp"
+#include "src/source_file.hpp"
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <memory>
 #include <string>
 #include <filesystem>
+#include <algorithm>
+#include <cstdlib>
 
 using namespace std;
 
@@ -18,6 +26,22 @@ void print_usage(const char *program_name) {
   cerr << "  -o <file>    Specify output file (default: output.asm)" << endl;
   cerr << "  -l, --lexer  Shows the token list as tokens_<file>.txt" << endl;
   cerr << "  -a, --ast    Shows ast output file as ast_<file>.txt" << endl;
+  cerr << "  -i, --ir     Shows the optimised IR as ir_<file>.txt" << endl;
+  cerr << "  -j <n>       Lex and parse large inputs on up to n threads"
+       << endl;
+  cerr << "  --cache <dir> Reuse the parsed AST of unchanged inputs from dir"
+       << endl;
+  cerr << "  --peephole-stats Print how often each peephole rule fired"
+       << endl;
+  cerr << "  --inline-threshold <n> Inline functions costing at most n "
+          "(default 24, 0 disables)"
+       << endl;
+  cerr << "  --inline-report Print which calls were inlined" << endl;
+  cerr << "  --dead-function-report Print the functions left out as unused"
+       << endl;
+  cerr << "  --no-strength-reduction Multiply and divide by constants with "
+          "imul and idiv"
+       << endl;
   cerr << "  -h, --help   Show this help message" << endl;
 }
 
@@ -28,8 +52,16 @@ int main(int argc, char *argv[]) {
   }
   bool lexer_debug = false;
   bool ast_debug = false;
+  bool ir_debug = false;
+  bool peephole_stats = false;
+  CodegenOptions codegen;
+  ir::PassContext passes;
+  bool inline_report = false;
+  bool dead_function_report = false;
+  unsigned jobs = 1;
   string input_file;
   string output_file = "output.asm";
+  string cache_dir;
 
   for (int i = 1; i < argc; i++) {
     string arg = argv[i];
@@ -43,10 +75,41 @@ int main(int argc, char *argv[]) {
         cerr << "Error: -o requires an argument" << endl;
         return 1;
       }
+    } else if (arg == "-j") {
+      if (i + 1 < argc) {
+        jobs = static_cast<unsigned>(max(1, atoi(argv[++i])));
+      } else {
+        cerr << "Error: -j requires an argument" << endl;
+        return 1;
+      }
+    } else if (arg == "--cache") {
+      if (i + 1 < argc) {
+        cache_dir = argv[++i];
+      } else {
+        cerr << "Error: --cache requires an argument" << endl;
+        return 1;
+      }
     } else if (arg == "-a" || arg == "--ast") {
       ast_debug = true;
+    } else if (arg == "-i" || arg == "--ir") {
+      ir_debug = true;
     } else if (arg == "-l" || arg == "--lexer") {
       lexer_debug = true;
+    } else if (arg == "--peephole-stats") {
+      peephole_stats = true;
+    } else if (arg == "--inline-threshold") {
+      if (i + 1 < argc) {
+        passes.inlineThreshold = static_cast<uint32_t>(max(0, atoi(argv[++i])));
+      } else {
+        cerr << "Error: --inline-threshold requires an argument" << endl;
+        return 1;
+      }
+    } else if (arg == "--inline-report") {
+      inline_report = true;
+    } else if (arg == "--dead-function-report") {
+      dead_function_report = true;
+    } else if (arg == "--no-strength-reduction") {
+      codegen.strength_reduction = false;
     } else {
       input_file = arg;
     }
@@ -58,24 +121,36 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  ifstream inputFileStream(input_file);
-  if (!inputFileStream) {
-    cerr << "Error: Could not open input file: " << input_file << endl;
+  unique_ptr<SourceFile> source;
+  try {
+    source = make_unique<SourceFile>(input_file);
+  } catch (const exception &e) {
+    cerr << "Error: " << e.what() << endl;
     return 1;
   }
 
-  stringstream buffer;
-  buffer << inputFileStream.rdbuf();
-  string sourceCode = buffer.str();
-  inputFileStream.close();
+  // An input that is unchanged since it was last compiled with the same
+  // cache directory skips lexing and parsing entirely.
+  Program program;
+  string cache_path;
+  bool cached = false;
+  if (!cache_dir.empty()) {
+    cache_path = astCachePath(cache_dir, source->text());
+    cached = loadAstCache(cache_path, source->text(), program);
+  }
 
-  // Lexical analysis
-  vector<Token> tokens;
-  try {
-    tokens = lex(sourceCode);
-  } catch (const exception &e) {
-    cerr << "Lexer error: " << e.what() << endl;
-    return 1;
+  // Lexical analysis. The full token array is only built when the token
+  // listing is requested or the input is lexed on several threads;
+  // otherwise the parser pulls tokens from the lexer as it goes.
+  bool buffered = lexer_debug || jobs > 1;
+  TokenBuffer tokens;
+  if (buffered && (lexer_debug || !cached)) {
+    try {
+      tokens = lex(source->text(), jobs);
+    } catch (const exception &e) {
+      cerr << "Lexer error: " << e.what() << endl;
+      return 1;
+    }
   }
 
   // Output lexer debug info if requested
@@ -93,13 +168,31 @@ int main(int argc, char *argv[]) {
   }
 
   // Parse to AST
-  vector<StmtPtr> ast;
-  try {
-    ast = Program::tokens_to_ast(tokens);
-    cout << "Parsed " << ast.size() << " top-level statement(s)" << endl;
-  } catch (const exception &e) {
-    cerr << "Parse error: " << e.what() << endl;
-    return 1;
+  if (cached) {
+    cout << "AST loaded from cache: " << cache_path << endl;
+  } else {
+    try {
+      if (buffered) {
+        program = Program::tokens_to_ast(tokens, jobs);
+      } else {
+        Lexer lexer(source->text());
+        TokenCursor cursor(lexer);
+        program = Program::tokens_to_ast(cursor);
+      }
+      cout << "Parsed " << program.statements.size()
+           << " top-level statement(s)" << endl;
+    } catch (const LexError &e) {
+      cerr << "Lexer error: " << e.what() << endl;
+      return 1;
+    } catch (const exception &e) {
+      cerr << "Parse error: " << e.what() << endl;
+      return 1;
+    }
+
+    if (!cache_path.empty() &&
+        !saveAstCache(cache_path, source->text(), program)) {
+      cerr << "Warning: could not write AST cache: " << cache_path << endl;
+    }
   }
 
   // Output AST debug info if requested
@@ -111,15 +204,58 @@ int main(int argc, char *argv[]) {
       cerr << "Error: Could not open AST output file: " << ast_out << endl;
       return 1;
     }
-    for (const auto &stmt : ast) {
-      printStmt(astFileStream, stmt.get(), 0);
+    for (const auto &stmt : program.statements) {
+      printStmt(astFileStream, stmt, 0);
     }
     astFileStream.close();
     cout << "AST output written to: " << ast_out << endl;
   }
 
+  try {
+    annotateTypes(program);
+  } catch (const SemaError &e) {
+    cerr << "Semantic error: " << e.what() << endl;
+    return 1;
+  }
+
+  // Lower to SSA and optimise
+  ir::Module module;
+  try {
+    module = ir::lower(program);
+    ir::defaultPipeline().run(module, passes);
+  } catch (const ir::LowerError &e) {
+    cerr << "Semantic error: " << e.what() << endl;
+    return 1;
+  } catch (const exception &e) {
+    cerr << "Optimizer error: " << e.what() << endl;
+    return 1;
+  }
+  if (inline_report) {
+    cout << "Inlined calls:" << endl;
+    for (const ir::Remark &remark : passes.remarks)
+      if (string(remark.pass) == ir::inlinePass.name)
+        cout << "  " << remark.message << endl;
+  }
+  if (dead_function_report) {
+    cout << "Eliminated functions:" << endl;
+    for (const ir::Remark &remark : passes.remarks)
+      if (string(remark.pass) == ir::deadFunctionsPass.name)
+        cout << "  " << remark.message << endl;
+  }
+
+  if (ir_debug) {
+    string base_name = filesystem::path(input_file).filename().string();
+    string ir_out = "ir_" + base_name + ".txt";
+    ofstream irFileStream(ir_out);
+    if (!irFileStream) {
+      cerr << "Error: Could not open IR output file: " << ir_out << endl;
+      return 1;
+    }
+    ir::print(irFileStream, module);
+    cout << "IR output written to: " << ir_out << endl;
+  }
+
   // Generate code
-  Program program(std::move(ast));
   ofstream outputFileStream(output_file);
   if (!outputFileStream) {
     cerr << "Error: Could not open output file: " << output_file << endl;
@@ -127,9 +263,17 @@ int main(int argc, char *argv[]) {
   }
 
   try {
-    ast_to_bin(outputFileStream, program);
+    vector<uint32_t> hits(peephole_rules.size(), 0);
+    if (peephole_stats)
+      codegen.peephole_hits = &hits;
+    ir_to_bin(outputFileStream, module, codegen);
     outputFileStream.close();
     cout << "Assembly generated: " << output_file << endl;
+    if (peephole_stats) {
+      cout << "Peephole rule hits:" << endl;
+      for (size_t r = 0; r < peephole_rules.size(); r++)
+        cout << "  " << peephole_rules[r].name << ": " << hits[r] << endl;
+    }
   } catch (const exception &e) {
     cerr << "Codegen error: " << e.what() << endl;
     return 1;
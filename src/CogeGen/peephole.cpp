@@ -0,0 +1,388 @@
+#include "peephole.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_map>
+using namespace std;
+
+namespace {
+
+bool is_memory(const string &operand) {
+  return operand.find('[') != string::npos;
+}
+
+bool is_immediate(const string &operand) {
+  return !operand.empty() && (isdigit(static_cast<unsigned char>(operand[0])) ||
+                              operand[0] == '-');
+}
+
+bool fits_imm32(const string &operand) {
+  long long value = strtoll(operand.c_str(), nullptr, 10);
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+bool is_scratch(const string &reg) {
+  return reg == "rax" || reg == "rcx" || reg == "rdx";
+}
+
+// The 64-bit register an operand names, and whether writing the operand
+// replaces all of it (32-bit writes zero the upper half, 8-bit ones don't)
+struct RegisterName {
+  string full; // empty for memory and immediates
+  bool whole;
+};
+
+RegisterName register_name(const string &operand) {
+  static const unordered_map<string, RegisterName> names = {
+      {"eax", {"rax", true}}, {"al", {"rax", false}},
+      {"ecx", {"rcx", true}}, {"cl", {"rcx", false}},
+      {"edx", {"rdx", true}}, {"dl", {"rdx", false}},
+      {"ebx", {"rbx", true}}, {"bl", {"rbx", false}},
+      {"esi", {"rsi", true}}, {"sil", {"rsi", false}},
+      {"edi", {"rdi", true}}, {"dil", {"rdi", false}},
+  };
+  auto it = names.find(operand);
+  if (it != names.end())
+    return it->second;
+  if (operand.size() >= 2 && operand[0] == 'r' && !is_memory(operand)) {
+    char last = operand.back();
+    if (isdigit(static_cast<unsigned char>(operand[1])) &&
+        (last == 'd' || last == 'b'))
+      return {operand.substr(0, operand.size() - 1), last == 'd'};
+    return {operand, true};
+  }
+  return {"", false};
+}
+
+bool names(const string &operand, const string &reg) {
+  return register_name(operand).full == reg;
+}
+
+// Whether operand reads reg: as the register itself, or in its address
+bool uses(const string &operand, const string &reg) {
+  if (!is_memory(operand))
+    return names(operand, reg);
+  size_t start = operand.find('[');
+  while (start < operand.size()) {
+    size_t end = start;
+    while (end < operand.size() &&
+           (isalnum(static_cast<unsigned char>(operand[end])) ||
+            operand[end] == '_'))
+      end++;
+    if (end > start && names(operand.substr(start, end - start), reg))
+      return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+bool is_register(const string &operand) {
+  return !register_name(operand).full.empty();
+}
+
+bool one_of(const string &op, initializer_list<const char *> ops) {
+  for (const char *candidate : ops)
+    if (op == candidate)
+      return true;
+  return false;
+}
+
+// Whether line may read reg
+bool reads(const AsmLine &line, const string &reg) {
+  const string &op = line.op;
+  const vector<string> &args = line.args;
+  if (one_of(op, {"mov", "movzx", "lea"}))
+    return uses(args[1], reg) || (is_memory(args[0]) && uses(args[0], reg));
+  if (op == "xor" && args[0] == args[1])
+    return false;
+  if (op == "imul" && args.size() == 3)
+    return uses(args[1], reg);
+  if (op == "imul" && args.size() == 1) // rdx:rax = rax * args[0]
+    return reg == "rax" || uses(args[0], reg);
+  if (one_of(op, {"add", "sub", "imul", "xor", "and", "or", "cmp", "test",
+                  "shl", "shr", "sar"}))
+    return uses(args[0], reg) || uses(args[1], reg);
+  if (one_of(op, {"neg", "not", "inc", "dec", "push"}) ||
+      op.compare(0, 3, "set") == 0)
+    return uses(args[0], reg);
+  if (op == "cqo")
+    return reg == "rax";
+  if (op == "idiv")
+    return reg == "rax" || reg == "rdx" || uses(args[0], reg);
+  if (op == "syscall")
+    return one_of(reg, {"rax", "rdi", "rsi", "rdx"});
+  if (op == "repne scasb")
+    return one_of(reg, {"rax", "rcx", "rdi"});
+  if (op == "ret")
+    return reg == "rax";
+  if (one_of(op, {"pop", "call"}) || op[0] == 'j')
+    return false;
+  return true; // anything unknown is assumed to need everything
+}
+
+// Whether line replaces all of reg without reading it
+bool overwrites(const AsmLine &line, const string &reg) {
+  const string &op = line.op;
+  const vector<string> &args = line.args;
+  auto whole = [&](const string &operand) {
+    RegisterName name = register_name(operand);
+    return name.full == reg && name.whole;
+  };
+  if (one_of(op, {"mov", "movzx", "lea", "pop", "xor"}) ||
+      (op == "imul" && args.size() == 3))
+    return whole(args[0]);
+  if (op == "cqo" || (op == "imul" && args.size() == 1))
+    return reg == "rdx";
+  if (op == "call") // the callee may clobber every caller-saved register
+    return !one_of(reg, {"rbx", "rbp", "rsp", "r12", "r13", "r14", "r15"});
+  return false;
+}
+
+size_t next_line(const vector<AsmLine> &code, size_t i) {
+  do
+    i++;
+  while (i < code.size() && code[i].kind == AsmLine::Deleted);
+  return i;
+}
+
+bool is_instr(const vector<AsmLine> &code, size_t i, const char *op) {
+  return i < code.size() && code[i].kind == AsmLine::Instr && code[i].op == op;
+}
+
+// Whether the scratch register reg is no longer needed after code[i]
+bool dead_after(const vector<AsmLine> &code, size_t i, const string &reg) {
+  for (size_t j = next_line(code, i); j < code.size(); j = next_line(code, j)) {
+    const AsmLine &line = code[j];
+    if (line.kind == AsmLine::Label)
+      return true;
+    if (reads(line, reg))
+      return false;
+    if (overwrites(line, reg) || line.op[0] == 'j')
+      return true;
+  }
+  return true;
+}
+
+const char *negate_condition(const string &cc) {
+  static const unordered_map<string, const char *> negated = {
+      {"e", "ne"}, {"ne", "e"}, {"z", "nz"}, {"nz", "z"}, {"l", "ge"},
+      {"ge", "l"}, {"le", "g"}, {"g", "le"},
+  };
+  auto it = negated.find(cc);
+  return it != negated.end() ? it->second : nullptr;
+}
+
+// --- Rules ---------------------------------------------------------------
+
+// mov a, a
+bool self_move(vector<AsmLine> &code, size_t i) {
+  AsmLine &line = code[i];
+  if (line.op != "mov" || line.args[0] != line.args[1])
+    return false;
+  line.kind = AsmLine::Deleted;
+  return true;
+}
+
+// mov a, b / mov b, a: the second move changes nothing
+bool move_back(vector<AsmLine> &code, size_t i) {
+  if (code[i].op != "mov")
+    return false;
+  size_t j = next_line(code, i);
+  if (!is_instr(code, j, "mov") || code[j].args[0] != code[i].args[1] ||
+      code[j].args[1] != code[i].args[0])
+    return false;
+  code[j].kind = AsmLine::Deleted;
+  return true;
+}
+
+// mov [m], r / mov s, [m]: reload from the register instead of memory
+bool store_reload(vector<AsmLine> &code, size_t i) {
+  const AsmLine &store = code[i];
+  if (store.op != "mov" || !is_memory(store.args[0]) ||
+      !is_register(store.args[1]))
+    return false;
+  size_t j = next_line(code, i);
+  if (!is_instr(code, j, "mov") || code[j].args[1] != store.args[0] ||
+      !is_register(code[j].args[0]))
+    return false;
+  code[j].args[1] = store.args[1];
+  return true;
+}
+
+// mov s, x / op y, s with the scratch register s dead afterwards: use x
+// directly (mov rax, [m] / cmp rax, 5 becomes cmp [m], 5)
+bool forward_scratch(vector<AsmLine> &code, size_t i) {
+  const AsmLine &load = code[i];
+  if (load.op != "mov" || !is_scratch(load.args[0]))
+    return false;
+  const string &scratch = load.args[0];
+  const string &value = load.args[1];
+  size_t j = next_line(code, i);
+  if (j >= code.size() || code[j].kind != AsmLine::Instr)
+    return false;
+  AsmLine &use = code[j];
+
+  // The operand of use that reads the scratch register
+  size_t operand;
+  if (one_of(use.op, {"mov", "add", "sub"}) ||
+      (use.op == "imul" && use.args.size() == 2)) {
+    operand = 1;
+    if (names(use.args[0], scratch))
+      return false;
+  } else if (use.op == "cmp") {
+    if (names(use.args[0], scratch) == names(use.args[1], scratch))
+      return false;
+    operand = names(use.args[0], scratch) ? 0 : 1;
+  } else if (use.op == "push") {
+    operand = 0;
+  } else {
+    return false;
+  }
+  if (use.args[operand] != scratch)
+    return false;
+
+  // Only forms x86 can encode
+  if (is_immediate(value) &&
+      (!fits_imm32(value) || use.op == "imul" ||
+       (use.op == "cmp" && operand == 0)))
+    return false;
+  if (is_memory(value) && use.args.size() == 2 &&
+      is_memory(use.args[1 - operand]))
+    return false;
+  if (value.compare(0, 5, "[rel ") == 0)
+    return false;
+  if (!dead_after(code, j, register_name(scratch).full))
+    return false;
+
+  use.args[operand] = value;
+  code[i].kind = AsmLine::Deleted;
+  return true;
+}
+
+// Writes to a scratch register nothing reads
+bool dead_scratch(vector<AsmLine> &code, size_t i) {
+  const AsmLine &line = code[i];
+  if (!one_of(line.op, {"mov", "movzx", "lea"}) &&
+      line.op.compare(0, 3, "set") != 0)
+    return false;
+  string reg = register_name(line.args[0]).full;
+  if (!is_scratch(reg) || !dead_after(code, i, reg))
+    return false;
+  code[i].kind = AsmLine::Deleted;
+  return true;
+}
+
+// cmp r, 0 -> test r, r
+bool zero_test(vector<AsmLine> &code, size_t i) {
+  AsmLine &line = code[i];
+  if (line.op != "cmp" || line.args[1] != "0" || !is_register(line.args[0]))
+    return false;
+  line.op = "test";
+  line.args[1] = line.args[0];
+  return true;
+}
+
+// setcc al / movzx eax, al / [mov x, rax] / test x, x / jz: the flags of
+// the comparison are still set, so branch on them directly
+bool reuse_flags(vector<AsmLine> &code, size_t i) {
+  const AsmLine &set = code[i];
+  if (set.op.compare(0, 3, "set") != 0 || set.args[0] != "al")
+    return false;
+  string cc = set.op.substr(3);
+  size_t j = next_line(code, i);
+  if (!is_instr(code, j, "movzx") || code[j].args[0] != "eax")
+    return false;
+  string copy = "rax";
+  size_t k = next_line(code, j);
+  if (is_instr(code, k, "mov") && code[k].args[1] == "rax") {
+    copy = code[k].args[0];
+    k = next_line(code, k);
+  }
+  bool tested = is_instr(code, k, "test") && code[k].args[0] == copy &&
+                code[k].args[1] == copy;
+  bool compared = is_instr(code, k, "cmp") && code[k].args[0] == copy &&
+                  code[k].args[1] == "0";
+  if (!tested && !compared)
+    return false;
+  size_t jump = next_line(code, k);
+  if (jump >= code.size() || code[jump].kind != AsmLine::Instr)
+    return false;
+  const string &op = code[jump].op;
+  const char *taken;
+  if (op == "jnz" || op == "jne")
+    taken = cc.c_str();
+  else if (op == "jz" || op == "je")
+    taken = negate_condition(cc);
+  else
+    return false;
+  if (!taken || !negate_condition(cc))
+    return false;
+  code[jump].op = "j" + string(taken);
+  code[k].kind = AsmLine::Deleted;
+  return true;
+}
+
+// jmp to the label right after it
+bool jump_to_next(vector<AsmLine> &code, size_t i) {
+  if (code[i].op != "jmp")
+    return false;
+  size_t j = next_line(code, i);
+  if (j >= code.size() || code[j].kind != AsmLine::Label ||
+      code[j].op != code[i].args[0])
+    return false;
+  code[i].kind = AsmLine::Deleted;
+  return true;
+}
+
+// add r, 0 / sub r, 0 disappear; imul r, x, 1 is a move
+bool identity_arithmetic(vector<AsmLine> &code, size_t i) {
+  AsmLine &line = code[i];
+  if (one_of(line.op, {"add", "sub"}) && line.args[1] == "0") {
+    line.kind = AsmLine::Deleted;
+    return true;
+  }
+  if (line.op == "imul" && line.args.size() == 3 && line.args[2] == "1") {
+    line.op = "mov";
+    line.args.pop_back();
+    return true;
+  }
+  return false;
+}
+
+} // namespace
+
+const vector<PeepholeRule> peephole_rules = {
+    {"self-move", self_move},
+    {"move-back", move_back},
+    {"store-reload", store_reload},
+    {"forward-scratch", forward_scratch},
+    {"dead-scratch", dead_scratch},
+    {"zero-test", zero_test},
+    {"reuse-flags", reuse_flags},
+    {"jump-to-next", jump_to_next},
+    {"identity-arithmetic", identity_arithmetic},
+};
+
+void peephole(vector<AsmLine> &code, vector<uint32_t> *hits) {
+  // Every rewrite removes a line or turns an instruction into a simpler
+  // one, so the sweeps stop
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+      for (size_t r = 0; r < peephole_rules.size(); r++) {
+        if (code[i].kind != AsmLine::Instr)
+          break;
+        if (peephole_rules[r].apply(code, i)) {
+          changed = true;
+          if (hits)
+            (*hits)[r]++;
+        }
+      }
+    }
+  }
+  code.erase(remove_if(code.begin(), code.end(),
+                       [](const AsmLine &line) {
+                         return line.kind == AsmLine::Deleted;
+                       }),
+             code.end());
+}
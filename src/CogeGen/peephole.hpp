@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One line of emitted assembly: an instruction with its operands in NASM
+// syntax, or a label. Rules delete lines by marking them Deleted.
+struct AsmLine {
+  enum Kind : uint8_t { Instr, Label, Deleted };
+  Kind kind = Instr;
+  std::string op; // mnemonic, or the label's name
+  std::vector<std::string> args;
+};
+
+// A rewrite of the instruction at code[i] and the lines after it. apply
+// reports whether it changed anything. Rules rely on the backend's
+// invariant that the scratch registers rax, rcx and rdx never carry a value
+// across a label or a jump.
+struct PeepholeRule {
+  const char *name;
+  bool (*apply)(std::vector<AsmLine> &code, size_t i);
+};
+
+extern const std::vector<PeepholeRule> peephole_rules;
+
+// Apply the rules to one function's code until none fires, then drop the
+// deleted lines. hits, when given, is indexed like peephole_rules and counts
+// every rewrite.
+void peephole(std::vector<AsmLine> &code, std::vector<uint32_t> *hits);
@@ -0,0 +1,226 @@
+#include "regalloc.hpp"
+#include <algorithm>
+using namespace std;
+using namespace ir;
+
+namespace {
+
+// One bit per SSA value of a function
+struct ValueSet {
+  vector<uint64_t> words;
+
+  explicit ValueSet(uint32_t count) : words((count + 63) / 64, 0) {}
+
+  void insert(ValueId v) { words[v / 64] |= uint64_t(1) << (v % 64); }
+  bool contains(ValueId v) const {
+    return (words[v / 64] >> (v % 64)) & 1;
+  }
+
+  template <typename F> void for_each(F visit) const {
+    for (size_t w = 0; w < words.size(); w++)
+      for (uint64_t bits = words[w]; bits; bits &= bits - 1)
+        visit(static_cast<ValueId>(w * 64 + __builtin_ctzll(bits)));
+  }
+};
+
+struct Liveness {
+  vector<ValueSet> live_in; // without the block's own phis
+  vector<ValueSet> live_out;
+};
+
+// Backward dataflow over the CFG. A phi argument is live out of the
+// predecessor it comes from, not live into the phi's block.
+Liveness compute_liveness(const Function &func) {
+  size_t count = func.blocks.size();
+  ValueSet empty(func.valueCount);
+  vector<ValueSet> gen(count, empty), kill(count, empty);
+  vector<ValueSet> phi_uses(count, empty);
+  for (BlockId b = 0; b < count; b++) {
+    const Block &block = func.blocks[b];
+    for (const Instr &instr : block.instrs) {
+      if (instr.op == Opcode::Phi) {
+        for (size_t i = 0; i < instr.args.size(); i++)
+          if (instr.args[i].isValue())
+            phi_uses[block.preds[i]].insert(instr.args[i].id);
+      } else {
+        // In SSA a definition in the block precedes its uses there
+        for (const Operand &arg : instr.args)
+          if (arg.isValue() && !kill[b].contains(arg.id))
+            gen[b].insert(arg.id);
+      }
+      if (instr.dst != NO_VALUE)
+        kill[b].insert(instr.dst);
+    }
+  }
+
+  Liveness live{vector<ValueSet>(count, empty), vector<ValueSet>(count, empty)};
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (BlockId b = static_cast<BlockId>(count); b-- > 0;) {
+      ValueSet out = phi_uses[b];
+      for (BlockId succ : successors(func.blocks[b]))
+        for (size_t w = 0; w < out.words.size(); w++)
+          out.words[w] |= live.live_in[succ].words[w];
+      ValueSet in = gen[b];
+      for (size_t w = 0; w < in.words.size(); w++)
+        in.words[w] |= out.words[w] & ~kill[b].words[w];
+      if (in.words != live.live_in[b].words ||
+          out.words != live.live_out[b].words) {
+        live.live_in[b] = std::move(in);
+        live.live_out[b] = std::move(out);
+        changed = true;
+      }
+    }
+  }
+  return live;
+}
+
+struct LiveInterval {
+  ValueId value;
+  uint32_t start = UINT32_MAX;
+  uint32_t end = 0;
+  bool crosses_call = false;
+
+  void extend(uint32_t position) {
+    start = min(start, position);
+    end = max(end, position);
+  }
+};
+
+} // namespace
+
+Allocation allocate_registers(const Function &func,
+                              const RegisterFile &registers) {
+  // Instruction k reads its operands at 2k and writes its result at 2k + 1,
+  // so a value last used by an instruction can share a register with the
+  // value it defines. Phis define at the start of their block.
+  Liveness live = compute_liveness(func);
+  vector<LiveInterval> intervals(func.valueCount);
+  for (ValueId v = 0; v < func.valueCount; v++)
+    intervals[v].value = v;
+  vector<uint32_t> calls; // positions of instructions clobbering registers
+  // Preferred register sources: the phi a value feeds or is fed by, and the
+  // first operand of the instruction defining it
+  vector<ValueId> phi_hint(func.valueCount, NO_VALUE);
+  vector<ValueId> operand_hint(func.valueCount, NO_VALUE);
+
+  uint32_t k = 0;
+  for (BlockId b = 0; b < func.blocks.size(); b++) {
+    const Block &block = func.blocks[b];
+    uint32_t size = static_cast<uint32_t>(block.instrs.size());
+    uint32_t block_start = 2 * k;
+    uint32_t block_end = 2 * (k + size - 1);
+    live.live_in[b].for_each(
+        [&](ValueId v) { intervals[v].extend(block_start); });
+    live.live_out[b].for_each(
+        [&](ValueId v) { intervals[v].extend(block_end); });
+
+    for (const Instr &instr : block.instrs) {
+      if (instr.op == Opcode::Phi) {
+        intervals[instr.dst].extend(block_start);
+        for (const Operand &arg : instr.args) {
+          if (!arg.isValue())
+            continue;
+          phi_hint[arg.id] = instr.dst;
+          if (operand_hint[instr.dst] == NO_VALUE)
+            operand_hint[instr.dst] = arg.id;
+        }
+      } else {
+        for (const Operand &arg : instr.args)
+          if (arg.isValue())
+            intervals[arg.id].extend(2 * k);
+        if (instr.dst != NO_VALUE) {
+          intervals[instr.dst].extend(2 * k + 1);
+          if (!instr.args.empty() && instr.args[0].isValue())
+            operand_hint[instr.dst] = instr.args[0].id;
+        }
+        if (instr.op == Opcode::Call || instr.op == Opcode::Print)
+          calls.push_back(2 * k);
+      }
+      k++;
+    }
+  }
+
+  vector<LiveInterval *> order;
+  for (LiveInterval &interval : intervals) {
+    if (interval.start == UINT32_MAX)
+      continue; // never defined or used
+    auto call = upper_bound(calls.begin(), calls.end(), interval.start);
+    interval.crosses_call = call != calls.end() && *call < interval.end;
+    order.push_back(&interval);
+  }
+  sort(order.begin(), order.end(),
+       [](const LiveInterval *a, const LiveInterval *b) {
+         return a->start != b->start ? a->start < b->start
+                                     : a->value < b->value;
+       });
+
+  Allocation result;
+  result.reg.assign(func.valueCount, Allocation::SPILLED);
+  result.slot.assign(func.valueCount, 0);
+  uint32_t all = registers.count >= 32 ? ~0u : (1u << registers.count) - 1;
+  uint32_t free_registers = all;
+  vector<LiveInterval *> active;
+
+  auto spill = [&](ValueId v) {
+    result.reg[v] = Allocation::SPILLED;
+    result.slot[v] = result.slot_count++;
+  };
+  auto hinted = [&](ValueId hint, uint32_t available) {
+    if (hint == NO_VALUE || result.reg[hint] == Allocation::SPILLED)
+      return false;
+    return ((available >> result.reg[hint]) & 1) != 0;
+  };
+
+  for (LiveInterval *current : order) {
+    // Registers of intervals that ended before this one starts are free
+    active.erase(remove_if(active.begin(), active.end(),
+                           [&](LiveInterval *interval) {
+                             if (interval->end >= current->start)
+                               return false;
+                             free_registers |=
+                                 1u << result.reg[interval->value];
+                             return true;
+                           }),
+                 active.end());
+
+    ValueId v = current->value;
+    uint32_t allowed = current->crosses_call ? registers.callee_saved : all;
+    uint32_t available = free_registers & allowed;
+    if (available) {
+      int reg;
+      if (hinted(phi_hint[v], available))
+        reg = result.reg[phi_hint[v]];
+      else if (hinted(operand_hint[v], available))
+        reg = result.reg[operand_hint[v]];
+      else if (available & ~registers.callee_saved)
+        reg = __builtin_ctz(available & ~registers.callee_saved);
+      else
+        reg = __builtin_ctz(available);
+      result.reg[v] = static_cast<int8_t>(reg);
+      free_registers &= ~(1u << reg);
+      active.push_back(current);
+      continue;
+    }
+
+    // Out of registers: spill whichever interval ends last
+    LiveInterval *victim = nullptr;
+    for (LiveInterval *interval : active)
+      if (((allowed >> result.reg[interval->value]) & 1) &&
+          (!victim || interval->end > victim->end))
+        victim = interval;
+    if (victim && victim->end > current->end) {
+      result.reg[v] = result.reg[victim->value];
+      spill(victim->value);
+      *find(active.begin(), active.end(), victim) = current;
+    } else {
+      spill(v);
+    }
+  }
+
+  for (int8_t reg : result.reg)
+    if (reg != Allocation::SPILLED)
+      result.used_registers |= 1u << reg;
+  return result;
+}
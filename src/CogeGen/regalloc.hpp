@@ -0,0 +1,29 @@
+#pragma once
+#include "../IR/ir.hpp"
+#include <cstdint>
+#include <vector>
+
+// Registers the allocator may hand out, numbered 0..count-1. Registers in
+// callee_saved keep their value across calls; every other register is
+// clobbered by a call or a print.
+struct RegisterFile {
+  uint32_t count;
+  uint32_t callee_saved; // bit mask
+};
+
+// Where every SSA value of a function lives
+struct Allocation {
+  static constexpr int8_t SPILLED = -1;
+  std::vector<int8_t> reg;    // register per value, or SPILLED
+  std::vector<uint32_t> slot; // frame slot per spilled value
+  uint32_t slot_count = 0;
+  uint32_t used_registers = 0; // bit mask of registers handed out
+};
+
+// Linear-scan register allocation (Poletto & Sarkar) for one function, with
+// the blocks in emission order. Each value gets a single live interval over
+// the linearised instructions; values live across a call only get
+// callee-saved registers, and under pressure the interval ending last is
+// spilled to its own frame slot.
+Allocation allocate_registers(const ir::Function &func,
+                              const RegisterFile &registers);
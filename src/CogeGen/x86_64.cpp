@@ -1,848 +1,887 @@
-#include "../ast.hpp"
+#include "../IR/ir.hpp"
 #include "../code_gen.hpp"
-#include <functional>
-#include <memory>
+#include "peephole.hpp"
+#include "regalloc.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
 #include <string>
-#include <variant>
+#include <unordered_map>
+#include <vector>
 using namespace std;
+using namespace ir;
 
 #define u16 uint16_t
 #define u32 uint32_t
 
-enum class VarType { INT, BOOL, STRING };
-
-typedef struct {
-  u16 rbp_offset;
-  u16 size;
-  string name;
-  void *value;
-  VarType type;
-  string string_label; // If type==STRING, stores the label of the string
-  bool is_param; // True if this is a function parameter (accessed as [rbp +
-                 // offset])
-} Variable;
-
 struct StringData {
   string label; // Unique label for this string (e.g., "str_0")
   string value; // content
   size_t length;
   bool is_computed; // True if from concatenation
+  u32 id;             // creation order, for stable output
+  u32 references = 0; // lea instructions emitted for this string
 
-  StringData(string lbl, string val, bool computed = false)
-      : label(lbl), value(val), length(val.length()), is_computed(computed) {}
+  StringData(string lbl, string val, bool computed, u32 index)
+      : label(lbl), value(val), length(val.length()), is_computed(computed),
+        id(index) {}
 };
 
+// String constants, interned by content. A string only reaches .data once
+// emitted code references it, so intermediate results of folding never do.
 struct Data_table {
-  vector<StringData> strings;
+  deque<StringData> strings; // deque keeps the string_view keys stable
+  unordered_map<string_view, u32> by_value;
+  unordered_map<string_view, u32> by_label;
   u32 string_counter = 0;
 
+  // Label of the string with this content, created on first use
   string add_string(const string &value, bool is_computed = false) {
-    string label = "str_" + to_string(string_counter++);
-    strings.emplace_back(label, value, is_computed);
+    auto it = by_value.find(value);
+    if (it != by_value.end())
+      return strings[it->second].label;
+
+    string label = "str_" + to_string(string_counter);
+    strings.emplace_back(label, value, is_computed, string_counter);
+    by_value.emplace(strings.back().value, string_counter);
+    by_label.emplace(strings.back().label, string_counter);
+    string_counter++;
     return label;
   }
 
-  const StringData *find_string(const string &label) const {
-    for (const auto &s : strings) {
-      if (s.label == label)
-        return &s;
-    }
-    return nullptr;
+  // Record that emitted code refers to label
+  void reference(const string &label) {
+    auto it = by_label.find(label);
+    if (it != by_label.end())
+      strings[it->second].references++;
   }
-};
 
-struct Var_table {
-  vector<Variable> table;
-  void *rbp_ptr;
-};
-
-struct CodegenFunctionParam {
-  string name;
-  VarType type;
-  bool isConst;
-};
-
-struct FunctionInfo {
-  string name;
-  string label; // Assembly label for the function
-  vector<CodegenFunctionParam> parameters;
-  VarType return_type; // Return type (Int by default for now)
-
-  FunctionInfo(string n, string lbl, vector<CodegenFunctionParam> params,
-               VarType ret_type = VarType::INT)
-      : name(n), label(lbl), parameters(params), return_type(ret_type) {}
-};
-
-struct Function_table {
-  vector<FunctionInfo> functions;
-
-  void add_function(const string &name, const string &label,
-                    const vector<CodegenFunctionParam> &params,
-                    VarType return_type = VarType::INT) {
-    functions.emplace_back(name, label, params, return_type);
-  }
-
-  const FunctionInfo *find_function(const string &name) const {
-    for (const auto &func : functions) {
-      if (func.name == name)
-        return &func;
-    }
-    return nullptr;
+  const StringData *find_string(const string &label) const {
+    auto it = by_label.find(label);
+    return it != by_label.end() ? &strings[it->second] : nullptr;
   }
 };
 
-struct CodegenContext {
-  u32 label_counter = 0;
-  u32 function_counter = 0;
-  bool in_function = false; // Track if we're currently in a function (vs main)
+// Allocatable registers, caller-saved first. rax, rcx and rdx are never
+// allocated: they are the scratch registers of single instructions (idiv,
+// phi cycles, syscalls).
+const char *const REGISTER_NAMES[] = {"rsi", "rdi", "r8",  "r9",
+                                      "r10", "r11", "rbx", "r12",
+                                      "r13", "r14", "r15"};
+// rbx and r12-r15 survive calls
+const RegisterFile REGISTERS = {11, 0x7C0};
+
+string memory(int32_t offset) {
+  return "qword [rbp " + string(offset < 0 ? "- " : "+ ") +
+         to_string(offset < 0 ? -offset : offset) + "]";
+}
 
-  string generate_label(const string &prefix) {
-    return prefix + "_" + to_string(label_counter++);
-  }
+bool fits_imm32(int64_t value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
 
-  string generate_function_label(const string &func_name) {
-    return "func_" + func_name;
-  }
-};
+bool is_memory(const string &location) { return location[0] == 'q'; }
 
-string generate_asm_headers() {
-  string header;
-  header += "global _start\n\nsection .text\n_start:\n";
-  return header;
+// Position of the single set bit of a power of two, or -1
+int log2_exact(uint64_t value) {
+  if (value == 0 || (value & (value - 1)) != 0)
+    return -1;
+  return __builtin_ctzll(value);
 }
 
-VarType get_expr_type(Expr *expr, const Var_table &var_table) {
-  if (auto lit = dynamic_cast<LiteralExpr *>(expr)) {
-    if (holds_alternative<int>(lit->value))
-      return VarType::INT;
-    if (holds_alternative<bool>(lit->value))
-      return VarType::BOOL;
-    if (holds_alternative<string>(lit->value))
-      return VarType::STRING;
-  } else if (auto ident = dynamic_cast<IdentifierExpr *>(expr)) {
-    // Lmfaoo sorry I couldn't come up with a better idea
-    for (const auto &var : var_table.table) {
-      if (var.name == ident->name) {
-        return var.type;
-      }
-    }
-  }
-  return VarType::INT;
-}
+// x / d == (high 64 bits of x * multiplier, corrected by x when the
+// multiplier's sign is off) >> shift, rounded towards zero. Hacker's
+// Delight 10-1, for |d| >= 2 and d != INT64_MIN.
+struct MagicNumber {
+  int64_t multiplier;
+  int shift;
+};
 
-bool get_string_label(Expr *expr, const Var_table &var_table,
-                      string &out_label) {
-  if (auto lit = dynamic_cast<LiteralExpr *>(expr)) {
-    if (holds_alternative<string>(lit->value)) {
-      // This is handled in handle_value, but we need the label
-      // We'll return false here and handle it differently
-      return false;
+MagicNumber magic_number(int64_t d) {
+  const uint64_t two63 = uint64_t(1) << 63;
+  uint64_t ad = d < 0 ? 0 - uint64_t(d) : uint64_t(d);
+  uint64_t t = two63 + (uint64_t(d) >> 63);
+  uint64_t anc = t - 1 - t % ad; // |nc|
+  int p = 63;
+  uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc; // 2^p / |nc|
+  uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;   // 2^p / |d|
+  uint64_t delta;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
     }
-  } else if (auto ident = dynamic_cast<IdentifierExpr *>(expr)) {
-    for (const auto &var : var_table.table) {
-      if (var.name == ident->name && var.type == VarType::STRING) {
-        out_label = var.string_label;
-        return true;
-      }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
     }
-  }
-  return false;
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  int64_t multiplier = static_cast<int64_t>(q2 + 1);
+  if (d < 0)
+    multiplier = static_cast<int64_t>(0 - uint64_t(multiplier));
+  return {multiplier, p - 64};
 }
 
-void handle_value(string &out, LiteralExpr *v, Var_table &var_table,
-                  Data_table &data_table, string *out_label = nullptr) {
-  if (holds_alternative<int>(v->value)) {
-    out += "  mov rax, " + to_string(get<int>(v->value)) + "\n";
-  } else if (holds_alternative<bool>(v->value)) {
-    bool val = get<bool>(v->value);
-    out += "  mov rax, " + string(val ? "1" : "0") + "\n";
-  } else if (holds_alternative<string>(v->value)) {
-    // Add string to data table and get its label
-    string label = data_table.add_string(get<string>(v->value), false);
-
-    // If caller wants the label, store it
-    if (out_label) {
-      *out_label = label;
-    }
-
-    // Load address of string into rax
-    out += "  lea rax, [rel " + label + "]\n";
+const char *condition_code(Opcode op) {
+  switch (op) {
+  case Opcode::Eq:
+    return "e";
+  case Opcode::Ne:
+    return "ne";
+  case Opcode::Lt:
+    return "l";
+  case Opcode::Le:
+    return "le";
+  case Opcode::Gt:
+    return "g";
+  default:
+    return "ge";
   }
 }
-void handle_expr(string &out, Expr *expr, Var_table &var_table,
-                 Data_table &data_table, Function_table &func_table,
-                 string *result_label);
-
-void handle_un_expr(string &out, UnaryExpr *u, Var_table &var_table,
-                    Data_table &data_table, Function_table &func_table) {
-  if (auto lit = dynamic_cast<LiteralExpr *>(u->operand.get())) {
-    handle_value(out, lit, var_table, data_table);
-  } else {
-    handle_expr(out, u->operand.get(), var_table, data_table, func_table,
-                nullptr);
-  }
-
-  if (u->op == "-") {
-    out += "  neg rax\n";
-  } else if (u->op == "!") {
-    // Logical NOT: if rax == 0, set to 1, else set to 0
-    out += "  test rax, rax\n";
-    out += "  sete al\n";
-    out += "  movzx rax, al\n";
+
+const char *negated_condition_code(Opcode op) {
+  switch (op) {
+  case Opcode::Eq:
+    return "ne";
+  case Opcode::Ne:
+    return "e";
+  case Opcode::Lt:
+    return "ge";
+  case Opcode::Le:
+    return "g";
+  case Opcode::Gt:
+    return "le";
+  default:
+    return "l";
   }
 }
 
-void handle_bin_expr(string &out, BinaryExpr *b, Var_table &var_table,
-                     Data_table &data_table, Function_table &func_table,
-                     string *result_label = nullptr) {
-  VarType left_type = get_expr_type(b->left.get(), var_table);
-  VarType right_type = get_expr_type(b->right.get(), var_table);
-
-  if (b->op == "+" &&
-      (left_type == VarType::STRING || right_type == VarType::STRING)) {
-    // compile-time concatenation
-    string left_str_val, right_str_val;
-    bool left_is_known = false, right_is_known = false;
-
-    if (auto lit = dynamic_cast<LiteralExpr *>(b->left.get())) {
-      if (holds_alternative<string>(lit->value)) {
-        left_str_val = get<string>(lit->value);
-        left_is_known = true;
-      }
-    } else if (auto ident = dynamic_cast<IdentifierExpr *>(b->left.get())) {
-      for (const auto &var : var_table.table) {
-        if (var.name == ident->name && var.type == VarType::STRING) {
-          // Look up the string value from data table using the variable's label
-          const StringData *str_data = data_table.find_string(var.string_label);
-          if (str_data) {
-            left_str_val = str_data->value;
-            left_is_known = true;
-          }
-          break;
-        }
-      }
-    } else if (auto bin = dynamic_cast<BinaryExpr *>(b->left.get())) {
-      // Handle nested concatenation recursively
-      string nested_label;
-      string nested_code;
-      handle_bin_expr(nested_code, bin, var_table, data_table, func_table,
-                      &nested_label);
-      if (!nested_label.empty()) {
-        const StringData *str_data = data_table.find_string(nested_label);
-        if (str_data) {
-          left_str_val = str_data->value;
-          left_is_known = true;
-        }
-      }
-    }
+// Emits one IR function. Values live in the registers the linear-scan
+// allocator gave them, or in a frame slot below the saved registers when
+// spilled; rax, rcx and rdx hold operands and results that can't be used
+// in place.
+class FunctionEmitter {
+public:
+  FunctionEmitter(const Module &m, const Function &f,
+                  const CodegenOptions &o, Data_table &data,
+                  vector<string> &labels, vector<AsmLine> &c)
+      : module(m), func(f), options(o), data_table(data),
+        string_labels(labels), code(c), uses(countUses(f)),
+        alloc(allocate_registers(f, REGISTERS)) {
+    // _start never returns, so it has nothing to preserve
+    if (!func.isMain)
+      for (u32 r = 0; r < REGISTERS.count; r++)
+        if ((alloc.used_registers & REGISTERS.callee_saved) >> r & 1)
+          saved.push_back(REGISTER_NAMES[r]);
+  }
 
-    if (auto lit = dynamic_cast<LiteralExpr *>(b->right.get())) {
-      if (holds_alternative<string>(lit->value)) {
-        right_str_val = get<string>(lit->value);
-        right_is_known = true;
-      }
-    } else if (auto ident = dynamic_cast<IdentifierExpr *>(b->right.get())) {
-      for (const auto &var : var_table.table) {
-        if (var.name == ident->name && var.type == VarType::STRING) {
-          const StringData *str_data = data_table.find_string(var.string_label);
-          if (str_data) {
-            right_str_val = str_data->value;
-            right_is_known = true;
-          }
-          break;
-        }
-      }
-    } else if (auto bin = dynamic_cast<BinaryExpr *>(b->right.get())) {
-      string nested_label;
-      string nested_code;
-      handle_bin_expr(nested_code, bin, var_table, data_table, func_table,
-                      &nested_label);
-      if (!nested_label.empty()) {
-        const StringData *str_data = data_table.find_string(nested_label);
-        if (str_data) {
-          right_str_val = str_data->value;
-          right_is_known = true;
-        }
-      }
+  void emit() {
+    label(func.label);
+    emit("push", "rbp");
+    emit("mov", "rbp", "rsp");
+    for (const char *reg : saved)
+      emit("push", reg);
+    // Keep rsp 16-byte aligned below the frame
+    u32 words = static_cast<u32>(saved.size()) + alloc.slot_count;
+    u32 frame = 8 * (alloc.slot_count + words % 2);
+    if (frame > 0)
+      emit("sub", "rsp", to_string(frame));
+
+    for (BlockId b = 0; b < func.blocks.size(); b++) {
+      if (b > 0)
+        label(block_label(b));
+      const Block &block = func.blocks[b];
+      for (size_t i = 0; i < block.instrs.size(); i++)
+        emit_instr(b, block, i);
     }
+  }
 
-    // If both values are known at compile time, concatenate them
-    if (left_is_known && right_is_known) {
-      string concatenated = left_str_val + right_str_val;
-      string label = data_table.add_string(concatenated, true);
-
-      if (result_label) {
-        *result_label = label;
-      }
+private:
+  const Module &module;
+  const Function &func;
+  const CodegenOptions &options;
+  Data_table &data_table;
+  vector<string> &string_labels; // assembly label per module string
+  vector<AsmLine> &code;
+  vector<u32> uses;
+  Allocation alloc;
+  vector<const char *> saved; // callee-saved registers pushed on entry
+  // A comparison whose flags are consumed directly by the branch after it
+  const Instr *fused_compare = nullptr;
+
+  template <typename... Operands>
+  void emit(string mnemonic, const Operands &...operands) {
+    code.push_back(
+        {AsmLine::Instr, std::move(mnemonic), {string(operands)...}});
+  }
 
-      out += "  lea rax, [rel " + label + "]\n";
-      return;
-    }
+  void label(string name) {
+    code.push_back({AsmLine::Label, std::move(name), {}});
+  }
 
-    // Otherwise we're fucking cooked lmao don't wanna implement that at runtime
-    out += "  ; ERROR: Runtime string concatenation not yet implemented\n";
-    out += "  xor rax, rax\n";
-    return;
-  }
-
-  // Evaluate left expression and store in rax
-  if (auto lit = dynamic_cast<LiteralExpr *>(b->left.get())) {
-    handle_value(out, lit, var_table, data_table);
-  } else {
-    handle_expr(out, b->left.get(), var_table, data_table, func_table, nullptr);
-  }
-
-  // Save left value to stack
-  out += "  push rax\n";
-
-  // Evaluate right expression and store in rax
-  if (auto lit = dynamic_cast<LiteralExpr *>(b->right.get())) {
-    handle_value(out, lit, var_table, data_table);
-  } else {
-    handle_expr(out, b->right.get(), var_table, data_table, func_table,
-                nullptr);
-  }
-
-  // Pop left value into rbx
-  out += "  pop rbx\n";
-
-  // Perform operation (left is in rbx, right is in rax)
-  if (b->op == "+") {
-    out += "  add rax, rbx\n";
-  } else if (b->op == "-") {
-    out += "  sub rbx, rax\n";
-    out += "  mov rax, rbx\n";
-  } else if (b->op == "*") {
-    out += "  imul rax, rbx\n";
-  } else if (b->op == "/") {
-    out += "  mov rdx, 0\n";
-    out += "  mov rcx, rax\n";
-    out += "  mov rax, rbx\n";
-    out += "  idiv rcx\n";
-  } else if (b->op == "%") {
-    out += "  mov rdx, 0\n";
-    out += "  mov rcx, rax\n";
-    out += "  mov rax, rbx\n";
-    out += "  idiv rcx\n";
-    out += "  mov rax, rdx\n";
-  } else if (b->op == "==") {
-    out += "  cmp rbx, rax\n";
-    out += "  sete al\n";       // Set AL to 1 if equal, 0 otherwise
-    out += "  movzx rax, al\n"; // Zero-extend AL to RAX
-  } else if (b->op == "<") {
-    out += "  cmp rbx, rax\n";
-    out += "  setl al\n"; // Set AL to 1 if rbx < rax
-    out += "  movzx rax, al\n";
-  } else if (b->op == ">") {
-    out += "  cmp rbx, rax\n";
-    out += "  setg al\n"; // Set AL to 1 if rbx > rax
-    out += "  movzx rax, al\n";
-  }
-  // Result is in rax
-}
+  string block_label(BlockId b) const {
+    return func.label + "." + to_string(b);
+  }
 
-void handle_expr(string &out, Expr *expr, Var_table &var_table,
-                 Data_table &data_table, Function_table &func_table,
-                 string *result_label = nullptr) {
+  // The register of v, or its slot below the saved registers
+  string location(ValueId v) const {
+    if (alloc.reg[v] != Allocation::SPILLED)
+      return REGISTER_NAMES[alloc.reg[v]];
+    return memory(-8 * static_cast<int32_t>(saved.size() + alloc.slot[v] + 1));
+  }
 
-  if (auto bin = dynamic_cast<BinaryExpr *>(expr)) {
-    handle_bin_expr(out, bin, var_table, data_table, func_table, result_label);
+  bool in_register(const Operand &op) const {
+    return op.isValue() && alloc.reg[op.id] != Allocation::SPILLED;
   }
 
-  else if (auto un = dynamic_cast<UnaryExpr *>(expr)) {
-    handle_un_expr(out, un, var_table, data_table, func_table);
+  string string_label(u32 index) {
+    string &label = string_labels[index];
+    if (label.empty())
+      label = data_table.add_string(module.strings[index]);
+    data_table.reference(label);
+    return label;
   }
 
-  else if (auto lit = dynamic_cast<LiteralExpr *>(expr)) {
-    handle_value(out, lit, var_table, data_table, result_label);
+  // The operand as an instruction source: a register, a slot, a 32-bit
+  // immediate, or (anything else) loaded into scratch first
+  string source(const Operand &op, const char *scratch) {
+    if (op.isValue())
+      return location(op.id);
+    if (op.isImm() && fits_imm32(op.imm))
+      return to_string(op.imm);
+    load(scratch, op);
+    return scratch;
   }
 
-  // Function calls
-  else if (auto call = dynamic_cast<CallExpr *>(expr)) {
-    // This will be changed later on as I plan to add more builtin functions and
-    // a syscall function
-    if (call->function == "print") {
-      // Assumes the argument is a string
-      if (!call->arguments.empty()) {
-        // Evaluate the argument (should be a string pointer in rax)
-        handle_expr(out, call->arguments[0].get(), var_table, data_table,
-                    func_table, nullptr);
+  // The operand in some register: its own, or scratch
+  string in_some_register(const Operand &op, const char *scratch) {
+    if (in_register(op))
+      return location(op.id);
+    load(scratch, op);
+    return scratch;
+  }
 
-        // Calculate string length (assume null-terminated)
-        // For simplicity, we'll use a fixed approach or look up the length
-        // Store string pointer
-        out += "  mov rsi, rax\n"; // String pointer in rsi
+  void load(const string &reg, const Operand &op) {
+    switch (op.kind) {
+    case Operand::Value:
+      if (location(op.id) != reg)
+        emit("mov", reg, location(op.id));
+      break;
+    case Operand::Imm:
+      if (op.imm == 0)
+        emit("xor", reg, reg);
+      else
+        emit("mov", reg, to_string(op.imm));
+      break;
+    case Operand::Str:
+      emit("lea", reg, "[rel " + string_label(op.id) + "]");
+      break;
+    case Operand::None:
+      break;
+    }
+  }
 
-        out += "  mov rdi, rax\n"; // Copy pointer
-        out += "  xor rcx, rcx\n"; // Counter = 0
-        out += "  dec rcx\n";      // rcx = -1 (for repne)
-        out += "  xor al, al\n";   // Search for 0
-        out += "  repne scasb\n";  // Scan until we find 0
-        out += "  not rcx\n";      // Invert rcx
-        out += "  dec rcx\n";      // Subtract 1 (length without null)
-        out += "  mov rdx, rcx\n"; // Length in rdx
+  void store(ValueId v, const string &reg) {
+    if (location(v) != reg)
+      emit("mov", location(v), reg);
+  }
 
-        // write(1, rsi, rdx)
-        out += "  mov rax, 1\n"; // syscall number for write
-        out += "  mov rdi, 1\n"; // file descriptor 1 (stdout)
-        out += "  syscall\n";
+  // dst = op, whatever the two locations are
+  void move(const string &dst, const Operand &op) {
+    if (!is_memory(dst)) {
+      load(dst, op);
+    } else if (op.isImm() && fits_imm32(op.imm)) {
+      emit("mov", dst, to_string(op.imm));
+    } else if (in_register(op)) {
+      if (location(op.id) != dst)
+        emit("mov", dst, location(op.id));
+    } else if (!(op.isValue() && location(op.id) == dst)) {
+      load("rax", op);
+      emit("mov", dst, "rax");
+    }
+  }
 
-        // Return 0 in rax
-        out += "  xor rax, rax\n";
-      }
+  // add, sub and imul work in the destination's register when it has one
+  // the right operand doesn't need afterwards
+  void emit_arithmetic(const Instr &instr) {
+    Operand lhs = instr.args[0];
+    Operand rhs = instr.args[1];
+    string dst = location(instr.dst);
+    if (instr.op != Opcode::Sub &&
+        ((rhs.isValue() && location(rhs.id) == dst) ||
+         (lhs.isImm() && rhs.isValue())))
+      swap(lhs, rhs);
+    string target = !is_memory(dst) && !(rhs.isValue() &&
+                                         location(rhs.id) == dst)
+                        ? dst
+                        : "rax";
+    if (instr.op == Opcode::Mul && options.strength_reduction &&
+        lhs.isValue() && rhs.isImm() && emit_multiply(lhs, rhs.imm, target)) {
+      store(instr.dst, target);
+      return;
+    }
+    if (instr.op == Opcode::Mul && rhs.isImm() && fits_imm32(rhs.imm)) {
+      string from = lhs.isValue() ? location(lhs.id) : target;
+      if (!lhs.isValue())
+        load(target, lhs);
+      emit("imul", target, from, to_string(rhs.imm));
     } else {
-      // Look up user-defined function
-      const FunctionInfo *func_info = func_table.find_function(call->function);
-      if (func_info) {
-        // User-defined function call
-        // Push arguments onto stack in RIGHT-TO-LEFT order (C calling
-        // convention)
-        for (auto it = call->arguments.rbegin(); it != call->arguments.rend();
-             ++it) {
-          handle_expr(out, it->get(), var_table, data_table, func_table,
-                      nullptr);
-          out += "  push rax\n"; // Push argument onto stack
-        }
+      load(target, lhs);
+      const char *mnemonic = instr.op == Opcode::Add   ? "add"
+                             : instr.op == Opcode::Sub ? "sub"
+                                                       : "imul";
+      emit(mnemonic, target, source(rhs, "rcx"));
+    }
+    store(instr.dst, target);
+  }
 
-        // Call the function
-        out += "  call " + func_info->label + "\n";
+  // target = x * factor with a shift, an lea or both (and a neg for a
+  // negative factor); false when imul is the better choice
+  bool emit_multiply(const Operand &x, int64_t factor, const string &target) {
+    uint64_t magnitude = factor < 0 ? 0 - uint64_t(factor) : uint64_t(factor);
+    if (magnitude == 0) {
+      load(target, Operand::constant(0));
+      return true;
+    }
+    int shift = __builtin_ctzll(magnitude);
+    uint64_t odd = magnitude >> shift;
+    if (odd != 1 && odd != 3 && odd != 5 && odd != 9)
+      return false;
+    if (odd == 1) {
+      load(target, x);
+    } else {
+      string from = in_register(x) ? location(x.id) : target;
+      if (!in_register(x))
+        load(target, x);
+      emit("lea", target,
+           "[" + from + " + " + from + "*" + to_string(odd - 1) + "]");
+    }
+    if (shift > 0)
+      emit("shl", target, to_string(shift));
+    if (factor < 0)
+      emit("neg", target);
+    return true;
+  }
 
-        // Clean up the stack (caller cleans up)
-        if (!call->arguments.empty()) {
-          out += "  add rsp, " + to_string(call->arguments.size() * 8) + "\n";
-        }
+  // Division and remainder by a constant without idiv: a power of two is an
+  // arithmetic shift after biasing negative dividends by 2^k - 1 so the
+  // quotient rounds towards zero, anything else a multiply-high by the
+  // divisor's magic number. The remainder is x - q * d.
+  bool emit_constant_division(const Instr &instr) {
+    const Operand &x = instr.args[0];
+    int64_t d = instr.args[1].imm;
+    bool remainder = instr.op == Opcode::Mod;
+    if (!x.isValue() || d == 0 || d == INT64_MIN)
+      return false;
+    string dst = location(instr.dst);
+    string target = is_memory(dst) ? "rax" : dst;
 
-        // Return value is now in rax
+    if (d == 1 || d == -1) {
+      if (remainder) {
+        load(target, Operand::constant(0));
       } else {
-        // Unknown function
-        out += "  ; ERROR: Unknown function call: " + call->function + "\n";
-        out += "  xor rax, rax\n";
+        load(target, x);
+        if (d < 0)
+          emit("neg", target);
       }
+      store(instr.dst, target);
+      return true;
     }
-  } else if (auto ident = dynamic_cast<IdentifierExpr *>(expr)) {
-    // Look up variable in var_table
-    for (const auto &var : var_table.table) {
-      if (var.name == ident->name) {
-        if (var.is_param) {
-          out += "  mov rax, [rbp + " + std::to_string(var.rbp_offset) + "]\n";
+
+    int k = log2_exact(d < 0 ? 0 - uint64_t(d) : uint64_t(d));
+    if (k > 0) {
+      // rdx = x < 0 ? 2^k - 1 : 0
+      load(target, x);
+      emit("mov", "rdx", target);
+      if (k > 1)
+        emit("sar", "rdx", "63");
+      emit("shr", "rdx", to_string(64 - k));
+      if (remainder) {
+        // x - ((x + bias) with its low k bits cleared)
+        emit("add", "rdx", target);
+        if (k <= 31) {
+          emit("and", "rdx", to_string(-(int64_t(1) << k)));
         } else {
-          out += "  mov rax, [rbp - " + std::to_string(var.rbp_offset) + "]\n";
-        }
-        if (result_label && var.type == VarType::STRING) {
-          *result_label = var.string_label;
+          emit("shr", "rdx", to_string(k));
+          emit("shl", "rdx", to_string(k));
         }
-        return;
+        emit("sub", target, "rdx");
+      } else {
+        emit("add", target, "rdx");
+        emit("sar", target, to_string(k));
+        if (d < 0)
+          emit("neg", target);
+      }
+      store(instr.dst, target);
+      return true;
+    }
+
+    MagicNumber magic = magic_number(d);
+    string dividend = location(x.id);
+    emit("mov", "rax", to_string(magic.multiplier));
+    emit("imul", dividend);
+    if (d > 0 && magic.multiplier < 0)
+      emit("add", "rdx", dividend);
+    else if (d < 0 && magic.multiplier > 0)
+      emit("sub", "rdx", dividend);
+    if (magic.shift > 0)
+      emit("sar", "rdx", to_string(magic.shift));
+    // Add one to a negative quotient to round it towards zero
+    if (remainder) {
+      emit("mov", "rax", "rdx");
+      emit("shr", "rax", "63");
+      emit("add", "rdx", "rax");
+      if (fits_imm32(d)) {
+        emit("imul", "rdx", "rdx", to_string(d));
+      } else {
+        emit("mov", "rax", to_string(d));
+        emit("imul", "rdx", "rax");
       }
+      load(target, x);
+      emit("sub", target, "rdx");
+    } else {
+      emit("mov", target, "rdx");
+      emit("shr", target, "63");
+      emit("add", target, "rdx");
     }
+    store(instr.dst, target);
+    return true;
   }
-}
 
-void handle_stmt(string &out, Stmt *stmt, Var_table &var_table,
-                 Data_table &data_table, Function_table &func_table,
-                 CodegenContext &ctx);
+  void jump_to(BlockId from, BlockId to) {
+    if (to != from + 1)
+      emit("jmp", block_label(to));
+  }
 
-void handle_expr_stmt(string &out, ExprStmt *s, Var_table &var_table,
-                      Data_table &data_table, Function_table &func_table) {
-  handle_expr(out, s->expression.get(), var_table, data_table, func_table,
-              nullptr);
-}
+  // Move the phi arguments for the edge from -> to into the phis'
+  // locations. The moves happen in parallel: a move is only done once no
+  // other pending move still reads its destination, and a cycle is broken
+  // by parking one destination's old value in rcx.
+  void emit_phi_moves(BlockId from, BlockId to) {
+    const Block &target = func.blocks[to];
+    size_t pred = 0;
+    while (target.preds[pred] != from)
+      pred++;
+
+    struct Move {
+      string dst;
+      Operand src;
+      bool parked; // src has been moved to rcx
+    };
+    vector<Move> moves;
+    for (const Instr &phi : target.instrs) {
+      if (phi.op != Opcode::Phi)
+        break;
+      const Operand &arg = phi.args[pred];
+      string dst = location(phi.dst);
+      if (!(arg.isValue() && location(arg.id) == dst))
+        moves.push_back({dst, arg, false});
+    }
 
-void handle_stmt(string &out, Stmt *stmt, Var_table &var_table,
-                 Data_table &data_table, Function_table &func_table,
-                 CodegenContext &ctx) {
-  if (auto expr_stmt = dynamic_cast<ExprStmt *>(stmt)) {
-    handle_expr_stmt(out, expr_stmt, var_table, data_table, func_table);
-  } else if (auto var_decl = dynamic_cast<VarDeclStmt *>(stmt)) {
-    if (var_decl->initializer) {
-      string result_label;
-      handle_expr(out, var_decl->initializer.get(), var_table, data_table,
-                  func_table, &result_label);
-
-      // Add variable to table FIRST to calculate correct offset
-      // Count only local variables (non-parameters) for offset calculation
-      int local_var_count = 0;
-      for (const auto &v : var_table.table) {
-        if (!v.is_param)
-          local_var_count++;
+    auto reads = [&](const Move &m, const string &where) {
+      return !m.parked && m.src.isValue() && location(m.src.id) == where;
+    };
+    while (!moves.empty()) {
+      size_t ready = moves.size();
+      for (size_t i = 0; i < moves.size() && ready == moves.size(); i++) {
+        bool blocked = false;
+        for (size_t j = 0; j < moves.size(); j++)
+          if (j != i && reads(moves[j], moves[i].dst))
+            blocked = true;
+        if (!blocked)
+          ready = i;
       }
+      if (ready == moves.size()) {
+        string parked = moves[0].dst;
+        emit("mov", "rcx", parked);
+        for (Move &m : moves)
+          if (reads(m, parked))
+            m.parked = true;
+        continue;
+      }
+      const Move &m = moves[ready];
+      if (m.parked)
+        emit("mov", m.dst, "rcx");
+      else
+        move(m.dst, m.src);
+      moves.erase(moves.begin() + ready);
+    }
+  }
 
-      Variable var;
-      var.name = var_decl->name;
-      var.rbp_offset = (local_var_count + 1) * 8;
-      var.size = 8; // Assuming 64-bit values for now
-      var.value = nullptr;
-      var.type = get_expr_type(var_decl->initializer.get(), var_table);
-      var.string_label = result_label;
-      var.is_param = false;
-      var_table.table.push_back(var);
-
-      // Store result at fixed offset (don't use push as it's affected by rsp
-      // changes)
-      out += "  mov [rbp - " + std::to_string(var.rbp_offset) + "], rax\n";
+  void emit_instr(BlockId b, const Block &block, size_t index) {
+    const Instr &instr = block.instrs[index];
+    switch (instr.op) {
+    case Opcode::Phi:
+      break; // filled in by the predecessors
+    case Opcode::Copy:
+      move(location(instr.dst), instr.args[0]);
+      break;
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::Mul:
+      emit_arithmetic(instr);
+      break;
+    case Opcode::Div:
+    case Opcode::Mod: {
+      if (options.strength_reduction && instr.args[1].isImm() &&
+          emit_constant_division(instr))
+        break;
+      load("rax", instr.args[0]);
+      const Operand &divisor = instr.args[1];
+      if (!divisor.isValue())
+        load("rcx", divisor);
+      emit("cqo");
+      emit("idiv", divisor.isValue() ? location(divisor.id) : "rcx");
+      store(instr.dst, instr.op == Opcode::Div ? "rax" : "rdx");
+      break;
+    }
+    case Opcode::Neg: {
+      string dst = location(instr.dst);
+      string target = is_memory(dst) ? "rax" : dst;
+      load(target, instr.args[0]);
+      emit("neg", target);
+      store(instr.dst, target);
+      break;
     }
-  } else if (auto assign = dynamic_cast<AssignStmt *>(stmt)) {
-    handle_expr(out, assign->value.get(), var_table, data_table, func_table,
-                nullptr);
-
-    for (const auto &var : var_table.table) {
-      if (var.name == assign->name) {
-        if (var.is_param) {
-          out += "  mov [rbp + " + std::to_string(var.rbp_offset) + "], rax\n";
+    case Opcode::Not:
+    case Opcode::Test: {
+      string value = in_some_register(instr.args[0], "rax");
+      emit("test", value, value);
+      emit(instr.op == Opcode::Not ? "sete" : "setne", "al");
+      emit("movzx", "eax", "al");
+      store(instr.dst, "rax");
+      break;
+    }
+    case Opcode::Eq:
+    case Opcode::Ne:
+    case Opcode::Lt:
+    case Opcode::Le:
+    case Opcode::Gt:
+    case Opcode::Ge: {
+      string lhs = in_some_register(instr.args[0], "rax");
+      emit("cmp", lhs, source(instr.args[1], "rcx"));
+      // Feed the flags straight into the branch that consumes the result
+      const Instr &next = block.instrs[index + 1];
+      if (next.op == Opcode::Branch && next.args[0].isValue() &&
+          next.args[0].id == instr.dst && uses[instr.dst] == 1) {
+        fused_compare = &instr;
+        break;
+      }
+      emit("set" + string(condition_code(instr.op)), "al");
+      emit("movzx", "eax", "al");
+      store(instr.dst, "rax");
+      break;
+    }
+    case Opcode::Param: {
+      string dst = location(instr.dst);
+      string target = is_memory(dst) ? "rax" : dst;
+      emit("mov", target,
+           memory(16 + 8 * static_cast<int32_t>(instr.args[0].imm)));
+      store(instr.dst, target);
+      break;
+    }
+    case Opcode::Call:
+      if (jumps_to_callee(block, index)) {
+        emit_tail_call(instr);
+        break;
+      }
+      // Arguments are pushed right to left and popped by the caller
+      for (size_t i = instr.args.size(); i-- > 0;) {
+        const Operand &arg = instr.args[i];
+        if (arg.isValue()) {
+          emit("push", location(arg.id));
+        } else if (arg.isImm() && fits_imm32(arg.imm)) {
+          emit("push", to_string(arg.imm));
         } else {
-          out += "  mov [rbp - " + std::to_string(var.rbp_offset) + "], rax\n";
+          load("rax", arg);
+          emit("push", "rax");
         }
-        return;
       }
+      emit("call", module.functions[instr.callee].label);
+      if (!instr.args.empty())
+        emit("add", "rsp", to_string(instr.args.size() * 8));
+      store(instr.dst, "rax");
+      break;
+    case Opcode::Print:
+      // write(1, s, strlen(s)); the length is found with repne scasb
+      load("rdi", instr.args[0]);
+      emit("mov", "rsi", "rdi");
+      emit("xor", "eax", "eax");
+      emit("mov", "rcx", "-1");
+      emit("repne scasb");
+      emit("not", "rcx");
+      emit("dec", "rcx");
+      emit("mov", "rdx", "rcx");
+      emit("mov", "eax", "1");
+      emit("mov", "edi", "1");
+      emit("syscall");
+      break;
+    case Opcode::Jump: {
+      BlockId to = instr.targets[0];
+      emit_phi_moves(b, to);
+      jump_to(b, to);
+      break;
     }
-  } else if (auto block = dynamic_cast<BlockStmt *>(stmt)) {
-    for (const auto &s : block->statements) {
-      handle_stmt(out, s.get(), var_table, data_table, func_table, ctx);
+    case Opcode::Branch:
+      emit_branch(b, instr);
+      break;
+    case Opcode::Return:
+      if (func.isMain) {
+        load("rdi", instr.args[0]);
+        emit("mov", "eax", "60");
+        emit("syscall");
+      } else if (!(index > 0 && jumps_to_callee(block, index - 1))) {
+        load("rax", instr.args[0]);
+        leave_frame();
+        emit("ret");
+      }
+      break;
     }
-  } else if (auto if_stmt = dynamic_cast<IfStmt *>(stmt)) {
-    string else_label = ctx.generate_label("else");
-    string end_label = ctx.generate_label("endif");
-
-    handle_expr(out, if_stmt->condition.get(), var_table, data_table,
-                func_table, nullptr);
+  }
 
-    out += "  test rax, rax\n";
-    if (if_stmt->elseBranch) {
-      out += "  jz " + else_label + "\n";
+  // Restore the callee-saved registers, rsp and rbp of the caller
+  void leave_frame() {
+    if (saved.empty()) {
+      emit("mov", "rsp", "rbp");
     } else {
-      out += "  jz " + end_label + "\n";
+      emit("lea", "rsp", "[rbp - " + to_string(8 * saved.size()) + "]");
+      for (size_t i = saved.size(); i-- > 0;)
+        emit("pop", saved[i]);
     }
+    emit("pop", "rbp");
+  }
 
-    handle_stmt(out, if_stmt->thenBranch.get(), var_table, data_table,
-                func_table, ctx);
+  // Whether block.instrs[index] is a tail call emitted as a jump, which
+  // makes the return after it unreachable
+  bool jumps_to_callee(const Block &block, size_t index) const {
+    return !func.isMain && isTailCall(block, index) &&
+           block.instrs[index].args.size() <= func.paramCount;
+  }
 
-    if (if_stmt->elseBranch) {
-      out += "  jmp " + end_label + "\n";
-      out += else_label + ":\n";
-      handle_stmt(out, if_stmt->elseBranch.get(), var_table, data_table,
-                  func_table, ctx);
+  // return f(args) as a jump: the arguments overwrite this function's own
+  // (there are at least as many slots, and the caller pops them all), the
+  // frame is left, and f returns straight to our caller. Parameters were
+  // loaded out of those slots in the entry block, so nothing live is lost.
+  void emit_tail_call(const Instr &call) {
+    for (size_t i = 0; i < call.args.size(); i++)
+      move(memory(16 + 8 * static_cast<int32_t>(i)), call.args[i]);
+    leave_frame();
+    emit("jmp", module.functions[call.callee].label);
+  }
+
+  // Critical edges are split before emission, so the targets of a branch
+  // never have phis to fill
+  void emit_branch(BlockId b, const Instr &instr) {
+    BlockId if_true = instr.targets[0];
+    BlockId if_false = instr.targets[1];
+    for (BlockId target : instr.targets)
+      if (func.blocks[target].instrs.front().op == Opcode::Phi)
+        throw logic_error("branch into a block with phis in " + func.label +
+                          ": critical edges must be split first");
+    const Operand &cond = instr.args[0];
+    if (!cond.isValue()) {
+      bool taken = cond.isStr() || cond.imm != 0;
+      jump_to(b, taken ? if_true : if_false);
+      return;
     }
 
-    out += end_label + ":\n";
-  } else if (auto while_stmt = dynamic_cast<WhileStmt *>(stmt)) {
-    string loop_start = ctx.generate_label("while_start");
-    string loop_end = ctx.generate_label("while_end");
-
-    // Loop start
-    out += loop_start + ":\n";
-
-    // Evaluate condition
-    handle_expr(out, while_stmt->condition.get(), var_table, data_table,
-                func_table, nullptr);
-
-    // Test if condition is false (0)
-    out += "  test rax, rax\n";
-    out += "  jz " + loop_end + "\n";
-
-    // Loop body
-    handle_stmt(out, while_stmt->body.get(), var_table, data_table, func_table,
-                ctx);
-
-    // Jump back to start
-    out += "  jmp " + loop_start + "\n";
-
-    // Loop end
-    out += loop_end + ":\n";
-  } else if (auto return_stmt = dynamic_cast<ReturnStmt *>(stmt)) {
-    // return expr;
-    if (return_stmt->value) {
-      handle_expr(out, return_stmt->value.get(), var_table, data_table,
-                  func_table, nullptr);
-      // Result is in rax (return value)
+    const char *jump_if_true = "nz";
+    const char *jump_if_false = "z";
+    if (fused_compare) {
+      jump_if_true = condition_code(fused_compare->op);
+      jump_if_false = negated_condition_code(fused_compare->op);
+      fused_compare = nullptr;
+    } else if (in_register(cond)) {
+      emit("test", location(cond.id), location(cond.id));
     } else {
-      out += "  xor rax, rax\n"; // Return 0
+      emit("cmp", location(cond.id), "0");
     }
 
-    if (ctx.in_function) {
-      // Return from function
-      out += "  mov rsp, rbp\n";
-      out += "  pop rbp\n";
-      out += "  ret\n";
+    if (if_false == b + 1) {
+      emit("j" + string(jump_if_true), block_label(if_true));
     } else {
-      // Exit from main
-      out += "  mov rdi, rax\n"; // Move return value to exit code
-      out += "  mov rsp, rbp\n";
-      out += "  pop rbp\n";
-      out += "  mov rax, 60\n";
-      out += "  syscall\n";
+      emit("j" + string(jump_if_false), block_label(if_false));
+      jump_to(b, if_true);
     }
   }
-}
+};
 
-// Generate assembly code for a function definition
-string generate_function(FunctionDef *func_def, Data_table &data_table,
-                         Function_table &func_table, CodegenContext &ctx) {
-  string out;
-
-  // Generate function label
-  string func_label = ctx.generate_function_label(func_def->name);
-  out += func_label + ":\n";
-
-  // Function prologue
-  out += "  push rbp\n";
-  out += "  mov rbp, rsp\n";
-
-  // Count local variables in function to allocate stack space
-  int local_var_count = 0;
-  std::function<void(Stmt *)> count_vars = [&](Stmt *stmt) {
-    if (auto var_decl = dynamic_cast<VarDeclStmt *>(stmt)) {
-      local_var_count++;
-    } else if (auto block = dynamic_cast<BlockStmt *>(stmt)) {
-      for (const auto &s : block->statements) {
-        count_vars(s.get());
-      }
-    } else if (auto if_stmt = dynamic_cast<IfStmt *>(stmt)) {
-      count_vars(if_stmt->thenBranch.get());
-      if (if_stmt->elseBranch) {
-        count_vars(if_stmt->elseBranch.get());
-      }
-    } else if (auto while_stmt = dynamic_cast<WhileStmt *>(stmt)) {
-      count_vars(while_stmt->body.get());
+// db operands for bytes: printable runs as quoted strings, characters NASM
+// can't take inside quotes as byte values
+string db_operands(const string &bytes) {
+  string data;
+  bool in_string = false;
+  bool first_part = true;
+
+  for (char c : bytes) {
+    bool is_special = false;
+    int byte_val = 0;
+
+    // Check for special characters that need to be output as byte values
+    switch (c) {
+    case '\n':
+      is_special = true;
+      byte_val = 10;
+      break;
+    case '\t':
+      is_special = true;
+      byte_val = 9;
+      break;
+    case '\r':
+      is_special = true;
+      byte_val = 13;
+      break;
+    case '\"':
+      is_special = true;
+      byte_val = 34;
+      break;
+    case '\\':
+      is_special = true;
+      byte_val = 92;
+      break;
+    default:
+      break;
     }
-  };
-  count_vars(func_def->body.get());
-
-  // Allocate stack space for local variables
-  if (local_var_count > 0) {
-    out += "  sub rsp, " + to_string(local_var_count * 8) + "\n";
-  }
-
-  // Create a new variable table for this function's scope
-  Var_table local_var_table;
-
-  // Add parameters to the variable table
-  // Parameters are at [rbp + 16], [rbp + 24], etc. (after return addr and saved
-  // rbp)
-  for (size_t i = 0; i < func_def->parameters.size(); i++) {
-    Variable param_var;
-    param_var.name = func_def->parameters[i].name;
-    param_var.rbp_offset =
-        16 + i * 8; // Positive offset for parameters above rbp
-    param_var.size = 8;
-    param_var.value = nullptr;
-    param_var.type = VarType::INT; // Default to INT for now
-    param_var.string_label = "";
-    param_var.is_param = true; // Mark as parameter
-    local_var_table.table.push_back(param_var);
-  }
-
-  // Set context to indicate we're in a function
-  bool prev_in_function = ctx.in_function;
-  ctx.in_function = true;
-
-  // Generate function body
-  handle_stmt(out, func_def->body.get(), local_var_table, data_table,
-              func_table, ctx);
-
-  // Restore context
-  ctx.in_function = prev_in_function;
-
-  // Function epilogue (in case there's no explicit return)
-  out += "  xor rax, rax\n"; // Default return value 0
-  out += "  mov rsp, rbp\n";
-  out += "  pop rbp\n";
-  out += "  ret\n";
-  out += "\n";
-
-  return out;
-}
-
-string generate_data_header(const Data_table &data_table) {
-  if (data_table.strings.empty()) {
-    return "";
-  }
 
-  string data = "\nsection .data\n";
-  for (const auto &str : data_table.strings) {
-    // Format: label: db parts separated by escape sequences
-    data += "  " + str.label + ": db ";
-    
-    // Handle empty strings specially
-    if (str.value.empty()) {
-      data += "0\n";
-      data += "  " + str.label + "_len equ 0\n";
-      continue;
-    }
-    
-    bool in_string = false;
-    bool first_part = true;
-    
-    for (char c : str.value) {
-      bool is_special = false;
-      int byte_val = 0;
-      
-      // Check for special characters that need to be output as byte values
-      switch (c) {
-      case '\n':
-        is_special = true;
-        byte_val = 10;
-        break;
-      case '\t':
-        is_special = true;
-        byte_val = 9;
-        break;
-      case '\r':
-        is_special = true;
-        byte_val = 13;
-        break;
-      case '\"':
-        is_special = true;
-        byte_val = 34;
-        break;
-      case '\\':
-        is_special = true;
-        byte_val = 92;
-        break;
-      default:
-        break;
+    if (is_special) {
+      // Close current string if open
+      if (in_string) {
+        data += "\"";
+        in_string = false;
       }
-      
-      if (is_special) {
-        // Close current string if open
-        if (in_string) {
-          data += "\"";
-          in_string = false;
-        }
-        // Add comma separator if not first part
+      // Add comma separator if not first part
+      if (!first_part) {
+        data += ", ";
+      }
+      // Add the numeric byte value
+      data += to_string(byte_val);
+      first_part = false;
+    } else {
+      // Regular character - add to string
+      if (!in_string) {
+        // Open new string part
         if (!first_part) {
           data += ", ";
         }
-        // Add the numeric byte value
-        data += to_string(byte_val);
+        data += "\"";
+        in_string = true;
         first_part = false;
-      } else {
-        // Regular character - add to string
-        if (!in_string) {
-          // Open new string part
-          if (!first_part) {
-            data += ", ";
-          }
-          data += "\"";
-          in_string = true;
-          first_part = false;
-        }
-        // Add regular character
-        data += c;
       }
+      // Add regular character
+      data += c;
     }
-    
-    // Close string if still open
-    if (in_string) {
-      data += "\"";
-    }
-    
-    // Add null terminator
-    data += ", 0\n";
-    data += "  " + str.label + "_len equ $ - " + str.label + " - 1\n";
+  }
+
+  // Close string if still open
+  if (in_string) {
+    data += "\"";
   }
   return data;
 }
 
-string generate_asm_program(const Program &program, Var_table &var_table,
-                            Data_table &data_table, Function_table &func_table,
-                            CodegenContext &ctx) {
-  string out;
-  string functions_code;
-
-  // First pass: collect function definitions and generate their code
-  for (const auto &stmt : program.statements) {
-    if (auto func_def = dynamic_cast<FunctionDef *>(stmt.get())) {
-      // Add function to function table
-      vector<CodegenFunctionParam> params;
-      for (const auto &param : func_def->parameters) {
-        CodegenFunctionParam cgParam;
-        cgParam.name = param.name;
-        cgParam.type = VarType::INT; // Default to INT for now
-        cgParam.isConst = param.isConst;
-        params.push_back(cgParam);
-      }
-      string func_label = ctx.generate_function_label(func_def->name);
-      func_table.add_function(func_def->name, func_label, params, VarType::INT);
-
-      // Generate function code
-      functions_code +=
-          generate_function(func_def, data_table, func_table, ctx);
-    }
+string generate_data_header(const Data_table &data_table) {
+  // Only strings that emitted code refers to are written out
+  vector<const StringData *> used;
+  for (const auto &str : data_table.strings) {
+    if (str.references > 0)
+      used.push_back(&str);
+  }
+  if (used.empty()) {
+    return "";
   }
 
-  // Count local variables in main to allocate stack space
-  int local_var_count = 0;
-  std::function<void(Stmt *)> count_vars = [&](Stmt *stmt) {
-    if (auto var_decl = dynamic_cast<VarDeclStmt *>(stmt)) {
-      local_var_count++;
-    } else if (auto block = dynamic_cast<BlockStmt *>(stmt)) {
-      for (const auto &s : block->statements) {
-        count_vars(s.get());
-      }
-    } else if (auto if_stmt = dynamic_cast<IfStmt *>(stmt)) {
-      count_vars(if_stmt->thenBranch.get());
-      if (if_stmt->elseBranch) {
-        count_vars(if_stmt->elseBranch.get());
-      }
-    } else if (auto while_stmt = dynamic_cast<WhileStmt *>(stmt)) {
-      count_vars(while_stmt->body.get());
-    }
+  // Suffix sharing. Sorted by reversed content, descending, every string
+  // that is a suffix of another comes right after one of the strings it is
+  // a suffix of, so comparing against the last owner is enough.
+  sort(used.begin(), used.end(),
+       [](const StringData *a, const StringData *b) {
+         return lexicographical_compare(b->value.rbegin(), b->value.rend(),
+                                        a->value.rbegin(), a->value.rend());
+       });
+  struct Storage {
+    const StringData *owner;
+    vector<const StringData *> suffixes; // longest first
   };
-
-  for (const auto &stmt : program.statements) {
-    if (!dynamic_cast<FunctionDef *>(stmt.get())) {
-      count_vars(stmt.get());
+  vector<Storage> storage;
+  for (const StringData *str : used) {
+    if (!storage.empty()) {
+      const string &owner = storage.back().owner->value;
+      if (str->length < owner.size() &&
+          owner.compare(owner.size() - str->length, str->length,
+                        str->value) == 0) {
+        storage.back().suffixes.push_back(str);
+        continue;
+      }
     }
+    storage.push_back({str, {}});
   }
+  sort(storage.begin(), storage.end(), [](const Storage &a, const Storage &b) {
+    return a.owner->id < b.owner->id;
+  });
 
-  // Generate main code (_start)
-  // Set up stack frame for main
-  out += "  push rbp\n";
-  out += "  mov rbp, rsp\n";
-
-  // Allocate stack space for local variables
-  if (local_var_count > 0) {
-    out += "  sub rsp, " + to_string(local_var_count * 8) + "\n";
-  }
-
-  // Second pass: generate code for non-function statements (main code)
-  for (const auto &stmt : program.statements) {
-    if (!dynamic_cast<FunctionDef *>(stmt.get())) {
-      handle_stmt(out, stmt.get(), var_table, data_table, func_table, ctx);
+  string data = "\nsection .data\n";
+  for (const Storage &entry : storage) {
+    // Format: label: db parts separated by escape sequences. A suffix's
+    // label is placed inside the owner's bytes where the suffix starts.
+    const string &value = entry.owner->value;
+    string label = entry.owner->label;
+    size_t pos = 0;
+    for (const StringData *suffix : entry.suffixes) {
+      size_t start = value.size() - suffix->length;
+      data += "  " + label + ": db " +
+              db_operands(value.substr(pos, start - pos)) + "\n";
+      label = suffix->label;
+      pos = start;
+    }
+    string rest = db_operands(value.substr(pos));
+    // Add null terminator
+    data += "  " + label + ": db " + (rest.empty() ? "0" : rest + ", 0") +
+            "\n";
+
+    data += "  " + entry.owner->label + "_len equ " +
+            to_string(entry.owner->length) + "\n";
+    for (const StringData *suffix : entry.suffixes) {
+      data += "  " + suffix->label + "_len equ " + to_string(suffix->length) +
+              "\n";
     }
   }
+  return data;
+}
 
-  // Clean up and exit (return last variable's value if any)
-  if (!var_table.table.empty()) {
-    const auto &last_var = var_table.table.back();
-    if (last_var.is_param) {
-      out += "  mov rdi, [rbp + " + std::to_string(last_var.rbp_offset) + "]\n";
-    } else {
-      out += "  mov rdi, [rbp - " + std::to_string(last_var.rbp_offset) + "]\n";
+void write_lines(std::ostream &out, const vector<AsmLine> &code) {
+  for (const AsmLine &line : code) {
+    if (line.kind == AsmLine::Label) {
+      out << line.op << ":\n";
+      continue;
     }
-  } else {
-    out += "  xor rdi, rdi\n";
+    out << "  " << line.op;
+    for (size_t i = 0; i < line.args.size(); i++)
+      out << (i == 0 ? " " : ", ") << line.args[i];
+    out << "\n";
   }
-  out += "  mov rsp, rbp\n";
-  out += "  pop rbp\n";
-  out += "  mov rax, 60\n";
-  out += "  syscall\n";
-
-  // Append function code after main
-  out += "\n" + functions_code;
-
-  return out;
 }
 
-void ast_to_bin(std::ostream &out, const Program &program) {
-  Var_table var_table;
+void ir_to_bin(std::ostream &out, const ir::Module &module,
+               const CodegenOptions &options) {
   Data_table data_table;
-  Function_table func_table;
-  CodegenContext ctx;
-
-  string code =
-      generate_asm_program(program, var_table, data_table, func_table, ctx);
-
-  out << generate_asm_headers();
-  out << code;
+  vector<string> string_labels(module.strings.size());
+
+  // The top-level code comes first, as _start, then every function
+  out << "global _start\n\nsection .text\n";
+  for (const Function &func : module.functions) {
+    vector<AsmLine> code;
+    FunctionEmitter(module, func, options, data_table, string_labels, code)
+        .emit();
+    peephole(code, options.peephole_hits);
+    write_lines(out, code);
+    out << "\n";
+  }
   out << generate_data_header(data_table);
 }
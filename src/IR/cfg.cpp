@@ -0,0 +1,201 @@
+#include "pass.hpp"
+#include <algorithm>
+
+namespace ir {
+namespace {
+
+bool hasPhis(const Block &block) {
+  return block.instrs.front().op == Opcode::Phi;
+}
+
+// Branches on a known condition, or to the same block both ways, become
+// jumps
+bool foldBranches(Function &func) {
+  bool changed = false;
+  for (BlockId b = 0; b < func.blocks.size(); b++) {
+    Instr &term = func.blocks[b].terminator();
+    if (term.op != Opcode::Branch)
+      continue;
+    const Operand &cond = term.args[0];
+    BlockId taken;
+    if (term.targets[0] == term.targets[1]) {
+      taken = term.targets[0];
+    } else if (!cond.isValue()) {
+      taken = cond.isStr() || cond.imm != 0 ? term.targets[0]
+                                            : term.targets[1];
+    } else {
+      continue;
+    }
+    // Drop the edge that is no longer taken (one of two equal edges when
+    // both targets are the same)
+    BlockId dropped = taken == term.targets[0] ? term.targets[1]
+                                               : term.targets[0];
+    term.op = Opcode::Jump;
+    term.args.clear();
+    term.targets[0] = taken;
+    term.targets[1] = NO_BLOCK;
+    removeEdge(func, b, dropped);
+    changed = true;
+  }
+  return changed;
+}
+
+// A block whose only predecessor jumps straight to it is appended to that
+// predecessor
+bool mergeChains(Function &func) {
+  bool changed = false;
+  std::vector<Operand> replacement(func.valueCount);
+  for (BlockId b = 0; b < func.blocks.size(); b++) {
+    while (true) {
+      Block &block = func.blocks[b];
+      const Instr &term = block.terminator();
+      if (term.op != Opcode::Jump)
+        break;
+      BlockId next = term.targets[0];
+      if (next == b || next == 0 || func.blocks[next].preds.size() != 1)
+        break;
+
+      Block &tail = func.blocks[next];
+      block.instrs.pop_back();
+      for (Instr &instr : tail.instrs) {
+        if (instr.op == Opcode::Phi)
+          replacement[instr.dst] = instr.args[0]; // single predecessor
+        else
+          block.instrs.push_back(std::move(instr));
+      }
+      for (BlockId succ : successors(block))
+        for (BlockId &pred : func.blocks[succ].preds)
+          if (pred == next)
+            pred = b;
+
+      // Leave the merged block unreachable, to be dropped
+      tail.preds.clear();
+      tail.instrs.clear();
+      Instr ret(Opcode::Return);
+      ret.args = {Operand::constant(0)};
+      tail.instrs.push_back(std::move(ret));
+      changed = true;
+    }
+  }
+  if (changed) {
+    replaceValues(func, replacement);
+    removeUnreachableBlocks(func);
+  }
+  return changed;
+}
+
+// Predecessors of a block holding nothing but a jump go straight to its
+// target instead
+bool bypassEmptyBlocks(Function &func) {
+  bool changed = false;
+  for (BlockId b = 1; b < func.blocks.size(); b++) {
+    Block &block = func.blocks[b];
+    if (block.instrs.size() != 1 || block.terminator().op != Opcode::Jump)
+      continue;
+    BlockId target = block.terminator().targets[0];
+    if (target == b)
+      continue;
+
+    std::vector<BlockId> preds = block.preds;
+    for (BlockId pred : preds) {
+      Block &dest = func.blocks[target];
+      size_t from = std::find(dest.preds.begin(), dest.preds.end(), b) -
+                    dest.preds.begin();
+      // An edge that already exists can't carry different phi arguments.
+      // With the same ones the branch ends up going one way both times, and
+      // foldBranches turns it into a jump.
+      auto existing = std::find(dest.preds.begin(), dest.preds.end(), pred);
+      if (existing != dest.preds.end()) {
+        size_t other = existing - dest.preds.begin();
+        bool same = true;
+        for (const Instr &phi : dest.instrs) {
+          if (phi.op != Opcode::Phi)
+            break;
+          same &= phi.args[from] == phi.args[other];
+        }
+        if (!same)
+          continue;
+      }
+      for (Instr &phi : dest.instrs) {
+        if (phi.op != Opcode::Phi)
+          break;
+        phi.args.push_back(phi.args[from]);
+      }
+      dest.preds.push_back(pred);
+
+      for (BlockId &t : func.blocks[pred].terminator().targets)
+        if (t == b)
+          t = target;
+      auto &own = func.blocks[b].preds;
+      own.erase(std::find(own.begin(), own.end(), pred));
+      changed = true;
+    }
+    if (func.blocks[b].preds.empty())
+      removeEdge(func, b, target);
+  }
+  if (changed)
+    removeUnreachableBlocks(func);
+  return changed;
+}
+
+bool simplifyCfg(Module &module, PassContext &) {
+  bool changed = false;
+  for (Function &func : module.functions) {
+    bool round = true;
+    while (round) {
+      round = foldBranches(func);
+      round |= removeUnreachableBlocks(func);
+      round |= mergeChains(func);
+      round |= bypassEmptyBlocks(func);
+      changed |= round;
+    }
+  }
+  return changed;
+}
+
+bool splitCriticalEdges(Module &module, PassContext &) {
+  bool changed = false;
+  for (Function &func : module.functions) {
+    BlockId count = static_cast<BlockId>(func.blocks.size());
+    std::vector<std::vector<BlockId>> splitsAfter(count);
+    for (BlockId b = 0; b < count; b++) {
+      if (func.blocks[b].terminator().op != Opcode::Branch)
+        continue;
+      for (int k = 0; k < 2; k++) {
+        BlockId target = func.blocks[b].terminator().targets[k];
+        if (!hasPhis(func.blocks[target]) ||
+            func.blocks[target].preds.size() < 2)
+          continue;
+        BlockId split = func.newBlock();
+        Block &middle = func.blocks[split];
+        Instr jump(Opcode::Jump);
+        jump.targets[0] = target;
+        middle.instrs.push_back(std::move(jump));
+        middle.preds = {b};
+        auto &preds = func.blocks[target].preds;
+        *std::find(preds.begin(), preds.end(), b) = split;
+        func.blocks[b].terminator().targets[k] = split;
+        splitsAfter[b].push_back(split);
+      }
+    }
+    if (func.blocks.size() == count)
+      continue;
+    // Each new block goes right after the branch it hangs off
+    std::vector<BlockId> order;
+    for (BlockId b = 0; b < count; b++) {
+      order.push_back(b);
+      order.insert(order.end(), splitsAfter[b].begin(), splitsAfter[b].end());
+    }
+    reorderBlocks(func, order);
+    changed = true;
+  }
+  return changed;
+}
+
+} // namespace
+
+const Pass simplifyCfgPass = {"simplify-cfg", simplifyCfg};
+const Pass splitCriticalEdgesPass = {"split-critical-edges",
+                                     splitCriticalEdges};
+
+} // namespace ir
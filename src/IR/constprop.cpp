@@ -0,0 +1,288 @@
+#include "pass.hpp"
+#include <algorithm>
+#include <set>
+
+namespace ir {
+namespace {
+
+// Sparse conditional constant propagation (Wegman & Zadeck, "Constant
+// Propagation with Conditional Branches", TOPLAS 1991). Values start
+// Unknown and only move down to Constant and then Varying; blocks are only
+// evaluated once an executable edge reaches them, so a branch on a constant
+// keeps the values on its dead side from spoiling the phis below it.
+struct Lattice {
+  enum State : uint8_t { Unknown, Constant, Varying };
+  State state = Unknown;
+  Operand constant; // Imm or Str
+};
+
+// Evaluate an instruction over integer operands the way the backend would.
+// Division by zero and the one overflowing division stay at run time.
+bool evaluate(Opcode op, const std::vector<int64_t> &a, int64_t &result) {
+  auto wrap = [](uint64_t v) { return static_cast<int64_t>(v); };
+  switch (op) {
+  case Opcode::Copy:
+    result = a[0];
+    return true;
+  case Opcode::Add:
+    result = wrap(uint64_t(a[0]) + uint64_t(a[1]));
+    return true;
+  case Opcode::Sub:
+    result = wrap(uint64_t(a[0]) - uint64_t(a[1]));
+    return true;
+  case Opcode::Mul:
+    result = wrap(uint64_t(a[0]) * uint64_t(a[1]));
+    return true;
+  case Opcode::Div:
+  case Opcode::Mod:
+    if (a[1] == 0 || (a[0] == INT64_MIN && a[1] == -1))
+      return false;
+    result = op == Opcode::Div ? a[0] / a[1] : a[0] % a[1];
+    return true;
+  case Opcode::Neg:
+    result = wrap(0 - uint64_t(a[0]));
+    return true;
+  case Opcode::Not:
+    result = a[0] == 0;
+    return true;
+  case Opcode::Test:
+    result = a[0] != 0;
+    return true;
+  case Opcode::Eq:
+    result = a[0] == a[1];
+    return true;
+  case Opcode::Ne:
+    result = a[0] != a[1];
+    return true;
+  case Opcode::Lt:
+    result = a[0] < a[1];
+    return true;
+  case Opcode::Le:
+    result = a[0] <= a[1];
+    return true;
+  case Opcode::Gt:
+    result = a[0] > a[1];
+    return true;
+  case Opcode::Ge:
+    result = a[0] >= a[1];
+    return true;
+  default:
+    return false;
+  }
+}
+
+class Propagation {
+public:
+  explicit Propagation(Function &f)
+      : func(f), values(f.valueCount), users(f.valueCount),
+        executable(f.blocks.size(), false) {
+    for (BlockId b = 0; b < func.blocks.size(); b++)
+      for (uint32_t i = 0; i < func.blocks[b].instrs.size(); i++)
+        for (const Operand &arg : func.blocks[b].instrs[i].args)
+          if (arg.isValue())
+            users[arg.id].push_back({b, i});
+  }
+
+  bool run() {
+    solve();
+    return rewrite();
+  }
+
+private:
+  Function &func;
+  std::vector<Lattice> values;
+  std::vector<std::vector<std::pair<BlockId, uint32_t>>> users;
+  std::vector<bool> executable;
+  std::set<std::pair<BlockId, BlockId>> executableEdges;
+  std::vector<std::pair<BlockId, BlockId>> edgeWork;
+  std::vector<ValueId> valueWork;
+
+  Lattice operand(const Operand &op) const {
+    if (op.isValue())
+      return values[op.id];
+    return {Lattice::Constant, op};
+  }
+
+  void lower(ValueId v, const Lattice &to) {
+    Lattice &current = values[v];
+    if (current.state == to.state &&
+        (to.state != Lattice::Constant || current.constant == to.constant))
+      return;
+    current = to;
+    valueWork.push_back(v);
+  }
+
+  void visitEdge(BlockId from, BlockId to) {
+    if (!executableEdges.insert({from, to}).second)
+      return;
+    if (!executable[to]) {
+      executable[to] = true;
+      for (uint32_t i = 0; i < func.blocks[to].instrs.size(); i++)
+        visit(to, i);
+    } else {
+      // Only the phis can see the new edge
+      for (uint32_t i = 0; i < func.blocks[to].instrs.size(); i++) {
+        if (func.blocks[to].instrs[i].op != Opcode::Phi)
+          break;
+        visit(to, i);
+      }
+    }
+  }
+
+  void visit(BlockId b, uint32_t index) {
+    const Block &block = func.blocks[b];
+    const Instr &instr = block.instrs[index];
+    switch (instr.op) {
+    case Opcode::Phi: {
+      Lattice merged;
+      for (size_t k = 0; k < instr.args.size(); k++) {
+        if (!executableEdges.count({block.preds[k], b}))
+          continue;
+        Lattice in = operand(instr.args[k]);
+        if (in.state == Lattice::Unknown)
+          continue;
+        if (in.state == Lattice::Varying ||
+            (merged.state == Lattice::Constant &&
+             merged.constant != in.constant)) {
+          merged.state = Lattice::Varying;
+          break;
+        }
+        merged = in;
+      }
+      lower(instr.dst, merged);
+      return;
+    }
+    case Opcode::Jump:
+      edgeWork.push_back({b, instr.targets[0]});
+      return;
+    case Opcode::Branch: {
+      Lattice cond = operand(instr.args[0]);
+      if (cond.state == Lattice::Unknown)
+        return;
+      if (cond.state == Lattice::Constant) {
+        bool taken = cond.constant.isStr() || cond.constant.imm != 0;
+        edgeWork.push_back({b, instr.targets[taken ? 0 : 1]});
+      } else {
+        edgeWork.push_back({b, instr.targets[0]});
+        edgeWork.push_back({b, instr.targets[1]});
+      }
+      return;
+    }
+    case Opcode::Return:
+    case Opcode::Print:
+      return;
+    case Opcode::Param:
+    case Opcode::Call:
+      lower(instr.dst, {Lattice::Varying, {}});
+      return;
+    default:
+      break;
+    }
+
+    // Copies pass strings through; everything else folds integers only
+    std::vector<int64_t> args;
+    for (const Operand &arg : instr.args) {
+      Lattice in = operand(arg);
+      if (in.state == Lattice::Unknown)
+        return;
+      if (in.state == Lattice::Varying) {
+        lower(instr.dst, {Lattice::Varying, {}});
+        return;
+      }
+      if (in.constant.isStr()) {
+        if (instr.op == Opcode::Copy)
+          lower(instr.dst, in);
+        else
+          lower(instr.dst, {Lattice::Varying, {}});
+        return;
+      }
+      args.push_back(in.constant.imm);
+    }
+    int64_t result;
+    if (evaluate(instr.op, args, result))
+      lower(instr.dst, {Lattice::Constant, Operand::constant(result)});
+    else
+      lower(instr.dst, {Lattice::Varying, {}});
+  }
+
+  void solve() {
+    executable[0] = true;
+    for (uint32_t i = 0; i < func.blocks[0].instrs.size(); i++)
+      visit(0, i);
+    while (!edgeWork.empty() || !valueWork.empty()) {
+      if (!edgeWork.empty()) {
+        auto edge = edgeWork.back();
+        edgeWork.pop_back();
+        visitEdge(edge.first, edge.second);
+        continue;
+      }
+      ValueId v = valueWork.back();
+      valueWork.pop_back();
+      for (auto [b, i] : users[v])
+        if (executable[b])
+          visit(b, i);
+    }
+  }
+
+  // Uses of constants become immediates, their definitions go away, and
+  // branches the solver never saw take one way become jumps
+  bool rewrite() {
+    bool changed = false;
+    std::vector<Operand> replacement(func.valueCount);
+    for (ValueId v = 0; v < func.valueCount; v++) {
+      if (values[v].state == Lattice::Constant) {
+        replacement[v] = values[v].constant;
+        changed = true;
+      }
+    }
+    if (changed) {
+      replaceValues(func, replacement);
+      for (Block &block : func.blocks) {
+        auto &instrs = block.instrs;
+        instrs.erase(std::remove_if(instrs.begin(), instrs.end(),
+                                    [&](const Instr &instr) {
+                                      return instr.dst != NO_VALUE &&
+                                             !hasSideEffects(instr.op) &&
+                                             replacement[instr.dst].kind !=
+                                                 Operand::None;
+                                    }),
+                     instrs.end());
+      }
+    }
+
+    for (BlockId b = 0; b < func.blocks.size(); b++) {
+      Instr &term = func.blocks[b].terminator();
+      if (!executable[b] || term.op != Opcode::Branch)
+        continue;
+      bool live[2] = {executableEdges.count({b, term.targets[0]}) > 0,
+                      executableEdges.count({b, term.targets[1]}) > 0};
+      if (live[0] == live[1] || term.targets[0] == term.targets[1])
+        continue;
+      BlockId taken = term.targets[live[0] ? 0 : 1];
+      BlockId dropped = term.targets[live[0] ? 1 : 0];
+      term.op = Opcode::Jump;
+      term.args.clear();
+      term.targets[0] = taken;
+      term.targets[1] = NO_BLOCK;
+      removeEdge(func, b, dropped);
+      changed = true;
+    }
+    if (removeUnreachableBlocks(func))
+      changed = true;
+    return changed;
+  }
+};
+
+bool propagateConstants(Module &module, PassContext &) {
+  bool changed = false;
+  for (Function &func : module.functions)
+    changed |= Propagation(func).run();
+  return changed;
+}
+
+} // namespace
+
+const Pass constantPropagationPass = {"constant-propagation",
+                                      propagateConstants};
+
+} // namespace ir
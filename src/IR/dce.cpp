@@ -0,0 +1,67 @@
+#include "pass.hpp"
+#include <algorithm>
+
+namespace ir {
+namespace {
+
+// Mark and sweep: calls, prints, terminators and divisions that may trap
+// are needed, and so is every value they read, transitively. Anything else computes a value nobody
+// looks at (a local written but never read, a phi only feeding itself
+// around a loop) and goes.
+bool eliminateDeadCode(Function &func) {
+  std::vector<const Instr *> definition(func.valueCount, nullptr);
+  for (const Block &block : func.blocks)
+    for (const Instr &instr : block.instrs)
+      if (instr.dst != NO_VALUE)
+        definition[instr.dst] = &instr;
+
+  std::vector<bool> live(func.valueCount, false);
+  std::vector<ValueId> work;
+  auto use = [&](const Instr &instr) {
+    for (const Operand &arg : instr.args)
+      if (arg.isValue() && !live[arg.id]) {
+        live[arg.id] = true;
+        work.push_back(arg.id);
+      }
+  };
+  for (const Block &block : func.blocks)
+    for (const Instr &instr : block.instrs)
+      if (hasSideEffects(instr.op) || mayTrap(instr))
+        use(instr);
+  while (!work.empty()) {
+    ValueId v = work.back();
+    work.pop_back();
+    if (definition[v])
+      use(*definition[v]);
+  }
+
+  bool changed = false;
+  for (Block &block : func.blocks) {
+    auto &instrs = block.instrs;
+    auto dead = std::remove_if(instrs.begin(), instrs.end(),
+                               [&](const Instr &instr) {
+                                 return !hasSideEffects(instr.op) &&
+                                        !mayTrap(instr) &&
+                                        instr.dst != NO_VALUE &&
+                                        !live[instr.dst];
+                               });
+    if (dead != instrs.end()) {
+      instrs.erase(dead, instrs.end());
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool eliminateDeadCode(Module &module, PassContext &) {
+  bool changed = false;
+  for (Function &func : module.functions)
+    changed |= eliminateDeadCode(func);
+  return changed;
+}
+
+} // namespace
+
+const Pass deadCodePass = {"dead-code", eliminateDeadCode};
+
+} // namespace ir
@@ -0,0 +1,53 @@
+#include "pass.hpp"
+#include <algorithm>
+
+namespace ir {
+namespace {
+
+// Only functions the top-level code can reach through calls are kept;
+// calls are renumbered for the functions that remain. Runs after inlining
+// and constant propagation, which leave many helpers without callers.
+bool eliminateDeadFunctions(Module &module, PassContext &context) {
+  std::vector<bool> reachable(module.functions.size(), false);
+  std::vector<uint32_t> work = {0};
+  reachable[0] = true;
+  while (!work.empty()) {
+    uint32_t f = work.back();
+    work.pop_back();
+    for (const Block &block : module.functions[f].blocks)
+      for (const Instr &instr : block.instrs)
+        if (instr.op == Opcode::Call && !reachable[instr.callee]) {
+          reachable[instr.callee] = true;
+          work.push_back(instr.callee);
+        }
+  }
+
+  if (std::find(reachable.begin(), reachable.end(), false) ==
+      reachable.end())
+    return false;
+
+  std::vector<uint32_t> newIndex(module.functions.size());
+  std::vector<Function> kept;
+  for (uint32_t f = 0; f < module.functions.size(); f++) {
+    if (!reachable[f]) {
+      context.remarks.push_back(
+          {"dead-functions", symbols().str(module.functions[f].name)});
+      continue;
+    }
+    newIndex[f] = static_cast<uint32_t>(kept.size());
+    kept.push_back(std::move(module.functions[f]));
+  }
+  for (Function &func : kept)
+    for (Block &block : func.blocks)
+      for (Instr &instr : block.instrs)
+        if (instr.op == Opcode::Call)
+          instr.callee = newIndex[instr.callee];
+  module.functions = std::move(kept);
+  return true;
+}
+
+} // namespace
+
+const Pass deadFunctionsPass = {"dead-functions", eliminateDeadFunctions};
+
+} // namespace ir
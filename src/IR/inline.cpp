@@ -0,0 +1,228 @@
+#include "pass.hpp"
+#include <iterator>
+#include <map>
+
+namespace ir {
+
+uint32_t inlineCost(const Function &func) {
+  uint32_t cost = 0;
+  for (const Block &block : func.blocks)
+    for (const Instr &instr : block.instrs) {
+      if (instr.op == Opcode::Param)
+        continue; // becomes the argument itself
+      cost += 1;
+      if (instr.op == Opcode::Call)
+        cost += static_cast<uint32_t>(instr.args.size());
+    }
+  return cost;
+}
+
+namespace {
+
+std::string displayName(const Function &func) {
+  return func.isMain ? "<top level>" : symbols().str(func.name);
+}
+
+class Inliner {
+public:
+  Inliner(Module &m, PassContext &c)
+      : module(m), context(c), callees(m.functions.size()),
+        recursive(m.functions.size(), false) {
+    for (uint32_t f = 0; f < module.functions.size(); f++)
+      for (const Block &block : module.functions[f].blocks)
+        for (const Instr &instr : block.instrs)
+          if (instr.op == Opcode::Call)
+            callees[f].push_back(instr.callee);
+    for (uint32_t f = 0; f < module.functions.size(); f++)
+      recursive[f] = reaches(f, f);
+  }
+
+  bool run() {
+    // Callees first, so their bodies are final by the time they are copied
+    std::vector<bool> visited(module.functions.size(), false);
+    bool changed = false;
+    for (uint32_t f = 0; f < module.functions.size(); f++)
+      changed |= visit(f, visited);
+    return changed;
+  }
+
+private:
+  Module &module;
+  PassContext &context;
+  std::vector<std::vector<uint32_t>> callees;
+  std::vector<bool> recursive; // on a cycle of the call graph
+
+  // Whether a chain of calls leads from `from` to `to`
+  bool reaches(uint32_t from, uint32_t to) const {
+    std::vector<bool> seen(module.functions.size(), false);
+    std::vector<uint32_t> stack = callees[from];
+    while (!stack.empty()) {
+      uint32_t f = stack.back();
+      stack.pop_back();
+      if (f == to)
+        return true;
+      if (seen[f])
+        continue;
+      seen[f] = true;
+      stack.insert(stack.end(), callees[f].begin(), callees[f].end());
+    }
+    return false;
+  }
+
+  bool visit(uint32_t f, std::vector<bool> &visited) {
+    if (visited[f])
+      return false;
+    visited[f] = true;
+    bool changed = false;
+    for (uint32_t callee : callees[f])
+      changed |= visit(callee, visited);
+    return inlineCalls(f) || changed;
+  }
+
+  bool inlineCalls(uint32_t f) {
+    Function &func = module.functions[f];
+    // Layout successor of every block: the copied blocks go right after the
+    // call, followed by the rest of the calling block
+    BlockId count = static_cast<BlockId>(func.blocks.size());
+    std::vector<BlockId> next(count);
+    for (BlockId b = 0; b < count; b++)
+      next[b] = b + 1 < count ? b + 1 : NO_BLOCK;
+    std::map<uint32_t, uint32_t> sites; // callee -> calls inlined
+
+    for (BlockId b = 0; b < func.blocks.size(); b++) {
+      for (size_t i = 0; i < func.blocks[b].instrs.size(); i++) {
+        const Instr &instr = func.blocks[b].instrs[i];
+        if (instr.op != Opcode::Call || recursive[instr.callee] ||
+            inlineCost(module.functions[instr.callee]) >
+                context.inlineThreshold)
+          continue;
+        sites[instr.callee]++;
+        BlockId first = static_cast<BlockId>(func.blocks.size());
+        inlineCall(func, b, i, module.functions[instr.callee]);
+        // New blocks: the callee's copy from first, then the continuation
+        BlockId rest = static_cast<BlockId>(func.blocks.size() - 1);
+        next.resize(func.blocks.size());
+        next[rest] = next[b];
+        for (BlockId n = first; n < rest; n++)
+          next[n] = n + 1;
+        next[b] = first;
+        break; // the block now ends with the jump into the copy
+      }
+    }
+    if (sites.empty())
+      return false;
+
+    std::vector<BlockId> order;
+    for (BlockId b = 0; b != NO_BLOCK; b = next[b])
+      order.push_back(b);
+    reorderBlocks(func, order);
+    for (auto [callee, count] : sites) {
+      const Function &body = module.functions[callee];
+      context.remarks.push_back(
+          {"inline", "inlined " + displayName(body) + " (cost " +
+                         std::to_string(inlineCost(body)) + ") into " +
+                         displayName(func) + " at " + std::to_string(count) +
+                         (count == 1 ? " call site" : " call sites")});
+    }
+    return true;
+  }
+
+  // Replace the call func.blocks[b].instrs[index] by a copy of callee's
+  // blocks, appended to func, followed by a block holding the instructions
+  // after the call. The copy's returns jump there; a phi merges their values
+  // when there are several.
+  void inlineCall(Function &func, BlockId b, size_t index,
+                  const Function &callee) {
+    Instr call = std::move(func.blocks[b].instrs[index]);
+    BlockId first = static_cast<BlockId>(func.blocks.size());
+    for (size_t i = 0; i < callee.blocks.size(); i++)
+      func.newBlock();
+    BlockId rest = func.newBlock();
+
+    // Callee values get fresh numbers; parameters become the arguments
+    std::vector<Operand> values(callee.valueCount);
+    for (const Block &block : callee.blocks)
+      for (const Instr &instr : block.instrs) {
+        if (instr.dst == NO_VALUE)
+          continue;
+        if (instr.op == Opcode::Param) {
+          size_t arg = static_cast<size_t>(instr.args[0].imm);
+          values[instr.dst] = arg < call.args.size() ? call.args[arg]
+                                                     : Operand::constant(0);
+        } else {
+          values[instr.dst] = Operand::value(func.newValue());
+        }
+      }
+    auto map = [&](const Operand &op) {
+      return op.isValue() ? values[op.id] : op;
+    };
+
+    std::vector<BlockId> returns;
+    std::vector<Operand> results;
+    for (BlockId cb = 0; cb < callee.blocks.size(); cb++) {
+      Block &copy = func.blocks[first + cb];
+      for (BlockId pred : callee.blocks[cb].preds)
+        copy.preds.push_back(first + pred);
+      for (const Instr &instr : callee.blocks[cb].instrs) {
+        if (instr.op == Opcode::Param)
+          continue;
+        if (instr.op == Opcode::Return) {
+          Instr jump(Opcode::Jump);
+          jump.targets[0] = rest;
+          copy.instrs.push_back(std::move(jump));
+          returns.push_back(first + cb);
+          results.push_back(map(instr.args[0]));
+          continue;
+        }
+        Instr clone = instr;
+        if (clone.dst != NO_VALUE)
+          clone.dst = values[instr.dst].id;
+        for (Operand &arg : clone.args)
+          arg = map(arg);
+        for (BlockId &target : clone.targets)
+          if (target != NO_BLOCK)
+            target += first;
+        copy.instrs.push_back(std::move(clone));
+      }
+    }
+    func.blocks[first].preds.push_back(b);
+
+    // Split the calling block after the call
+    Block &block = func.blocks[b];
+    Block &tail = func.blocks[rest];
+    auto after = block.instrs.begin() + index + 1;
+    tail.instrs.assign(std::make_move_iterator(after),
+                       std::make_move_iterator(block.instrs.end()));
+    block.instrs.erase(block.instrs.begin() + index, block.instrs.end());
+    Instr jump(Opcode::Jump);
+    jump.targets[0] = first;
+    block.instrs.push_back(std::move(jump));
+    for (BlockId succ : successors(tail))
+      for (BlockId &pred : func.blocks[succ].preds)
+        if (pred == b)
+          pred = rest;
+    tail.preds = returns;
+
+    if (call.dst == NO_VALUE)
+      return;
+    if (results.size() == 1) {
+      std::vector<Operand> replacement(func.valueCount);
+      replacement[call.dst] = results[0];
+      replaceValues(func, replacement);
+    } else {
+      Instr phi(Opcode::Phi, call.dst);
+      phi.args = results;
+      tail.instrs.insert(tail.instrs.begin(), std::move(phi));
+    }
+  }
+};
+
+bool inlineFunctions(Module &module, PassContext &context) {
+  return Inliner(module, context).run();
+}
+
+} // namespace
+
+const Pass inlinePass = {"inline", inlineFunctions};
+
+} // namespace ir
@@ -0,0 +1,420 @@
+#include "ir.hpp"
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+
+namespace ir {
+
+const char *opcodeName(Opcode op) {
+  switch (op) {
+  case Opcode::Copy:
+    return "copy";
+  case Opcode::Add:
+    return "add";
+  case Opcode::Sub:
+    return "sub";
+  case Opcode::Mul:
+    return "mul";
+  case Opcode::Div:
+    return "div";
+  case Opcode::Mod:
+    return "mod";
+  case Opcode::Neg:
+    return "neg";
+  case Opcode::Not:
+    return "not";
+  case Opcode::Test:
+    return "test";
+  case Opcode::Eq:
+    return "eq";
+  case Opcode::Ne:
+    return "ne";
+  case Opcode::Lt:
+    return "lt";
+  case Opcode::Le:
+    return "le";
+  case Opcode::Gt:
+    return "gt";
+  case Opcode::Ge:
+    return "ge";
+  case Opcode::Param:
+    return "param";
+  case Opcode::Call:
+    return "call";
+  case Opcode::Print:
+    return "print";
+  case Opcode::Phi:
+    return "phi";
+  case Opcode::Jump:
+    return "jump";
+  case Opcode::Branch:
+    return "branch";
+  case Opcode::Return:
+    return "return";
+  }
+  return "?";
+}
+
+bool isTerminator(Opcode op) {
+  return op == Opcode::Jump || op == Opcode::Branch || op == Opcode::Return;
+}
+
+bool isCompare(Opcode op) { return op >= Opcode::Eq && op <= Opcode::Ge; }
+
+bool isBinary(Opcode op) {
+  return (op >= Opcode::Add && op <= Opcode::Mod) || isCompare(op);
+}
+
+bool hasSideEffects(Opcode op) {
+  return op == Opcode::Call || op == Opcode::Print || isTerminator(op);
+}
+
+bool mayTrap(const Instr &instr) {
+  if (instr.op != Opcode::Div && instr.op != Opcode::Mod)
+    return false;
+  const Operand &divisor = instr.args[1];
+  return !divisor.isImm() || divisor.imm == 0 || divisor.imm == -1;
+}
+
+uint32_t Module::internString(std::string_view text) {
+  auto it = stringIndex.find(std::string(text));
+  if (it != stringIndex.end())
+    return it->second;
+  uint32_t index = static_cast<uint32_t>(strings.size());
+  strings.emplace_back(text);
+  stringIndex.emplace(strings.back(), index);
+  return index;
+}
+
+std::vector<BlockId> successors(const Block &block) {
+  const Instr &term = block.terminator();
+  switch (term.op) {
+  case Opcode::Jump:
+    return {term.targets[0]};
+  case Opcode::Branch:
+    return {term.targets[0], term.targets[1]};
+  default:
+    return {};
+  }
+}
+
+void recomputePreds(Function &func) {
+  std::vector<std::vector<BlockId>> preds(func.blocks.size());
+  for (BlockId b = 0; b < func.blocks.size(); b++)
+    for (BlockId succ : successors(func.blocks[b]))
+      preds[succ].push_back(b);
+
+  for (BlockId b = 0; b < func.blocks.size(); b++) {
+    Block &block = func.blocks[b];
+    if (block.preds != preds[b]) {
+      for (Instr &instr : block.instrs) {
+        if (instr.op != Opcode::Phi)
+          break;
+        std::vector<Operand> args;
+        for (BlockId pred : preds[b]) {
+          auto at = std::find(block.preds.begin(), block.preds.end(), pred);
+          args.push_back(instr.args[at - block.preds.begin()]);
+        }
+        instr.args = std::move(args);
+      }
+      block.preds = std::move(preds[b]);
+    }
+  }
+}
+
+std::vector<BlockId> reversePostorder(const Function &func) {
+  std::vector<BlockId> order;
+  std::vector<uint8_t> state(func.blocks.size(), 0); // 1 open, 2 done
+  // Explicit stack of (block, next successor to visit)
+  std::vector<std::pair<BlockId, size_t>> stack{{0, 0}};
+  state[0] = 1;
+  while (!stack.empty()) {
+    auto &top = stack.back();
+    std::vector<BlockId> succs = successors(func.blocks[top.first]);
+    if (top.second < succs.size()) {
+      BlockId next = succs[top.second++];
+      if (!state[next]) {
+        state[next] = 1;
+        stack.push_back({next, 0});
+      }
+    } else {
+      state[top.first] = 2;
+      order.push_back(top.first);
+      stack.pop_back();
+    }
+  }
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+void removeEdge(Function &func, BlockId from, BlockId to) {
+  Block &block = func.blocks[to];
+  auto at = std::find(block.preds.begin(), block.preds.end(), from);
+  if (at == block.preds.end())
+    return;
+  size_t index = at - block.preds.begin();
+  block.preds.erase(at);
+  for (Instr &instr : block.instrs) {
+    if (instr.op != Opcode::Phi)
+      break;
+    instr.args.erase(instr.args.begin() + index);
+  }
+}
+
+void reorderBlocks(Function &func, const std::vector<BlockId> &order) {
+  std::vector<BlockId> newId(func.blocks.size(), NO_BLOCK);
+  for (BlockId i = 0; i < order.size(); i++)
+    newId[order[i]] = i;
+
+  // Edges out of dropped blocks disappear from the kept blocks' phis
+  for (BlockId b = 0; b < func.blocks.size(); b++)
+    if (newId[b] == NO_BLOCK)
+      for (BlockId succ : successors(func.blocks[b]))
+        if (newId[succ] != NO_BLOCK)
+          removeEdge(func, b, succ);
+
+  std::vector<Block> blocks;
+  blocks.reserve(order.size());
+  for (BlockId old : order) {
+    Block block = std::move(func.blocks[old]);
+    for (BlockId &pred : block.preds)
+      pred = newId[pred];
+    Instr &term = block.terminator();
+    for (BlockId &target : term.targets)
+      if (target != NO_BLOCK)
+        target = newId[target];
+    blocks.push_back(std::move(block));
+  }
+  func.blocks = std::move(blocks);
+}
+
+bool removeUnreachableBlocks(Function &func) {
+  std::vector<BlockId> live = reversePostorder(func);
+  if (live.size() == func.blocks.size())
+    return false;
+  // Keep the surviving blocks in their current layout order
+  std::sort(live.begin(), live.end());
+  reorderBlocks(func, live);
+  return true;
+}
+
+void replaceValues(Function &func, std::vector<Operand> &replacement) {
+  auto resolve = [&](Operand op) {
+    while (op.isValue() && op.id < replacement.size() &&
+           replacement[op.id].kind != Operand::None)
+      op = replacement[op.id];
+    return op;
+  };
+  // Compress chains first so every lookup below is a single step
+  for (ValueId v = 0; v < replacement.size(); v++)
+    if (replacement[v].kind != Operand::None)
+      replacement[v] = resolve(replacement[v]);
+
+  for (Block &block : func.blocks)
+    for (Instr &instr : block.instrs)
+      for (Operand &arg : instr.args)
+        arg = resolve(arg);
+}
+
+bool removeTrivialPhis(Function &func) {
+  std::vector<Operand> replacement(func.valueCount);
+  auto resolve = [&](Operand op) {
+    while (op.isValue() && replacement[op.id].kind != Operand::None)
+      op = replacement[op.id];
+    return op;
+  };
+  bool any = false;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (Block &block : func.blocks) {
+      for (Instr &instr : block.instrs) {
+        if (instr.op != Opcode::Phi)
+          break;
+        if (replacement[instr.dst].kind != Operand::None)
+          continue;
+        Operand same;
+        bool trivial = true;
+        for (Operand arg : instr.args) {
+          arg = resolve(arg);
+          if (arg == same || (arg.isValue() && arg.id == instr.dst))
+            continue;
+          if (same.kind != Operand::None) {
+            trivial = false;
+            break;
+          }
+          same = arg;
+        }
+        if (!trivial)
+          continue;
+        // A phi only reachable from itself is never read
+        replacement[instr.dst] =
+            same.kind == Operand::None ? Operand::constant(0) : same;
+        changed = any = true;
+      }
+    }
+  }
+  if (!any)
+    return false;
+  for (Block &block : func.blocks) {
+    auto &instrs = block.instrs;
+    instrs.erase(std::remove_if(instrs.begin(), instrs.end(),
+                                [&](const Instr &instr) {
+                                  return instr.op == Opcode::Phi &&
+                                         replacement[instr.dst].kind !=
+                                             Operand::None;
+                                }),
+                 instrs.end());
+  }
+  replaceValues(func, replacement);
+  return true;
+}
+
+bool isTailCall(const Block &block, size_t index) {
+  if (index + 2 != block.instrs.size())
+    return false;
+  const Instr &call = block.instrs[index];
+  const Instr &ret = block.terminator();
+  return call.op == Opcode::Call && ret.op == Opcode::Return &&
+         ret.args[0].isValue() && ret.args[0].id == call.dst;
+}
+
+std::vector<uint32_t> countUses(const Function &func) {
+  std::vector<uint32_t> uses(func.valueCount, 0);
+  for (const Block &block : func.blocks)
+    for (const Instr &instr : block.instrs)
+      for (const Operand &arg : instr.args)
+        if (arg.isValue())
+          uses[arg.id]++;
+  return uses;
+}
+
+static void verifyFunction(const Module &module, const Function &func) {
+  auto fail = [&](const std::string &what) {
+    throw std::logic_error("IR verification failed in " + func.label + ": " +
+                           what);
+  };
+  if (func.blocks.empty())
+    fail("no blocks");
+
+  std::vector<uint8_t> defined(func.valueCount, 0);
+  std::vector<std::vector<BlockId>> preds(func.blocks.size());
+  for (BlockId b = 0; b < func.blocks.size(); b++) {
+    const Block &block = func.blocks[b];
+    std::string where = "block " + std::to_string(b);
+    if (block.instrs.empty() || !isTerminator(block.terminator().op))
+      fail(where + " does not end in a terminator");
+
+    bool phis = true;
+    for (size_t i = 0; i < block.instrs.size(); i++) {
+      const Instr &instr = block.instrs[i];
+      if (isTerminator(instr.op) && i + 1 != block.instrs.size())
+        fail(where + " has a terminator before its end");
+      if (instr.op == Opcode::Phi) {
+        if (!phis)
+          fail(where + " has a phi after other instructions");
+        if (instr.args.size() != block.preds.size())
+          fail(where + " has a phi with the wrong number of arguments");
+      } else {
+        phis = false;
+      }
+      if (instr.dst != NO_VALUE) {
+        if (instr.dst >= func.valueCount || defined[instr.dst])
+          fail(where + " redefines or overflows a value");
+        defined[instr.dst] = 1;
+      }
+      for (const Operand &arg : instr.args) {
+        if (arg.isValue() && arg.id >= func.valueCount)
+          fail(where + " uses an unknown value");
+        if (arg.isStr() && arg.id >= module.strings.size())
+          fail(where + " uses an unknown string");
+      }
+      if (instr.op == Opcode::Call && instr.callee >= module.functions.size())
+        fail(where + " calls an unknown function");
+    }
+    for (BlockId succ : successors(block)) {
+      if (succ >= func.blocks.size())
+        fail(where + " jumps to a missing block");
+      preds[succ].push_back(b);
+    }
+  }
+  for (BlockId b = 0; b < func.blocks.size(); b++) {
+    // Any order will do: phi arguments just have to follow it
+    std::vector<BlockId> listed = func.blocks[b].preds;
+    std::sort(listed.begin(), listed.end());
+    if (preds[b] != listed)
+      fail("pred list of block " + std::to_string(b) +
+           " does not match the CFG");
+  }
+  if (!func.blocks[0].preds.empty())
+    fail("entry block has predecessors");
+}
+
+void verify(const Module &module) {
+  for (const Function &func : module.functions)
+    verifyFunction(module, func);
+}
+
+static void printOperand(std::ostream &out, const Module &module,
+                         const Operand &op) {
+  switch (op.kind) {
+  case Operand::None:
+    out << "_";
+    break;
+  case Operand::Value:
+    out << "%" << op.id;
+    break;
+  case Operand::Imm:
+    out << op.imm;
+    break;
+  case Operand::Str: {
+    out << "\"";
+    for (char c : module.strings[op.id]) {
+      if (c == '\n')
+        out << "\\n";
+      else if (c == '"' || c == '\\')
+        out << '\\' << c;
+      else
+        out << c;
+    }
+    out << "\"";
+    break;
+  }
+  }
+}
+
+void print(std::ostream &out, const Module &module) {
+  for (const Function &func : module.functions) {
+    out << "function " << func.label << "(" << func.paramCount << ")\n";
+    for (BlockId b = 0; b < func.blocks.size(); b++) {
+      const Block &block = func.blocks[b];
+      out << "b" << b << ":";
+      if (!block.preds.empty()) {
+        out << "  ; preds";
+        for (BlockId pred : block.preds)
+          out << " b" << pred;
+      }
+      out << "\n";
+      for (const Instr &instr : block.instrs) {
+        out << "  ";
+        if (instr.dst != NO_VALUE)
+          out << "%" << instr.dst << " = ";
+        out << opcodeName(instr.op);
+        if (instr.op == Opcode::Call)
+          out << " " << module.functions[instr.callee].label;
+        for (size_t i = 0; i < instr.args.size(); i++) {
+          out << (i == 0 ? " " : ", ");
+          printOperand(out, module, instr.args[i]);
+        }
+        if (instr.op == Opcode::Jump)
+          out << " b" << instr.targets[0];
+        else if (instr.op == Opcode::Branch)
+          out << ", b" << instr.targets[0] << ", b" << instr.targets[1];
+        out << "\n";
+      }
+    }
+    out << "\n";
+  }
+}
+
+} // namespace ir
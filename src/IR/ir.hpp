@@ -0,0 +1,174 @@
+#pragma once
+#include "../symbol.hpp"
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Middle end. A program is lowered (lower.hpp) to one Function per
+// FunctionDef plus one for the top-level code; each Function is a control-flow
+// graph of basic blocks holding three-address instructions in SSA form: every
+// value is assigned by exactly one instruction, and merges of control flow
+// pick values with phi instructions at the top of the join block. Passes
+// (pass.hpp) rewrite the module in place and the x86_64 backend emits it.
+
+namespace ir {
+
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+constexpr ValueId NO_VALUE = UINT32_MAX;
+constexpr BlockId NO_BLOCK = UINT32_MAX;
+
+enum class Opcode : uint8_t {
+  Copy, // dst = a
+  Add,
+  Sub,
+  Mul,
+  Div, // truncating, like idiv
+  Mod,
+  Neg,  // dst = -a
+  Not,  // dst = a == 0
+  Test, // dst = a != 0
+  Eq,   // comparisons produce 0 or 1
+  Ne,
+  Lt,
+  Le,
+  Gt,
+  Ge,
+  Param, // dst = argument number imm of a (entry block only)
+  Call,  // dst = functions[callee](args...)
+  Print, // write the NUL-terminated string a to stdout
+  Phi,   // dst = args[i] when control arrived from preds[i]
+
+  // Terminators: exactly one, at the end of every block
+  Jump,   // goto targets[0]
+  Branch, // goto a != 0 ? targets[0] : targets[1]
+  Return, // return a (exit status a for the top-level code)
+};
+
+const char *opcodeName(Opcode op);
+bool isTerminator(Opcode op);
+bool isCompare(Opcode op);
+bool isBinary(Opcode op); // Add .. Mod and the comparisons
+// Whether the instruction may do something other than compute dst: calls
+// and prints are kept even when their result is unused
+bool hasSideEffects(Opcode op);
+
+// An instruction input: an SSA value, an integer, or the address of a string
+// constant from Module::strings
+struct Operand {
+  enum Kind : uint8_t { None, Value, Imm, Str };
+  Kind kind = None;
+  uint32_t id = 0; // ValueId for Value, string index for Str
+  int64_t imm = 0;
+
+  static Operand value(ValueId v) { return {Value, v, 0}; }
+  static Operand constant(int64_t i) { return {Imm, 0, i}; }
+  static Operand string(uint32_t index) { return {Str, index, 0}; }
+
+  bool isValue() const { return kind == Value; }
+  bool isImm() const { return kind == Imm; }
+  bool isStr() const { return kind == Str; }
+
+  bool operator==(const Operand &o) const {
+    return kind == o.kind && id == o.id && imm == o.imm;
+  }
+  bool operator!=(const Operand &o) const { return !(*this == o); }
+};
+
+struct Instr {
+  Opcode op;
+  ValueId dst = NO_VALUE;
+  std::vector<Operand> args;
+  BlockId targets[2] = {NO_BLOCK, NO_BLOCK};
+  uint32_t callee = 0; // Call: index into Module::functions
+
+  Instr(Opcode o, ValueId d = NO_VALUE) : op(o), dst(d) {}
+};
+
+// Whether the instruction is a division or remainder that may fault: by a
+// divisor not known to be a constant, by zero, or by -1 (INT64_MIN / -1).
+// Such an instruction stays even when its result is unused.
+bool mayTrap(const Instr &instr);
+
+struct Block {
+  std::vector<Instr> instrs;  // phis first, terminator last
+  std::vector<BlockId> preds; // phi arguments follow this order
+
+  const Instr &terminator() const { return instrs.back(); }
+  Instr &terminator() { return instrs.back(); }
+};
+
+// Successors of a block, read off its terminator
+std::vector<BlockId> successors(const Block &block);
+
+struct Function {
+  Symbol name;       // builtin::None for the top-level code
+  std::string label; // assembly label
+  uint32_t paramCount = 0;
+  bool isMain = false; // the top-level code: Return exits the process
+  std::vector<Block> blocks; // blocks[0] is the entry; order is the layout
+  uint32_t valueCount = 0;
+
+  ValueId newValue() { return valueCount++; }
+  BlockId newBlock() {
+    blocks.emplace_back();
+    return static_cast<BlockId>(blocks.size() - 1);
+  }
+};
+
+struct Module {
+  std::vector<Function> functions; // functions[0] is the top-level code
+  std::vector<std::string> strings;
+
+  // Index of the string constant with this content, added on first use
+  uint32_t internString(std::string_view text);
+
+private:
+  std::unordered_map<std::string, uint32_t> stringIndex;
+};
+
+// CFG utilities shared by the lowering and the passes
+
+// Rebuild every block's pred list from the terminators. Phi arguments are
+// permuted to match; blocks are assumed to keep the same incoming edges.
+void recomputePreds(Function &func);
+
+// Drop blocks that cannot be reached from the entry, removing their phi
+// arguments in the blocks they jumped to. Returns whether anything changed.
+bool removeUnreachableBlocks(Function &func);
+
+// Renumber the blocks so that order[i] becomes block i. Blocks missing from
+// order must be unreachable and are dropped.
+void reorderBlocks(Function &func, const std::vector<BlockId> &order);
+
+// Blocks in reverse postorder from the entry
+std::vector<BlockId> reversePostorder(const Function &func);
+
+// Remove the edge from -> to: to's phis lose the matching argument
+void removeEdge(Function &func, BlockId from, BlockId to);
+
+// Replace every use of the values in `replacement` (indexed by ValueId, None
+// meaning keep) by the operand given, following chains of replacements
+void replaceValues(Function &func, std::vector<Operand> &replacement);
+
+// Replace phis whose arguments are all the same value (or the phi itself)
+// by that value, until none is left. Returns whether anything changed.
+bool removeTrivialPhis(Function &func);
+
+// Whether block.instrs[index] is a call whose result the block returns
+// right away
+bool isTailCall(const Block &block, size_t index);
+
+// Number of uses of every value
+std::vector<uint32_t> countUses(const Function &func);
+
+// Check the structural invariants; throws std::logic_error naming the
+// function and the broken rule
+void verify(const Module &module);
+
+void print(std::ostream &out, const Module &module);
+
+} // namespace ir
@@ -0,0 +1,357 @@
+#include "pass.hpp"
+#include <algorithm>
+#include <iterator>
+
+namespace ir {
+namespace {
+
+// What a call to a function may do
+struct Effects {
+  bool pure = true;  // prints nothing, itself or through its callees
+  bool total = true; // pure, and always returns: no loop, no recursion and
+                     // no division that can trap
+};
+
+// Whether the CFG has a cycle: an edge to a block no later in reverse
+// postorder
+bool hasCycle(const Function &func) {
+  std::vector<BlockId> order = reversePostorder(func);
+  std::vector<uint32_t> position(func.blocks.size(), UINT32_MAX);
+  for (uint32_t i = 0; i < order.size(); i++)
+    position[order[i]] = i;
+  for (BlockId b : order)
+    for (BlockId succ : successors(func.blocks[b]))
+      if (position[succ] <= position[b])
+        return true;
+  return false;
+}
+
+// Purity is optimistic (a recursive function that prints nothing is pure)
+// and found by iterating to a fixed point over the calls
+std::vector<Effects> analyseEffects(const Module &module) {
+  size_t count = module.functions.size();
+  std::vector<Effects> effects(count);
+  std::vector<std::vector<uint32_t>> callees(count);
+  for (uint32_t f = 0; f < count; f++) {
+    const Function &func = module.functions[f];
+    if (hasCycle(func))
+      effects[f].total = false;
+    for (const Block &block : func.blocks)
+      for (const Instr &instr : block.instrs) {
+        if (instr.op == Opcode::Print)
+          effects[f] = {false, false};
+        if (mayTrap(instr))
+          effects[f].total = false;
+        if (instr.op == Opcode::Call) {
+          callees[f].push_back(instr.callee);
+          if (instr.callee == f)
+            effects[f].total = false;
+        }
+      }
+  }
+  // Mutual recursion: a function reaching itself through others
+  for (uint32_t f = 0; f < count; f++) {
+    std::vector<bool> seen(count, false);
+    std::vector<uint32_t> work = callees[f];
+    while (!work.empty() && effects[f].total) {
+      uint32_t g = work.back();
+      work.pop_back();
+      if (g == f)
+        effects[f].total = false;
+      if (seen[g])
+        continue;
+      seen[g] = true;
+      work.insert(work.end(), callees[g].begin(), callees[g].end());
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (uint32_t f = 0; f < count; f++)
+      for (uint32_t callee : callees[f]) {
+        Effects next = {effects[f].pure && effects[callee].pure,
+                        effects[f].total && effects[callee].total};
+        if (next.pure != effects[f].pure || next.total != effects[f].total) {
+          effects[f] = next;
+          changed = true;
+        }
+      }
+  }
+  return effects;
+}
+
+struct Loop {
+  BlockId header;
+  std::vector<bool> body; // indexed by block, header included
+  uint32_t size = 0;
+};
+
+// Immediate dominators (Cooper, Harvey & Kennedy, "A Simple, Fast
+// Dominance Algorithm"), NO_BLOCK for the entry and unreachable blocks
+std::vector<BlockId> immediateDominators(const Function &func,
+                                         const std::vector<BlockId> &rpo) {
+  std::vector<uint32_t> position(func.blocks.size(), UINT32_MAX);
+  for (uint32_t i = 0; i < rpo.size(); i++)
+    position[rpo[i]] = i;
+  std::vector<BlockId> idom(func.blocks.size(), NO_BLOCK);
+  idom[0] = 0;
+  auto intersect = [&](BlockId a, BlockId b) {
+    while (a != b) {
+      while (position[a] > position[b])
+        a = idom[a];
+      while (position[b] > position[a])
+        b = idom[b];
+    }
+    return a;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (BlockId b : rpo) {
+      if (b == 0)
+        continue;
+      BlockId dom = NO_BLOCK;
+      for (BlockId pred : func.blocks[b].preds) {
+        if (idom[pred] == NO_BLOCK)
+          continue; // not processed yet, or unreachable
+        dom = dom == NO_BLOCK ? pred : intersect(pred, dom);
+      }
+      if (dom != idom[b]) {
+        idom[b] = dom;
+        changed = true;
+      }
+    }
+  }
+  idom[0] = NO_BLOCK;
+  return idom;
+}
+
+// Natural loops, innermost (smallest) first. Back edges into the same
+// header make one loop.
+std::vector<Loop> findLoops(const Function &func,
+                            const std::vector<BlockId> &rpo) {
+  std::vector<BlockId> idom = immediateDominators(func, rpo);
+  auto dominates = [&](BlockId a, BlockId b) {
+    for (; b != NO_BLOCK; b = idom[b])
+      if (a == b)
+        return true;
+    return false;
+  };
+
+  std::vector<Loop> loops;
+  for (BlockId header : rpo) {
+    Loop loop{header, std::vector<bool>(func.blocks.size(), false)};
+    std::vector<BlockId> work;
+    for (BlockId pred : func.blocks[header].preds)
+      if (dominates(header, pred))
+        work.push_back(pred);
+    if (work.empty())
+      continue;
+    loop.body[header] = true;
+    loop.size = 1;
+    while (!work.empty()) {
+      BlockId b = work.back();
+      work.pop_back();
+      if (loop.body[b])
+        continue;
+      loop.body[b] = true;
+      loop.size++;
+      for (BlockId pred : func.blocks[b].preds)
+        work.push_back(pred);
+    }
+    loops.push_back(std::move(loop));
+  }
+  std::stable_sort(loops.begin(), loops.end(),
+                   [](const Loop &a, const Loop &b) { return a.size < b.size; });
+  return loops;
+}
+
+class LoopHoisting {
+public:
+  LoopHoisting(Function &f, const std::vector<Effects> &e)
+      : func(f), effects(e) {}
+
+  // Hoist one loop's invariants at a time, re-finding the loops afterwards
+  // since a new preheader belongs to the loops around it
+  bool run() {
+    bool changed = false;
+    bool round = true;
+    while (round) {
+      round = false;
+      std::vector<BlockId> rpo = reversePostorder(func);
+      for (const Loop &loop : findLoops(func, rpo)) {
+        if (hoist(loop, rpo)) {
+          round = changed = true;
+          break;
+        }
+      }
+    }
+    return changed;
+  }
+
+private:
+  Function &func;
+  const std::vector<Effects> &effects;
+
+  // Whether the instruction may run before the loop. Everything in the
+  // header runs whenever the loop is entered, so a division that may trap
+  // or a pure call that may not return can move out of it as long as
+  // nothing observable comes first; anywhere else in the loop it might
+  // never have run at all.
+  bool movable(const Instr &instr, bool alwaysRuns) const {
+    switch (instr.op) {
+    case Opcode::Phi:
+    case Opcode::Param:
+    case Opcode::Print:
+      return false;
+    case Opcode::Call:
+      return effects[instr.callee].pure &&
+             (effects[instr.callee].total || alwaysRuns);
+    default:
+      return !isTerminator(instr.op) && (!mayTrap(instr) || alwaysRuns);
+    }
+  }
+
+  bool hoist(const Loop &loop, const std::vector<BlockId> &rpo) {
+    std::vector<bool> variant(func.valueCount, false);
+    for (BlockId b : rpo)
+      if (loop.body[b])
+        for (const Instr &instr : func.blocks[b].instrs)
+          if (instr.dst != NO_VALUE)
+            variant[instr.dst] = true;
+    auto invariant = [&](const Operand &op) {
+      return !op.isValue() || !variant[op.id];
+    };
+
+    // Instructions whose operands are all invariant, in an order that
+    // respects their dependencies
+    std::vector<ValueId> order;
+    bool found = true;
+    while (found) {
+      found = false;
+      for (BlockId b : rpo) {
+        if (!loop.body[b])
+          continue;
+        bool observable = false; // something before it in the header stays
+        for (const Instr &instr : func.blocks[b].instrs) {
+          bool alwaysRuns = b == loop.header && !observable;
+          if (instr.dst != NO_VALUE && variant[instr.dst] &&
+              movable(instr, alwaysRuns) &&
+              std::all_of(instr.args.begin(), instr.args.end(), invariant)) {
+            variant[instr.dst] = false;
+            order.push_back(instr.dst);
+            found = true;
+          } else if (instr.dst == NO_VALUE || variant[instr.dst]) {
+            observable |= hasSideEffects(instr.op) || mayTrap(instr);
+          }
+        }
+      }
+    }
+    if (order.empty())
+      return false;
+
+    std::vector<uint32_t> slot(func.valueCount, UINT32_MAX);
+    for (uint32_t i = 0; i < order.size(); i++)
+      slot[order[i]] = i;
+    std::vector<Instr> taken;
+    for (BlockId b : rpo) {
+      if (!loop.body[b])
+        continue;
+      auto &instrs = func.blocks[b].instrs;
+      auto stays = std::stable_partition(
+          instrs.begin(), instrs.end(), [&](const Instr &instr) {
+            return instr.dst == NO_VALUE || slot[instr.dst] == UINT32_MAX;
+          });
+      taken.insert(taken.end(), std::make_move_iterator(stays),
+                   std::make_move_iterator(instrs.end()));
+      instrs.erase(stays, instrs.end());
+    }
+    std::sort(taken.begin(), taken.end(),
+              [&](const Instr &a, const Instr &b) {
+                return slot[a.dst] < slot[b.dst];
+              });
+
+    BlockId pre = preheader(loop);
+    auto &instrs = func.blocks[pre].instrs;
+    instrs.insert(instrs.end() - 1, std::make_move_iterator(taken.begin()),
+                  std::make_move_iterator(taken.end()));
+    return true;
+  }
+
+  // The block every entry into the loop comes through, created when the
+  // header has several outside predecessors or the one it has branches.
+  // Phis of the header merge the outside values there first.
+  BlockId preheader(const Loop &loop) {
+    std::vector<size_t> outside; // positions in the header's preds
+    const Block &header = func.blocks[loop.header];
+    for (size_t i = 0; i < header.preds.size(); i++)
+      if (!loop.body[header.preds[i]])
+        outside.push_back(i);
+    if (outside.size() == 1) {
+      BlockId pred = header.preds[outside[0]];
+      if (func.blocks[pred].terminator().op == Opcode::Jump)
+        return pred;
+    }
+
+    BlockId pre = func.newBlock();
+    Block &entry = func.blocks[pre];
+    Block &target = func.blocks[loop.header];
+    for (size_t i : outside)
+      entry.preds.push_back(target.preds[i]);
+    for (Instr &phi : target.instrs) {
+      if (phi.op != Opcode::Phi)
+        break;
+      Operand incoming = phi.args[outside[0]];
+      if (outside.size() > 1) {
+        Instr merge(Opcode::Phi, func.newValue());
+        for (size_t i : outside)
+          merge.args.push_back(phi.args[i]);
+        incoming = Operand::value(merge.dst);
+        entry.instrs.push_back(std::move(merge));
+      }
+      std::vector<Operand> args;
+      for (size_t i = 0; i < phi.args.size(); i++)
+        if (loop.body[target.preds[i]])
+          args.push_back(phi.args[i]);
+      args.push_back(incoming);
+      phi.args = std::move(args);
+    }
+    std::vector<BlockId> preds;
+    for (BlockId pred : target.preds)
+      if (loop.body[pred])
+        preds.push_back(pred);
+    preds.push_back(pre);
+    target.preds = std::move(preds);
+    for (BlockId pred : entry.preds)
+      for (BlockId &t : func.blocks[pred].terminator().targets)
+        if (t == loop.header)
+          t = pre;
+    Instr jump(Opcode::Jump);
+    jump.targets[0] = loop.header;
+    entry.instrs.push_back(std::move(jump));
+
+    // Lay the preheader out right before the header
+    std::vector<BlockId> order;
+    for (BlockId b = 0; b < pre; b++) {
+      if (b == loop.header)
+        order.push_back(pre);
+      order.push_back(b);
+    }
+    reorderBlocks(func, order);
+    return std::find(order.begin(), order.end(), pre) - order.begin();
+  }
+};
+
+bool hoistLoopInvariants(Module &module, PassContext &) {
+  std::vector<Effects> effects = analyseEffects(module);
+  bool changed = false;
+  for (Function &func : module.functions)
+    changed |= LoopHoisting(func, effects).run();
+  return changed;
+}
+
+} // namespace
+
+const Pass licmPass = {"licm", hoistLoopInvariants};
+
+} // namespace ir
@@ -0,0 +1,605 @@
+#include "lower.hpp"
+#include <algorithm>
+#include <utility>
+#include <variant>
+
+namespace ir {
+namespace {
+
+using FunctionIndex = std::unordered_map<Symbol, uint32_t, SymbolHash>;
+
+class FunctionLowering {
+public:
+  FunctionLowering(Module &m, Function &f, const FunctionIndex &index)
+      : module(m), func(f), functionIndex(index) {}
+
+  void lowerFunction(const FunctionDef *def) {
+    start(addBlock());
+    seal(cur);
+    scopes.emplace_back();
+    for (uint32_t i = 0; i < def->parameters.size(); i++) {
+      ValueId v = emit(Opcode::Param, {Operand::constant(i)});
+      writeVariable(declare(def->parameters[i].name), cur,
+                    Operand::value(v));
+    }
+    lowerStmt(def->body);
+    // Falling off the end returns 0
+    emitReturn(Operand::constant(0));
+    finish();
+  }
+
+  // The top-level code exits with the value of the last variable it
+  // declared, or 0 if there is none
+  void lowerMain(const Program &program) {
+    start(addBlock());
+    seal(cur);
+    scopes.emplace_back();
+    for (StmtPtr stmt : program.statements)
+      if (stmt->kind != StmtKind::FunctionDef)
+        lowerStmt(stmt);
+    emitReturn(lastVar == NO_VAR ? Operand::constant(0)
+                                 : readSource(lastVar));
+    finish();
+  }
+
+private:
+  static constexpr uint32_t NO_VAR = UINT32_MAX;
+
+  Module &module;
+  Function &func;
+  const FunctionIndex &functionIndex;
+
+  BlockId cur = NO_BLOCK;
+  std::vector<BlockId> layout; // blocks in the order lowering started them
+
+  // Source variables: every declaration gets its own number, so shadowed
+  // names never share definitions
+  uint32_t varCount = 0;
+  uint32_t lastVar = NO_VAR;
+  std::vector<std::unordered_map<Symbol, uint32_t, SymbolHash>> scopes;
+  // Folded value of each const, Operand::None for variables. Consts never
+  // enter SSA construction, so a read always sees the literal itself.
+  std::vector<Operand> constants;
+
+  // Braun et al. state, per block
+  std::vector<std::unordered_map<uint32_t, Operand>> currentDef;
+  std::vector<bool> sealed;
+  std::vector<std::vector<std::pair<uint32_t, ValueId>>> incompletePhis;
+  // What each removed trivial phi stands for, indexed by ValueId
+  std::vector<Operand> replaced;
+
+  // String concatenations whose operands were not yet known strings, left
+  // as adds of their operands until finish() folds them
+  std::vector<bool> concatenation;
+
+  BlockId addBlock() {
+    BlockId b = func.newBlock();
+    currentDef.emplace_back();
+    sealed.push_back(false);
+    incompletePhis.emplace_back();
+    return b;
+  }
+
+  void start(BlockId b) {
+    cur = b;
+    layout.push_back(b);
+  }
+
+  // A fresh block with no predecessors, for code following a return
+  void startUnreachable() {
+    start(addBlock());
+    seal(cur);
+  }
+
+  uint32_t declare(Symbol name, Operand constant = {}) {
+    uint32_t var = varCount++;
+    scopes.back()[name] = var;
+    constants.push_back(constant);
+    return var;
+  }
+
+  Operand readSource(uint32_t var) {
+    if (constants[var].kind != Operand::None)
+      return constants[var];
+    return readVariable(var, cur);
+  }
+
+  uint32_t lookup(Symbol name) const {
+    for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+      auto it = scope->find(name);
+      if (it != scope->end())
+        return it->second;
+    }
+    return NO_VAR;
+  }
+
+  ValueId emit(Opcode op, std::vector<Operand> args) {
+    Instr instr(op, func.newValue());
+    instr.args = std::move(args);
+    ValueId dst = instr.dst;
+    func.blocks[cur].instrs.push_back(std::move(instr));
+    return dst;
+  }
+
+  void addEdge(BlockId from, BlockId to) {
+    func.blocks[to].preds.push_back(from);
+  }
+
+  void jump(BlockId to) {
+    Instr instr(Opcode::Jump);
+    instr.targets[0] = to;
+    func.blocks[cur].instrs.push_back(std::move(instr));
+    addEdge(cur, to);
+  }
+
+  void branch(Operand cond, BlockId ifTrue, BlockId ifFalse) {
+    Instr instr(Opcode::Branch);
+    instr.args = {cond};
+    instr.targets[0] = ifTrue;
+    instr.targets[1] = ifFalse;
+    func.blocks[cur].instrs.push_back(std::move(instr));
+    addEdge(cur, ifTrue);
+    addEdge(cur, ifFalse);
+  }
+
+  void emitReturn(Operand value) {
+    Instr instr(Opcode::Return);
+    instr.args = {value};
+    func.blocks[cur].instrs.push_back(std::move(instr));
+  }
+
+  // --- SSA construction -------------------------------------------------
+
+  void writeVariable(uint32_t var, BlockId block, Operand value) {
+    currentDef[block][var] = value;
+  }
+
+  Operand readVariable(uint32_t var, BlockId block) {
+    auto it = currentDef[block].find(var);
+    if (it != currentDef[block].end())
+      return resolve(it->second);
+    return resolve(readVariableRecursive(var, block));
+  }
+
+  Operand resolve(Operand op) const {
+    while (op.isValue() && op.id < replaced.size() &&
+           replaced[op.id].kind != Operand::None)
+      op = replaced[op.id];
+    return op;
+  }
+
+  Operand readVariableRecursive(uint32_t var, BlockId block) {
+    Operand value;
+    const std::vector<BlockId> &preds = func.blocks[block].preds;
+    if (!sealed[block]) {
+      ValueId phi = addPhi(block);
+      incompletePhis[block].push_back({var, phi});
+      value = Operand::value(phi);
+    } else if (preds.empty()) {
+      value = Operand::constant(0); // read before any definition
+    } else if (preds.size() == 1) {
+      value = readVariable(var, preds[0]);
+    } else {
+      // Break cycles through loops by defining the phi before its operands
+      ValueId phi = addPhi(block);
+      writeVariable(var, block, Operand::value(phi));
+      addPhiOperands(var, block, phi);
+      value = tryRemoveTrivialPhi(block, phi);
+    }
+    writeVariable(var, block, value);
+    return value;
+  }
+
+  ValueId addPhi(BlockId block) {
+    std::vector<Instr> &instrs = func.blocks[block].instrs;
+    size_t at = 0;
+    while (at < instrs.size() && instrs[at].op == Opcode::Phi)
+      at++;
+    Instr phi(Opcode::Phi, func.newValue());
+    ValueId dst = phi.dst;
+    instrs.insert(instrs.begin() + at, std::move(phi));
+    return dst;
+  }
+
+  void addPhiOperands(uint32_t var, BlockId block, ValueId phi) {
+    // Reading may add phis to any block, block included, so the operands are
+    // collected before the phi is looked up
+    std::vector<Operand> args;
+    std::vector<BlockId> preds = func.blocks[block].preds;
+    for (BlockId pred : preds)
+      args.push_back(readVariable(var, pred));
+    for (Instr &instr : func.blocks[block].instrs)
+      if (instr.dst == phi) {
+        instr.args = std::move(args);
+        return;
+      }
+  }
+
+  // A complete phi whose operands are all the same value (or the phi
+  // itself) goes, and reads of it see that value from now on. Uses taken
+  // before are rewritten in finish().
+  Operand tryRemoveTrivialPhi(BlockId block, ValueId phi) {
+    std::vector<Instr> &instrs = func.blocks[block].instrs;
+    auto at = std::find_if(instrs.begin(), instrs.end(),
+                           [&](const Instr &instr) { return instr.dst == phi; });
+    Operand same;
+    for (Operand arg : at->args) {
+      arg = resolve(arg);
+      if (arg == same || (arg.isValue() && arg.id == phi))
+        continue;
+      if (same.kind != Operand::None)
+        return Operand::value(phi);
+      same = arg;
+    }
+    // A phi only reachable from itself is never read
+    if (same.kind == Operand::None)
+      same = Operand::constant(0);
+    instrs.erase(at);
+    if (replaced.size() <= phi)
+      replaced.resize(phi + 1);
+    replaced[phi] = same;
+    return same;
+  }
+
+  // All predecessors of block are known: complete its pending phis
+  void seal(BlockId block) {
+    auto pending = std::move(incompletePhis[block]);
+    incompletePhis[block].clear();
+    sealed[block] = true;
+    for (auto &[var, phi] : pending) {
+      addPhiOperands(var, block, phi);
+      tryRemoveTrivialPhi(block, phi);
+    }
+  }
+
+  void finish() {
+    reorderBlocks(func, layout);
+    removeUnreachableBlocks(func);
+    replaced.resize(func.valueCount);
+    replaceValues(func, replaced);
+    removeTrivialPhis(func);
+    foldConcatenations();
+  }
+
+  // Fold the concatenations left by lowerBinary, now that every phi merging
+  // a single string is gone. Each round folds those whose operands are
+  // strings, which may leave more phis trivial and more concatenations
+  // foldable; one that never folds joins strings only known at run time.
+  void foldConcatenations() {
+    concatenation.resize(func.valueCount, false);
+    for (;;) {
+      std::vector<Operand> replacement(func.valueCount);
+      bool pending = false;
+      bool folded = false;
+      for (Block &block : func.blocks) {
+        auto &instrs = block.instrs;
+        instrs.erase(
+            std::remove_if(instrs.begin(), instrs.end(),
+                           [&](const Instr &instr) {
+                             if (instr.dst == NO_VALUE ||
+                                 !concatenation[instr.dst])
+                               return false;
+                             pending = true;
+                             if (!instr.args[0].isStr() ||
+                                 !instr.args[1].isStr())
+                               return false;
+                             replacement[instr.dst] = concatenate(
+                                 instr.args[0], instr.args[1]);
+                             folded = true;
+                             return true;
+                           }),
+            instrs.end());
+      }
+      if (!pending)
+        return;
+      if (!folded)
+        throw LowerError("string concatenation in " + func.label +
+                         " needs strings known at compile time");
+      replaceValues(func, replacement);
+      removeTrivialPhis(func);
+    }
+  }
+
+  Operand concatenate(Operand left, Operand right) {
+    return Operand::string(module.internString(module.strings[left.id] +
+                                               module.strings[right.id]));
+  }
+
+  // --- Statements ------------------------------------------------------
+
+  void lowerStmt(Stmt *stmt) {
+    switch (stmt->kind) {
+    case StmtKind::Expr:
+      lowerExpr(node_cast<ExprStmt>(stmt)->expression);
+      break;
+    case StmtKind::VarDecl: {
+      auto decl = node_cast<VarDeclStmt>(stmt);
+      Operand value = lowerExpr(decl->initializer);
+      if (decl->isConst) {
+        lastVar = declare(decl->name, value);
+        break;
+      }
+      uint32_t var = declare(decl->name);
+      writeVariable(var, cur, value);
+      lastVar = var;
+      break;
+    }
+    case StmtKind::Assign: {
+      auto assign = node_cast<AssignStmt>(stmt);
+      Operand value = lowerExpr(assign->value);
+      uint32_t var = lookup(assign->name);
+      if (var != NO_VAR)
+        writeVariable(var, cur, value);
+      break;
+    }
+    case StmtKind::Block:
+      scopes.emplace_back();
+      for (StmtPtr inner : node_cast<BlockStmt>(stmt)->statements)
+        lowerStmt(inner);
+      scopes.pop_back();
+      break;
+    case StmtKind::If: {
+      auto ifStmt = node_cast<IfStmt>(stmt);
+      BlockId thenBlock = addBlock();
+      BlockId elseBlock = ifStmt->elseBranch ? addBlock() : NO_BLOCK;
+      BlockId end = addBlock();
+      lowerCond(ifStmt->condition, thenBlock,
+                elseBlock != NO_BLOCK ? elseBlock : end);
+
+      seal(thenBlock);
+      start(thenBlock);
+      lowerStmt(ifStmt->thenBranch);
+      jump(end);
+
+      if (elseBlock != NO_BLOCK) {
+        seal(elseBlock);
+        start(elseBlock);
+        lowerStmt(ifStmt->elseBranch);
+        jump(end);
+      }
+      seal(end);
+      start(end);
+      break;
+    }
+    case StmtKind::While: {
+      auto loop = node_cast<WhileStmt>(stmt);
+      BlockId header = addBlock();
+      BlockId body = addBlock();
+      BlockId exit = addBlock();
+      jump(header);
+      start(header); // sealed once the back edge exists
+      lowerCond(loop->condition, body, exit);
+
+      seal(body);
+      start(body);
+      lowerStmt(loop->body);
+      jump(header);
+      seal(header);
+
+      seal(exit);
+      start(exit);
+      break;
+    }
+    case StmtKind::Return: {
+      auto ret = node_cast<ReturnStmt>(stmt);
+      emitReturn(ret->value ? lowerExpr(ret->value) : Operand::constant(0));
+      startUnreachable();
+      break;
+    }
+    case StmtKind::FunctionDef:
+      // Only top-level definitions are compiled, each as its own Function
+      break;
+    }
+  }
+
+  // Branch to ifTrue or ifFalse on cond. && and || (and ! over them) become
+  // chains of branches, so a condition never materialises the booleans of
+  // its operands.
+  void lowerCond(Expr *cond, BlockId ifTrue, BlockId ifFalse) {
+    if (auto bin = node_as<BinaryExpr>(cond)) {
+      if (bin->op == BinaryOp::And || bin->op == BinaryOp::Or) {
+        BlockId right = addBlock();
+        if (bin->op == BinaryOp::And)
+          lowerCond(bin->left, right, ifFalse);
+        else
+          lowerCond(bin->left, ifTrue, right);
+        seal(right);
+        start(right);
+        lowerCond(bin->right, ifTrue, ifFalse);
+        return;
+      }
+    } else if (auto unary = node_as<UnaryExpr>(cond)) {
+      if (unary->op == UnaryOp::Not) {
+        lowerCond(unary->operand, ifFalse, ifTrue);
+        return;
+      }
+    }
+    branch(lowerExpr(cond), ifTrue, ifFalse);
+  }
+
+  // --- Expressions -----------------------------------------------------
+
+  Operand lowerExpr(Expr *expr) {
+    switch (expr->kind) {
+    case ExprKind::Literal: {
+      auto lit = node_cast<LiteralExpr>(expr);
+      if (std::holds_alternative<int>(lit->value))
+        return Operand::constant(std::get<int>(lit->value));
+      if (std::holds_alternative<bool>(lit->value))
+        return Operand::constant(std::get<bool>(lit->value) ? 1 : 0);
+      return Operand::string(
+          module.internString(std::get<std::string_view>(lit->value)));
+    }
+    case ExprKind::Identifier: {
+      uint32_t var = lookup(node_cast<IdentifierExpr>(expr)->name);
+      return var == NO_VAR ? Operand::constant(0) : readSource(var);
+    }
+    case ExprKind::Unary: {
+      auto unary = node_cast<UnaryExpr>(expr);
+      Operand operand = lowerExpr(unary->operand);
+      return Operand::value(emit(
+          unary->op == UnaryOp::Negate ? Opcode::Neg : Opcode::Not,
+          {operand}));
+    }
+    case ExprKind::Binary:
+      return lowerBinary(node_cast<BinaryExpr>(expr));
+    case ExprKind::Call:
+      return lowerCall(node_cast<CallExpr>(expr));
+    }
+    return Operand::constant(0);
+  }
+
+  Operand lowerBinary(BinaryExpr *bin) {
+    if (bin->op == BinaryOp::And || bin->op == BinaryOp::Or) {
+      // Short-circuit: the right operand only runs when the left one does
+      // not decide the result, which is 0 or 1 either way
+      bool isAnd = bin->op == BinaryOp::And;
+      Operand left = lowerExpr(bin->left);
+      BlockId right = addBlock();
+      BlockId end = addBlock();
+      BlockId decided = cur;
+      if (isAnd)
+        branch(left, right, end);
+      else
+        branch(left, end, right);
+
+      seal(right);
+      start(right);
+      ValueId rightValue = emit(Opcode::Test, {lowerExpr(bin->right)});
+      BlockId rightEnd = cur;
+      jump(end);
+
+      seal(end);
+      start(end);
+      ValueId result = addPhi(end);
+      Instr &phi = func.blocks[end].instrs.front();
+      for (BlockId pred : func.blocks[end].preds)
+        phi.args.push_back(pred == rightEnd && pred != decided
+                               ? Operand::value(rightValue)
+                               : Operand::constant(isAnd ? 0 : 1));
+      return Operand::value(result);
+    }
+
+    Operand left = lowerExpr(bin->left);
+    Operand right = lowerExpr(bin->right);
+
+    if (bin->op == BinaryOp::Add && bin->type == Type::String) {
+      // Concatenation only exists at compile time: both sides must be known
+      // strings, though a variable read in a loop may only turn out to be
+      // one once the loop is complete
+      if (left.isStr() && right.isStr())
+        return concatenate(left, right);
+      ValueId dst = emit(Opcode::Add, {left, right});
+      concatenation.resize(func.valueCount, false);
+      concatenation[dst] = true;
+      return Operand::value(dst);
+    }
+
+    Opcode op = Opcode::Add;
+    switch (bin->op) {
+    case BinaryOp::Add:
+      op = Opcode::Add;
+      break;
+    case BinaryOp::Sub:
+      op = Opcode::Sub;
+      break;
+    case BinaryOp::Mul:
+      op = Opcode::Mul;
+      break;
+    case BinaryOp::Div:
+      op = Opcode::Div;
+      break;
+    case BinaryOp::Mod:
+      op = Opcode::Mod;
+      break;
+    case BinaryOp::Equal:
+      op = Opcode::Eq;
+      break;
+    case BinaryOp::NotEqual:
+      op = Opcode::Ne;
+      break;
+    case BinaryOp::Less:
+      op = Opcode::Lt;
+      break;
+    case BinaryOp::LessEqual:
+      op = Opcode::Le;
+      break;
+    case BinaryOp::Greater:
+      op = Opcode::Gt;
+      break;
+    case BinaryOp::GreaterEqual:
+      op = Opcode::Ge;
+      break;
+    case BinaryOp::And:
+    case BinaryOp::Or:
+      break; // handled above
+    }
+    return Operand::value(emit(op, {left, right}));
+  }
+
+  Operand lowerCall(CallExpr *call) {
+    if (call->function == builtin::Print) {
+      // print takes one string; further arguments are not evaluated
+      if (call->arguments.empty())
+        return Operand::constant(0);
+      Instr instr(Opcode::Print);
+      instr.args = {lowerExpr(call->arguments[0])};
+      func.blocks[cur].instrs.push_back(std::move(instr));
+      return Operand::constant(0);
+    }
+
+    auto it = functionIndex.find(call->function);
+    if (it == functionIndex.end())
+      return Operand::constant(0); // unknown function
+    const Function &callee = module.functions[it->second];
+
+    // Arguments are evaluated right to left. Surplus arguments are evaluated
+    // for their effects only, missing ones are 0.
+    std::vector<Operand> args(call->arguments.size());
+    for (size_t i = call->arguments.size(); i-- > 0;)
+      args[i] = lowerExpr(call->arguments[i]);
+    args.resize(callee.paramCount, Operand::constant(0));
+
+    Instr instr(Opcode::Call, func.newValue());
+    instr.args = std::move(args);
+    instr.callee = it->second;
+    ValueId dst = instr.dst;
+    func.blocks[cur].instrs.push_back(std::move(instr));
+    return Operand::value(dst);
+  }
+};
+
+} // namespace
+
+Module lower(const Program &program) {
+  Module module;
+  FunctionIndex functionIndex;
+  std::vector<const FunctionDef *> defs;
+
+  Function &main = module.functions.emplace_back();
+  main.name = builtin::None;
+  main.label = "_start";
+  main.isMain = true;
+
+  for (StmtPtr stmt : program.statements) {
+    auto def = node_as<FunctionDef>(stmt);
+    if (!def || functionIndex.count(def->name))
+      continue;
+    functionIndex.emplace(def->name,
+                          static_cast<uint32_t>(module.functions.size()));
+    defs.push_back(def);
+    Function &func = module.functions.emplace_back();
+    func.name = def->name;
+    func.label = "func_" + symbols().str(def->name);
+    func.paramCount = static_cast<uint32_t>(def->parameters.size());
+  }
+
+  FunctionLowering(module, module.functions[0], functionIndex)
+      .lowerMain(program);
+  for (size_t i = 0; i < defs.size(); i++)
+    FunctionLowering(module, module.functions[i + 1], functionIndex)
+        .lowerFunction(defs[i]);
+  return module;
+}
+
+} // namespace ir
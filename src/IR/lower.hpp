@@ -0,0 +1,32 @@
+#pragma once
+#include "../ast.hpp"
+#include "ir.hpp"
+#include <stdexcept>
+#include <string>
+
+namespace ir {
+
+// A program sema accepts but the IR cannot express, such as a string
+// concatenation whose operands are not known at compile time
+class LowerError : public std::runtime_error {
+public:
+  explicit LowerError(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// Lower a type-annotated program (sema.hpp) to SSA form.
+//
+// SSA is built directly while walking the AST, following Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form"
+// (CC 2013): a variable read looks for its definition in the current block
+// and otherwise asks the predecessors, placing a phi where they may disagree.
+// Blocks whose predecessors are not all known yet (loop headers) are
+// completed once their back edges exist. A phi that turns out to merge a
+// single value is replaced by it as soon as its operands are known, and
+// any left are removed once the function is finished.
+//
+// Functions are numbered like the program: functions[0] is the top-level
+// code, then every FunctionDef in order (the first definition of a name wins).
+// Throws LowerError.
+Module lower(const Program &program);
+
+} // namespace ir
@@ -0,0 +1,27 @@
+#include "pass.hpp"
+
+namespace ir {
+
+void PassManager::run(Module &module, PassContext &context) const {
+  verify(module);
+  for (const Pass &pass : passes) {
+    pass.run(module, context);
+    verify(module);
+  }
+}
+
+PassManager defaultPipeline() {
+  PassManager pipeline;
+  pipeline.add(tailRecursionPass);
+  pipeline.add(inlinePass);
+  pipeline.add(constantPropagationPass);
+  pipeline.add(deadCodePass);
+  pipeline.add(simplifyCfgPass);
+  pipeline.add(deadCodePass); // conditions of branches simplify-cfg folded
+  pipeline.add(licmPass);
+  pipeline.add(deadFunctionsPass);
+  pipeline.add(splitCriticalEdgesPass);
+  return pipeline;
+}
+
+} // namespace ir
@@ -0,0 +1,83 @@
+#pragma once
+#include "ir.hpp"
+#include <string>
+#include <vector>
+
+namespace ir {
+
+// Something a pass did that is worth telling the user about, such as a call
+// it inlined
+struct Remark {
+  const char *pass;
+  std::string message;
+};
+
+// Tuning knobs for one pipeline run, and what the passes report back
+struct PassContext {
+  // Largest callee, by inlineCost, the inliner copies into its callers
+  uint32_t inlineThreshold = 24;
+  std::vector<Remark> remarks;
+};
+
+// A transformation of the module in place. run reports whether it changed
+// anything. Passes are plain functions so the pipeline is a table, like the
+// parser's infixRules.
+struct Pass {
+  const char *name;
+  bool (*run)(Module &module, PassContext &context);
+};
+
+class PassManager {
+public:
+  void add(const Pass &pass) { passes.push_back(pass); }
+
+  // Run every pass in order, verifying the module after each one
+  void run(Module &module, PassContext &context) const;
+
+private:
+  std::vector<Pass> passes;
+};
+
+// Turn calls a function makes to itself right before returning their
+// result into jumps back to its top (tailcall.cpp)
+extern const Pass tailRecursionPass;
+
+// Copy small non-recursive functions into their call sites (inline.cpp),
+// callees before callers, so a call to a helper that itself calls helpers
+// inlines everything at once
+extern const Pass inlinePass;
+
+// The inliner's size estimate of a function: one per instruction, plus one
+// per argument a call pushes
+uint32_t inlineCost(const Function &func);
+
+// Sparse conditional constant propagation (constprop.cpp): folds integer
+// arithmetic and comparisons on known operands, propagates the results
+// through copies and phis, and turns branches on constants into jumps
+extern const Pass constantPropagationPass;
+
+// Drop instructions whose values no call, print, terminator or division
+// that may trap depends on (dce.cpp)
+extern const Pass deadCodePass;
+
+// CFG clean-up (cfg.cpp): folds branches on constants, drops unreachable
+// blocks, merges straight-line block chains and bypasses empty blocks
+extern const Pass simplifyCfgPass;
+
+// Loop-invariant code motion (licm.cpp): computations inside a loop whose
+// operands are all defined outside it move to a preheader. Calls move only
+// to functions that print nothing, directly or through their callees.
+extern const Pass licmPass;
+
+// Drop the functions no chain of calls from the top-level code reaches
+// (deadfunc.cpp); each one is left as a remark naming it
+extern const Pass deadFunctionsPass;
+
+// Give every edge from a branch into a block with phis a block of its own,
+// where the backend can place the phi moves (cfg.cpp)
+extern const Pass splitCriticalEdgesPass;
+
+// The optimisation pipeline, ending with the passes the backend relies on
+PassManager defaultPipeline();
+
+} // namespace ir
@@ -0,0 +1,106 @@
+#include "pass.hpp"
+#include <algorithm>
+#include <iterator>
+
+namespace ir {
+namespace {
+
+// A function returning the result of a call to itself jumps back to the top
+// instead: the old entry becomes a loop header whose phis take the
+// parameters on the way in and the call's arguments on every back edge.
+// The entry block keeps only the Params, since it can't have predecessors.
+bool eliminateTailRecursion(Function &func, uint32_t self) {
+  std::vector<BlockId> sites;
+  for (BlockId b = 0; b < func.blocks.size(); b++) {
+    const Block &block = func.blocks[b];
+    size_t last = block.instrs.size() - 1;
+    if (last > 0 && isTailCall(block, last - 1) &&
+        block.instrs[last - 1].callee == self)
+      sites.push_back(b);
+  }
+  if (sites.empty())
+    return false;
+
+  BlockId header = func.newBlock();
+  Block &entry = func.blocks[0];
+  std::vector<ValueId> params(func.paramCount, NO_VALUE);
+  auto body = std::stable_partition(
+      entry.instrs.begin(), entry.instrs.end(),
+      [](const Instr &instr) { return instr.op == Opcode::Param; });
+  for (auto it = entry.instrs.begin(); it != body; ++it)
+    params[it->args[0].imm] = it->dst;
+  func.blocks[header].instrs.assign(
+      std::make_move_iterator(body),
+      std::make_move_iterator(entry.instrs.end()));
+  entry.instrs.erase(body, entry.instrs.end());
+  Instr enter(Opcode::Jump);
+  enter.targets[0] = header;
+  entry.instrs.push_back(std::move(enter));
+  for (BlockId succ : successors(func.blocks[header]))
+    for (BlockId &pred : func.blocks[succ].preds)
+      if (pred == 0)
+        pred = header;
+  if (std::find(sites.begin(), sites.end(), 0) != sites.end())
+    *std::find(sites.begin(), sites.end(), 0) = header;
+
+  // Inside the loop a parameter is the phi's value
+  std::vector<ValueId> phis(func.paramCount, NO_VALUE);
+  for (uint32_t i = 0; i < func.paramCount; i++)
+    if (params[i] != NO_VALUE)
+      phis[i] = func.newValue();
+  std::vector<Operand> replacement(func.valueCount);
+  for (uint32_t i = 0; i < func.paramCount; i++)
+    if (params[i] != NO_VALUE)
+      replacement[params[i]] = Operand::value(phis[i]);
+  replaceValues(func, replacement);
+
+  Block &loop = func.blocks[header];
+  loop.preds = {0};
+  std::vector<Instr> headerPhis;
+  for (uint32_t i = 0; i < func.paramCount; i++) {
+    if (phis[i] == NO_VALUE)
+      continue;
+    Instr phi(Opcode::Phi, phis[i]);
+    phi.args.push_back(Operand::value(params[i]));
+    headerPhis.push_back(std::move(phi));
+  }
+  for (BlockId site : sites) {
+    Block &block = func.blocks[site];
+    Instr call = std::move(block.instrs[block.instrs.size() - 2]);
+    block.instrs.erase(block.instrs.end() - 2, block.instrs.end());
+    Instr jump(Opcode::Jump);
+    jump.targets[0] = header;
+    block.instrs.push_back(std::move(jump));
+    loop.preds.push_back(site);
+    size_t k = 0;
+    for (uint32_t i = 0; i < func.paramCount; i++)
+      if (phis[i] != NO_VALUE)
+        headerPhis[k++].args.push_back(call.args[i]);
+  }
+  loop.instrs.insert(loop.instrs.begin(),
+                     std::make_move_iterator(headerPhis.begin()),
+                     std::make_move_iterator(headerPhis.end()));
+
+  // Keep the header right after the entry
+  std::vector<BlockId> order = {0, header};
+  for (BlockId b = 1; b < header; b++)
+    order.push_back(b);
+  reorderBlocks(func, order);
+  // Parameters every call passes on unchanged need no phi
+  removeTrivialPhis(func);
+  return true;
+}
+
+bool eliminateTailRecursion(Module &module, PassContext &) {
+  bool changed = false;
+  for (uint32_t f = 0; f < module.functions.size(); f++)
+    if (!module.functions[f].isMain)
+      changed |= eliminateTailRecursion(module.functions[f], f);
+  return changed;
+}
+
+} // namespace
+
+const Pass tailRecursionPass = {"tail-recursion", eliminateTailRecursion};
+
+} // namespace ir
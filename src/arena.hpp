@@ -0,0 +1,111 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Fixed-size array living in an Arena. Does not own its elements.
+template <typename T> class Span {
+public:
+  Span() = default;
+  Span(T *data, uint32_t count) : items(data), count(count) {}
+
+  T *begin() const { return items; }
+  T *end() const { return items + count; }
+  std::reverse_iterator<T *> rbegin() const {
+    return std::reverse_iterator<T *>(end());
+  }
+  std::reverse_iterator<T *> rend() const {
+    return std::reverse_iterator<T *>(begin());
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  T &operator[](size_t i) const { return items[i]; }
+
+private:
+  T *items = nullptr;
+  uint32_t count = 0;
+};
+
+// Bump-pointer allocator backed by contiguous slabs. Everything allocated
+// from an arena is released at once when the arena goes away; destructors
+// are never run, so only trivially destructible data may live here.
+class Arena {
+public:
+  Arena() = default;
+  Arena(Arena &&) = default;
+  Arena &operator=(Arena &&) = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t size, size_t align) {
+    uintptr_t p = (reinterpret_cast<uintptr_t>(cursor) + align - 1) &
+                  ~(uintptr_t(align) - 1);
+    if (cursor == nullptr || p + size > reinterpret_cast<uintptr_t>(limit)) {
+      grow(size + align);
+      p = (reinterpret_cast<uintptr_t>(cursor) + align - 1) &
+          ~(uintptr_t(align) - 1);
+    }
+    cursor = reinterpret_cast<char *>(p + size);
+    return reinterpret_cast<void *>(p);
+  }
+
+  template <typename T, typename... Args> T *make(Args &&...args) {
+    return new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+  }
+
+  // Copy [first, last) into the arena
+  template <typename T> Span<T> copy(const T *first, const T *last) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "arena arrays must be trivially copyable");
+    size_t count = last - first;
+    if (count == 0)
+      return Span<T>();
+    T *data = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+    memcpy(data, first, sizeof(T) * count);
+    return Span<T>(data, static_cast<uint32_t>(count));
+  }
+
+  std::string_view copyString(std::string_view text) {
+    if (text.empty())
+      return std::string_view();
+    char *data = static_cast<char *>(allocate(text.size(), 1));
+    memcpy(data, text.data(), text.size());
+    return std::string_view(data, text.size());
+  }
+
+  // Take over the slabs of other, so everything allocated from it lives as
+  // long as this arena. other is left empty.
+  void adopt(Arena &&other) {
+    for (Slab &slab : other.slabs)
+      slabs.push_back(std::move(slab));
+    other.slabs.clear();
+    other.cursor = other.limit = nullptr;
+  }
+
+private:
+  static constexpr size_t SLAB_SIZE = 64 * 1024;
+
+  struct Slab {
+    std::unique_ptr<char[]> memory;
+    size_t size;
+  };
+
+  void grow(size_t min_size) {
+    size_t size = min_size > SLAB_SIZE ? min_size : SLAB_SIZE;
+    slabs.push_back({std::unique_ptr<char[]>(new char[size]), size});
+    cursor = slabs.back().memory.get();
+    limit = cursor + size;
+  }
+
+  std::vector<Slab> slabs;
+  char *cursor = nullptr;
+  char *limit = nullptr;
+};
@@ -1,29 +1,150 @@
 #include "ast.hpp"
+#include "lexer.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <iostream>
 #include <stdexcept>
 
 #define INDENT_LEVEL 2
+
+// Pratt parser table: binding power and operator of every token that can
+// continue an expression as a binary operator. Precedence 0 ends the
+// expression, so all other tokens fall out of the loop in parseExpression.
+enum Precedence : uint8_t {
+  PREC_NONE,
+  PREC_OR,         // ||
+  PREC_AND,        // &&
+  PREC_EQUALITY,   // == !=
+  PREC_COMPARISON, // < <= > >=
+  PREC_TERM,       // + -
+  PREC_FACTOR,     // * / %
+};
+
+struct InfixRule {
+  uint8_t precedence;
+  BinaryOp op;
+};
+
+static constexpr size_t TOKEN_KIND_COUNT =
+    static_cast<size_t>(TokenKind::Unknown) + 1;
+
+static constexpr std::array<InfixRule, TOKEN_KIND_COUNT> makeInfixRules() {
+  std::array<InfixRule, TOKEN_KIND_COUNT> rules{};
+  auto set = [&rules](TokenKind kind, uint8_t precedence, BinaryOp op) {
+    rules[static_cast<size_t>(kind)] = {precedence, op};
+  };
+  set(TokenKind::Or, PREC_OR, BinaryOp::Or);
+  set(TokenKind::And, PREC_AND, BinaryOp::And);
+  set(TokenKind::EqualEqual, PREC_EQUALITY, BinaryOp::Equal);
+  set(TokenKind::NotEqual, PREC_EQUALITY, BinaryOp::NotEqual);
+  set(TokenKind::Less, PREC_COMPARISON, BinaryOp::Less);
+  set(TokenKind::LessEqual, PREC_COMPARISON, BinaryOp::LessEqual);
+  set(TokenKind::Greater, PREC_COMPARISON, BinaryOp::Greater);
+  set(TokenKind::GreaterEqual, PREC_COMPARISON, BinaryOp::GreaterEqual);
+  set(TokenKind::Plus, PREC_TERM, BinaryOp::Add);
+  set(TokenKind::Minus, PREC_TERM, BinaryOp::Sub);
+  set(TokenKind::Multiply, PREC_FACTOR, BinaryOp::Mul);
+  set(TokenKind::Divide, PREC_FACTOR, BinaryOp::Div);
+  set(TokenKind::Modulo, PREC_FACTOR, BinaryOp::Mod);
+  return rules;
+}
+
+static constexpr std::array<InfixRule, TOKEN_KIND_COUNT> infixRules =
+    makeInfixRules();
+
+const char *binaryOpText(BinaryOp op) {
+  switch (op) {
+  case BinaryOp::Add:
+    return "+";
+  case BinaryOp::Sub:
+    return "-";
+  case BinaryOp::Mul:
+    return "*";
+  case BinaryOp::Div:
+    return "/";
+  case BinaryOp::Mod:
+    return "%";
+  case BinaryOp::Equal:
+    return "==";
+  case BinaryOp::NotEqual:
+    return "!=";
+  case BinaryOp::Less:
+    return "<";
+  case BinaryOp::LessEqual:
+    return "<=";
+  case BinaryOp::Greater:
+    return ">";
+  case BinaryOp::GreaterEqual:
+    return ">=";
+  case BinaryOp::And:
+    return "&&";
+  case BinaryOp::Or:
+    return "||";
+  }
+  return "?";
+}
+
+const char *unaryOpText(UnaryOp op) {
+  return op == UnaryOp::Negate ? "-" : "!";
+}
+
+const char *typeName(Type type) {
+  switch (type) {
+  case Type::Unknown:
+    return "unknown";
+  case Type::Int:
+    return "int";
+  case Type::Bool:
+    return "bool";
+  case Type::String:
+    return "string";
+  }
+  return "?";
+}
+
 class Parser {
 private:
-  const std::vector<Token> &tokens;
-  size_t current = 0;
+  TokenCursor &tokens;
+  Arena &arena;
+
+  // Scratch stacks for child lists. Nested lists push on top and are copied
+  // into the arena once complete, so building a node allocates nothing else.
+  std::vector<StmtPtr> stmt_stack;
+  std::vector<ExprPtr> expr_stack;
+  std::vector<FunctionParam> param_stack;
+
+  template <typename T>
+  Span<T> popSpan(std::vector<T> &stack, size_t start) {
+    Span<T> span = arena.copy(stack.data() + start, stack.data() + stack.size());
+    stack.erase(stack.begin() + start, stack.end());
+    return span;
+  }
+
+  bool isAtEnd() const { return peekKind() == TokenKind::EndOfFile; }
+
+  TokenKind peekKind() const { return tokens.peek().kind; }
+
+  int line() const { return tokens.peek().pos.line; }
 
-  bool isAtEnd() const { return peek().kind == TokenKind::EndOfFile; }
+  std::string_view previousLexeme() const { return tokens.previous().lexeme; }
 
-  const Token &peek() const { return tokens[current]; }
+  TokenKind previousKind() const { return tokens.previous().kind; }
 
-  const Token &previous() const { return tokens[current - 1]; }
+  Symbol previousSymbol() const {
+    return std::get<Symbol>(tokens.previous().literal);
+  }
 
-  const Token &advance() {
+  void advance() {
     if (!isAtEnd())
-      current++;
-    return previous();
+      tokens.advance();
   }
 
   bool check(TokenKind kind) const {
     if (isAtEnd())
       return false;
-    return peek().kind == kind;
+    return peekKind() == kind;
   }
 
   bool match(TokenKind kind) {
@@ -39,12 +160,11 @@ private:
       advance();
       return;
     }
-    throw std::runtime_error(message + " at line " +
-                             std::to_string(peek().pos.line));
+    throw std::runtime_error(message + " at line " + std::to_string(line()));
   }
 
 public:
-  explicit Parser(const std::vector<Token> &toks) : tokens(toks) {}
+  Parser(TokenCursor &toks, Arena &nodes) : tokens(toks), arena(nodes) {}
 
   std::vector<StmtPtr> parse() {
     std::vector<StmtPtr> statements;
@@ -58,7 +178,9 @@ public:
     if (match(TokenKind::Define))
       return parseFunctionDef();
     if (match(TokenKind::Var))
-      return parseVarDecl();
+      return parseVarDecl(false);
+    if (match(TokenKind::Const))
+      return parseVarDecl(true);
     if (match(TokenKind::If))
       return parseIfStmt();
     if (match(TokenKind::While))
@@ -68,41 +190,40 @@ public:
     if (match(TokenKind::LBrace))
       return parseBlockStmt();
 
-    if (check(TokenKind::Identifier)) {
-      size_t saved = current;
+    // Assignment needs one token of lookahead past the identifier
+    if (check(TokenKind::Identifier) &&
+        tokens.peekNext().kind == TokenKind::Equals) {
       advance(); // consume identifier
-      if (match(TokenKind::Equals)) {
-        std::string name = tokens[saved].lexeme;
-        ExprPtr value = parseExpression();
-        expect(TokenKind::Semicolon, "Expected ';' after assignment");
-        return std::make_unique<AssignStmt>(name, std::move(value));
-      }
-      current = saved; // backtrack
+      Symbol name = previousSymbol();
+      advance(); // consume '='
+      ExprPtr value = parseExpression();
+      expect(TokenKind::Semicolon, "Expected ';' after assignment");
+      return arena.make<AssignStmt>(name, value);
     }
 
     return parseExprStmt();
   }
 
-  // var x = expression;
-  StmtPtr parseVarDecl() {
+  // var x = expression;  or  const x = expression;
+  StmtPtr parseVarDecl(bool isConst) {
     expect(TokenKind::Identifier, "Expected variable name");
-    std::string name = previous().lexeme;
+    Symbol name = previousSymbol();
 
     expect(TokenKind::Equals, "Expected '=' after variable name");
     ExprPtr initializer = parseExpression();
     expect(TokenKind::Semicolon, "Expected ';' after variable declaration");
 
-    return std::make_unique<VarDeclStmt>(name, std::move(initializer), false); // var means mutable, so isConst = false
+    return arena.make<VarDeclStmt>(name, initializer, isConst);
   }
 
   // define foo(var a, var b) { body }
   StmtPtr parseFunctionDef() {
     expect(TokenKind::Identifier, "Expected function name");
-    std::string name = previous().lexeme;
+    Symbol name = previousSymbol();
 
     expect(TokenKind::Lpar, "Expected '(' after function name");
 
-    std::vector<FunctionParam> parameters;
+    size_t params_start = param_stack.size();
     if (!check(TokenKind::Rpar)) {
       do {
         bool isMutable = false;
@@ -110,18 +231,18 @@ public:
           isMutable = true;
         }
         expect(TokenKind::Identifier, "Expected parameter name");
-        std::string paramName = previous().lexeme;
-        parameters.emplace_back(paramName, !isMutable); // isConst is opposite of isMutable
+        Symbol paramName = previousSymbol();
+        param_stack.emplace_back(paramName, !isMutable); // isConst is opposite of isMutable
       } while (match(TokenKind::Comma));
     }
 
     expect(TokenKind::Rpar, "Expected ')' after parameters");
     expect(TokenKind::LBrace, "Expected '{' before function body");
 
+    Span<FunctionParam> parameters = popSpan(param_stack, params_start);
     StmtPtr body = parseBlockStmt();
 
-    return std::make_unique<FunctionDef>(name, std::move(parameters),
-                                         std::move(body));
+    return arena.make<FunctionDef>(name, parameters, body);
   }
 
   // if (condition) statement [else statement]
@@ -137,8 +258,7 @@ public:
       elseBranch = parseStatement();
     }
 
-    return std::make_unique<IfStmt>(std::move(condition), std::move(thenBranch),
-                                    std::move(elseBranch));
+    return arena.make<IfStmt>(condition, thenBranch, elseBranch);
   }
 
   // while (condition) statement
@@ -149,7 +269,7 @@ public:
 
     StmtPtr body = parseStatement();
 
-    return std::make_unique<WhileStmt>(std::move(condition), std::move(body));
+    return arena.make<WhileStmt>(condition, body);
   }
 
   // return [expression];
@@ -161,84 +281,42 @@ public:
     }
 
     expect(TokenKind::Semicolon, "Expected ';' after return statement");
-    return std::make_unique<ReturnStmt>(std::move(value));
+    return arena.make<ReturnStmt>(value);
   }
 
   // { statement* }
   StmtPtr parseBlockStmt() {
-    std::vector<StmtPtr> statements;
+    size_t start = stmt_stack.size();
 
     while (!check(TokenKind::RBrace) && !isAtEnd()) {
-      statements.push_back(parseStatement());
+      StmtPtr stmt = parseStatement();
+      stmt_stack.push_back(stmt);
     }
 
     expect(TokenKind::RBrace, "Expected '}' after block");
-    return std::make_unique<BlockStmt>(std::move(statements));
+    return arena.make<BlockStmt>(popSpan(stmt_stack, start));
   }
 
   // expression;
   StmtPtr parseExprStmt() {
     ExprPtr expr = parseExpression();
     expect(TokenKind::Semicolon, "Expected ';' after expression");
-    return std::make_unique<ExprStmt>(std::move(expr));
+    return arena.make<ExprStmt>(expr);
   }
 
-  ExprPtr parseExpression() { return parseEquality(); }
-
-  ExprPtr parseEquality() {
-    ExprPtr expr = parseComparison();
-
-    while (match(TokenKind::EqualEqual)) {
-      std::string op = previous().lexeme;
-      ExprPtr right = parseComparison();
-      expr =
-          std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
-    }
-
-    return expr;
-  }
-
-  // < >
-  ExprPtr parseComparison() {
-    ExprPtr expr = parseTerm();
-
-    while (check(TokenKind::Less) || check(TokenKind::Greater)) {
-      advance();
-      std::string op = previous().lexeme;
-      ExprPtr right = parseTerm();
-      expr =
-          std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
-    }
-
-    return expr;
-  }
-
-  // + -
-  ExprPtr parseTerm() {
-    ExprPtr expr = parseFactor();
-
-    while (check(TokenKind::Plus) || check(TokenKind::Minus)) {
-      advance();
-      std::string op = previous().lexeme;
-      ExprPtr right = parseFactor();
-      expr =
-          std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
-    }
-
-    return expr;
-  }
-
-  // * / %
-  ExprPtr parseFactor() {
+  // Binary operators by precedence climbing over infixRules: the right operand
+  // only takes operators that bind tighter, which makes every level left
+  // associative.
+  ExprPtr parseExpression(uint8_t minPrecedence = PREC_OR) {
     ExprPtr expr = parseUnary();
 
-    while (check(TokenKind::Multiply) || check(TokenKind::Divide) ||
-           check(TokenKind::Modulo)) {
+    for (;;) {
+      const InfixRule &rule = infixRules[static_cast<size_t>(peekKind())];
+      if (rule.precedence == PREC_NONE || rule.precedence < minPrecedence)
+        break;
       advance();
-      std::string op = previous().lexeme;
-      ExprPtr right = parseUnary();
-      expr =
-          std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+      ExprPtr right = parseExpression(rule.precedence + 1);
+      expr = arena.make<BinaryExpr>(rule.op, expr, right);
     }
 
     return expr;
@@ -248,9 +326,10 @@ public:
   ExprPtr parseUnary() {
     if (check(TokenKind::Minus) || check(TokenKind::Not)) {
       advance();
-      std::string op = previous().lexeme;
+      UnaryOp op = previousKind() == TokenKind::Minus ? UnaryOp::Negate
+                                                      : UnaryOp::Not;
       ExprPtr right = parseUnary();
-      return std::make_unique<UnaryExpr>(op, std::move(right));
+      return arena.make<UnaryExpr>(op, right);
     }
 
     return parsePrimary();
@@ -259,42 +338,46 @@ public:
   ExprPtr parsePrimary() {
     // Literals
     if (match(TokenKind::Number)) {
-      int value = std::get<int>(previous().literal);
-      return std::make_unique<LiteralExpr>(value);
+      int value = std::get<int>(tokens.previous().literal);
+      return arena.make<LiteralExpr>(value);
     }
 
     if (match(TokenKind::String)) {
-      std::string value = std::get<std::string>(previous().literal);
-      return std::make_unique<LiteralExpr>(value);
+      std::string_view raw = previousLexeme();
+      std::string_view value = stringNeedsDecoding(raw)
+                                   ? arena.copyString(decodeString(raw))
+                                   : arena.copyString(raw);
+      return arena.make<LiteralExpr>(value);
     }
 
     if (match(TokenKind::True)) {
-      return std::make_unique<LiteralExpr>(true);
+      return arena.make<LiteralExpr>(true);
     }
 
     if (match(TokenKind::False)) {
-      return std::make_unique<LiteralExpr>(false);
+      return arena.make<LiteralExpr>(false);
     }
 
     // Identifier or function call
     if (match(TokenKind::Identifier)) {
-      std::string name = previous().lexeme;
+      Symbol name = previousSymbol();
 
       // Check for function call
       if (match(TokenKind::Lpar)) {
-        std::vector<ExprPtr> args;
+        size_t start = expr_stack.size();
 
         if (!check(TokenKind::Rpar)) {
           do {
-            args.push_back(parseExpression());
+            ExprPtr arg = parseExpression();
+            expr_stack.push_back(arg);
           } while (match(TokenKind::Comma));
         }
 
         expect(TokenKind::Rpar, "Expected ')' after arguments");
-        return std::make_unique<CallExpr>(name, std::move(args));
+        return arena.make<CallExpr>(name, popSpan(expr_stack, start));
       }
 
-      return std::make_unique<IdentifierExpr>(name);
+      return arena.make<IdentifierExpr>(name);
     }
 
     // Parenthesized expression
@@ -305,13 +388,119 @@ public:
     }
 
     throw std::runtime_error("Expected expression at line " +
-                             std::to_string(peek().pos.line));
+                             std::to_string(line()));
   }
 };
 
-std::vector<StmtPtr> Program::tokens_to_ast(const std::vector<Token> &tokens) {
-  Parser parser(tokens);
-  return parser.parse();
+Program Program::tokens_to_ast(TokenCursor &tokens) {
+  Arena arena;
+  Parser parser(tokens, arena);
+  std::vector<StmtPtr> statements = parser.parse();
+  return Program(std::move(statements), std::move(arena));
+}
+
+Program Program::tokens_to_ast(const TokenBuffer &tokens) {
+  TokenCursor cursor(tokens);
+  return tokens_to_ast(cursor);
+}
+
+namespace {
+// Tokens [begin, end) holding one top-level `define` or the run of other
+// top-level statements between two of them
+struct TokenRange {
+  size_t begin;
+  size_t end;
+  bool is_function;
+};
+} // namespace
+
+// Split the token stream into top-level ranges, in source order. A `define`
+// at brace depth 0 runs to the brace closing its body. Returns false when the
+// braces don't match up; the serial parser then reports the error.
+static bool splitTopLevel(const TokenBuffer &tokens,
+                          std::vector<TokenRange> &ranges) {
+  const std::vector<TokenKind> &kinds = tokens.kinds;
+  size_t eof = tokens.size() - 1;
+  size_t start = 0;
+  int depth = 0;
+
+  for (size_t i = 0; i < eof; i++) {
+    if (kinds[i] == TokenKind::LBrace) {
+      depth++;
+    } else if (kinds[i] == TokenKind::RBrace) {
+      if (--depth < 0)
+        return false;
+    } else if (kinds[i] == TokenKind::Define && depth == 0) {
+      if (start < i)
+        ranges.push_back({start, i, false});
+
+      size_t j = i + 1;
+      while (j < eof && kinds[j] != TokenKind::LBrace)
+        j++;
+      int body = 0;
+      for (; j < eof; j++) {
+        if (kinds[j] == TokenKind::LBrace) {
+          body++;
+        } else if (kinds[j] == TokenKind::RBrace && --body == 0) {
+          break;
+        }
+      }
+      if (j == eof)
+        return false;
+
+      ranges.push_back({i, j + 1, true});
+      start = j + 1;
+      i = j;
+    }
+  }
+
+  if (start < eof)
+    ranges.push_back({start, eof, false});
+  return true;
+}
+
+Program Program::tokens_to_ast(const TokenBuffer &tokens, unsigned threads) {
+  std::vector<TokenRange> ranges;
+  if (threads <= 1 || !splitTopLevel(tokens, ranges) || ranges.size() < 2)
+    return tokens_to_ast(tokens);
+
+  // One arena per worker; ranges are parsed independently and their
+  // statements stitched back together in source order below.
+  unsigned workers = std::min<size_t>(threads, ranges.size());
+  std::vector<Arena> arenas(workers);
+  std::vector<std::vector<StmtPtr>> parsed(ranges.size());
+  std::atomic<bool> failed{false};
+
+  parallelFor(ranges.size(), workers, [&](size_t i, unsigned worker) {
+    if (failed)
+      return;
+    const TokenRange &range = ranges[i];
+    try {
+      TokenCursor cursor(tokens, range.begin, range.end);
+      Parser parser(cursor, arenas[worker]);
+      parsed[i] = parser.parse();
+      if (range.is_function && parsed[i].size() != 1)
+        failed = true;
+    } catch (const std::exception &) {
+      failed = true;
+    }
+  });
+
+  // Errors are rare; re-parse serially so they read exactly as without -j
+  if (failed)
+    return tokens_to_ast(tokens);
+
+  Program program;
+  size_t count = 0;
+  for (const auto &stmts : parsed)
+    count += stmts.size();
+  program.statements.reserve(count);
+  for (const auto &stmts : parsed)
+    program.statements.insert(program.statements.end(), stmts.begin(),
+                              stmts.end());
+  for (Arena &arena : arenas)
+    program.arena.adopt(std::move(arena));
+  return program;
 }
 
 std::string getIndent(int level) {
@@ -321,94 +510,131 @@ std::string getIndent(int level) {
 void printExpr(std::ostream &out, const Expr *expr, int indent) {
   std::string ind = getIndent(indent);
 
-  if (auto *lit = dynamic_cast<const LiteralExpr *>(expr)) {
+  switch (expr->kind) {
+  case ExprKind::Literal: {
+    auto *lit = node_cast<LiteralExpr>(expr);
     out << ind << "LiteralExpr: ";
     if (std::holds_alternative<int>(lit->value)) {
       out << std::get<int>(lit->value);
     } else if (std::holds_alternative<bool>(lit->value)) {
       out << (std::get<bool>(lit->value) ? "true" : "false");
-    } else if (std::holds_alternative<std::string>(lit->value)) {
-      out << "\"" << std::get<std::string>(lit->value) << "\"";
+    } else if (std::holds_alternative<std::string_view>(lit->value)) {
+      out << "\"" << std::get<std::string_view>(lit->value) << "\"";
     }
     out << "\n";
-  } else if (auto *id = dynamic_cast<const IdentifierExpr *>(expr)) {
-    out << ind << "IdentifierExpr: " << id->name << "\n";
-  } else if (auto *bin = dynamic_cast<const BinaryExpr *>(expr)) {
-    out << ind << "BinaryExpr: " << bin->op << "\n";
+    break;
+  }
+  case ExprKind::Identifier: {
+    auto *id = node_cast<IdentifierExpr>(expr);
+    out << ind << "IdentifierExpr: " << symbols().name(id->name) << "\n";
+    break;
+  }
+  case ExprKind::Binary: {
+    auto *bin = node_cast<BinaryExpr>(expr);
+    out << ind << "BinaryExpr: " << binaryOpText(bin->op) << "\n";
     out << ind << "  Left:\n";
-    printExpr(out, bin->left.get(), indent + INDENT_LEVEL);
+    printExpr(out, bin->left, indent + INDENT_LEVEL);
     out << ind << "  Right:\n";
-    printExpr(out, bin->right.get(), indent + INDENT_LEVEL);
-  } else if (auto *un = dynamic_cast<const UnaryExpr *>(expr)) {
-    out << ind << "UnaryExpr: " << un->op << "\n";
+    printExpr(out, bin->right, indent + INDENT_LEVEL);
+    break;
+  }
+  case ExprKind::Unary: {
+    auto *un = node_cast<UnaryExpr>(expr);
+    out << ind << "UnaryExpr: " << unaryOpText(un->op) << "\n";
     out << ind << "  Operand:\n";
-    printExpr(out, un->operand.get(), indent + INDENT_LEVEL);
-  } else if (auto *call = dynamic_cast<const CallExpr *>(expr)) {
-    out << ind << "CallExpr: " << call->function << "\n";
+    printExpr(out, un->operand, indent + INDENT_LEVEL);
+    break;
+  }
+  case ExprKind::Call: {
+    auto *call = node_cast<CallExpr>(expr);
+    out << ind << "CallExpr: " << symbols().name(call->function) << "\n";
     out << ind << "  Arguments (" << call->arguments.size() << "):\n";
     for (const auto &arg : call->arguments) {
-      printExpr(out, arg.get(), indent + INDENT_LEVEL);
+      printExpr(out, arg, indent + INDENT_LEVEL);
     }
-  } else {
-    out << ind << "UnknownExpr\n";
+    break;
+  }
   }
 }
 
 void printStmt(std::ostream &out, const Stmt *stmt, int indent) {
   std::string ind = getIndent(indent);
 
-  if (auto *expr = dynamic_cast<const ExprStmt *>(stmt)) {
+  switch (stmt->kind) {
+  case StmtKind::Expr: {
+    auto *expr = node_cast<ExprStmt>(stmt);
     out << ind << "ExprStmt:\n";
-    printExpr(out, expr->expression.get(), indent + INDENT_LEVEL / 2);
-  } else if (auto *varDecl = dynamic_cast<const VarDeclStmt *>(stmt)) {
-    out << ind << "VarDeclStmt: " << varDecl->name
+    printExpr(out, expr->expression, indent + INDENT_LEVEL / 2);
+    break;
+  }
+  case StmtKind::VarDecl: {
+    auto *varDecl = node_cast<VarDeclStmt>(stmt);
+    out << ind << "VarDeclStmt: " << symbols().name(varDecl->name)
         << (varDecl->isConst ? " (const)" : " (mutable)") << "\n";
     out << ind << "  Initializer:\n";
-    printExpr(out, varDecl->initializer.get(), indent + INDENT_LEVEL);
-  } else if (auto *assign = dynamic_cast<const AssignStmt *>(stmt)) {
-    out << ind << "AssignStmt: " << assign->name << "\n";
+    printExpr(out, varDecl->initializer, indent + INDENT_LEVEL);
+    break;
+  }
+  case StmtKind::Assign: {
+    auto *assign = node_cast<AssignStmt>(stmt);
+    out << ind << "AssignStmt: " << symbols().name(assign->name) << "\n";
     out << ind << "  Value:\n";
-    printExpr(out, assign->value.get(), indent + INDENT_LEVEL);
-  } else if (auto *block = dynamic_cast<const BlockStmt *>(stmt)) {
+    printExpr(out, assign->value, indent + INDENT_LEVEL);
+    break;
+  }
+  case StmtKind::Block: {
+    auto *block = node_cast<BlockStmt>(stmt);
     out << ind << "BlockStmt (" << block->statements.size()
         << " statements):\n";
     for (const auto &s : block->statements) {
-      printStmt(out, s.get(), indent + INDENT_LEVEL / 2);
+      printStmt(out, s, indent + INDENT_LEVEL / 2);
     }
-  } else if (auto *ifStmt = dynamic_cast<const IfStmt *>(stmt)) {
+    break;
+  }
+  case StmtKind::If: {
+    auto *ifStmt = node_cast<IfStmt>(stmt);
     out << ind << "IfStmt:\n";
     out << ind << "  Condition:\n";
-    printExpr(out, ifStmt->condition.get(), indent + INDENT_LEVEL);
+    printExpr(out, ifStmt->condition, indent + INDENT_LEVEL);
     out << ind << "  Then:\n";
-    printStmt(out, ifStmt->thenBranch.get(), indent + INDENT_LEVEL);
+    printStmt(out, ifStmt->thenBranch, indent + INDENT_LEVEL);
     if (ifStmt->elseBranch) {
       out << ind << "  Else:\n";
-      printStmt(out, ifStmt->elseBranch.get(), indent + INDENT_LEVEL);
+      printStmt(out, ifStmt->elseBranch, indent + INDENT_LEVEL);
     }
-  } else if (auto *whileStmt = dynamic_cast<const WhileStmt *>(stmt)) {
+    break;
+  }
+  case StmtKind::While: {
+    auto *whileStmt = node_cast<WhileStmt>(stmt);
     out << ind << "WhileStmt:\n";
     out << ind << "  Cond:\n";
-    printExpr(out, whileStmt->condition.get(), indent + INDENT_LEVEL);
+    printExpr(out, whileStmt->condition, indent + INDENT_LEVEL);
     out << ind << "  Body:\n";
-    printStmt(out, whileStmt->body.get(), indent + INDENT_LEVEL);
-  } else if (auto *ret = dynamic_cast<const ReturnStmt *>(stmt)) {
+    printStmt(out, whileStmt->body, indent + INDENT_LEVEL);
+    break;
+  }
+  case StmtKind::Return: {
+    auto *ret = node_cast<ReturnStmt>(stmt);
     out << ind << "ReturnStmt:\n";
     if (ret->value) {
       out << ind << "  Value:\n";
-      printExpr(out, ret->value.get(), indent + INDENT_LEVEL);
+      printExpr(out, ret->value, indent + INDENT_LEVEL);
     } else {
       out << ind << "  NULL (no value assigned)\n";
     }
-  } else if (auto *funcDef = dynamic_cast<const FunctionDef *>(stmt)) {
-    out << ind << "FunctionDef: " << funcDef->name << "\n";
+    break;
+  }
+  case StmtKind::FunctionDef: {
+    auto *funcDef = node_cast<FunctionDef>(stmt);
+    out << ind << "FunctionDef: " << symbols().name(funcDef->name) << "\n";
     out << ind << "  Parameters (" << funcDef->parameters.size() << "):\n";
     for (const auto &param : funcDef->parameters) {
-      out << ind << "    " << param.name << (param.isConst ? " (const)" : "")
-          << "\n";
+      out << ind << "    " << symbols().name(param.name)
+          << (param.isConst ? " (const)" : "") << "\n";
     }
     out << ind << "  Body:\n";
-    printStmt(out, funcDef->body.get(), indent + INDENT_LEVEL);
-  } else {
-    out << ind << "UnknownStmt\n";
+    printStmt(out, funcDef->body, indent + INDENT_LEVEL);
+    break;
+  }
   }
 }
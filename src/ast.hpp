@@ -1,164 +1,266 @@
 #pragma once
+#include "arena.hpp"
+#include <cstdint>
 #include "token.hpp"
-#include <memory>
-#include <string>
+#include <ostream>
+#include <string_view>
 #include <variant>
 #include <vector>
 class Expr;
 class Stmt;
+class TokenCursor;
+
+// Nodes are owned by the Arena of the Program they belong to
+using ExprPtr = Expr *;
+using StmtPtr = Stmt *;
+
+enum class ExprKind : uint8_t { Literal, Identifier, Binary, Unary, Call };
+
+enum class StmtKind : uint8_t {
+  Expr,
+  VarDecl,
+  Assign,
+  Block,
+  If,
+  While,
+  Return,
+  FunctionDef
+};
+
+enum class BinaryOp : uint8_t {
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Mod,
+  Equal,
+  NotEqual,
+  Less,
+  LessEqual,
+  Greater,
+  GreaterEqual,
+  And, // short-circuit &&
+  Or,  // short-circuit ||
+};
+
+enum class UnaryOp : uint8_t { Negate, Not };
+
+const char *binaryOpText(BinaryOp op);
+const char *unaryOpText(UnaryOp op);
 
-using ExprPtr = std::unique_ptr<Expr>;
-using StmtPtr = std::unique_ptr<Stmt>;
+// Value types, inferred by the semantic pass (sema.hpp) before code
+// generation. Everything is Unknown straight out of the parser.
+enum class Type : uint8_t { Unknown, Int, Bool, String };
 
+const char *typeName(Type type);
+
+// Every node carries its kind so passes dispatch with a switch instead of
+// probing with dynamic_cast. Concrete classes expose it as KIND for
+// node_cast/node_as below.
 class Expr {
 public:
-  virtual ~Expr() = default;
+  const ExprKind kind;
+  Type type = Type::Unknown;
+
+protected:
+  explicit Expr(ExprKind k) : kind(k) {}
 };
 
 class LiteralExpr : public Expr {
 public:
-  std::variant<int, bool, std::string> value;
+  static constexpr ExprKind KIND = ExprKind::Literal;
+  std::variant<int, bool, std::string_view> value; // strings live in the arena
 
-  explicit LiteralExpr(std::variant<int, bool, std::string> val)
-      : value(std::move(val)) {}
+  explicit LiteralExpr(std::variant<int, bool, std::string_view> val)
+      : Expr(KIND), value(val) {}
 };
 
 class IdentifierExpr : public Expr {
 public:
-  std::string name;
+  static constexpr ExprKind KIND = ExprKind::Identifier;
+  Symbol name;
 
-  explicit IdentifierExpr(std::string n) : name(std::move(n)) {}
+  explicit IdentifierExpr(Symbol n) : Expr(KIND), name(n) {}
 };
 
 class BinaryExpr : public Expr {
 public:
-  std::string op; // "+", "-", "*", "/", "%", "==", "<", ">"
+  static constexpr ExprKind KIND = ExprKind::Binary;
+  BinaryOp op;
   ExprPtr left;
   ExprPtr right;
 
-  BinaryExpr(std::string operation, ExprPtr l, ExprPtr r)
-      : op(std::move(operation)), left(std::move(l)), right(std::move(r)) {}
+  BinaryExpr(BinaryOp operation, ExprPtr l, ExprPtr r)
+      : Expr(KIND), op(operation), left(l), right(r) {}
 };
 
 class UnaryExpr : public Expr {
 public:
-  std::string op; // "-", "!"
+  static constexpr ExprKind KIND = ExprKind::Unary;
+  UnaryOp op;
   ExprPtr operand;
 
-  UnaryExpr(std::string operation, ExprPtr expr)
-      : op(std::move(operation)), operand(std::move(expr)) {}
+  UnaryExpr(UnaryOp operation, ExprPtr expr)
+      : Expr(KIND), op(operation), operand(expr) {}
 };
 
 // foo(a, b, c)
 class CallExpr : public Expr {
 public:
-  std::string function;
-  std::vector<ExprPtr> arguments;
+  static constexpr ExprKind KIND = ExprKind::Call;
+  Symbol function;
+  Span<ExprPtr> arguments;
 
-  CallExpr(std::string func, std::vector<ExprPtr> args)
-      : function(std::move(func)), arguments(std::move(args)) {}
+  CallExpr(Symbol func, Span<ExprPtr> args)
+      : Expr(KIND), function(func), arguments(args) {}
 };
 
 class Stmt {
 public:
-  virtual ~Stmt() = default;
+  const StmtKind kind;
+
+protected:
+  explicit Stmt(StmtKind k) : kind(k) {}
 };
 
 // x + 5;
 class ExprStmt : public Stmt {
 public:
+  static constexpr StmtKind KIND = StmtKind::Expr;
   ExprPtr expression;
 
-  explicit ExprStmt(ExprPtr expr) : expression(std::move(expr)) {}
+  explicit ExprStmt(ExprPtr expr) : Stmt(KIND), expression(expr) {}
 };
 
 // var x = 10;
 class VarDeclStmt : public Stmt {
 public:
-  std::string name;
+  static constexpr StmtKind KIND = StmtKind::VarDecl;
+  Symbol name;
   ExprPtr initializer;
   bool isConst;
 
-  VarDeclStmt(std::string n, ExprPtr init, bool constant = false)
-      : name(std::move(n)), initializer(std::move(init)), isConst(constant) {}
+  VarDeclStmt(Symbol n, ExprPtr init, bool constant = false)
+      : Stmt(KIND), name(n), initializer(init), isConst(constant) {}
 };
 
 // x = 42;
 class AssignStmt : public Stmt {
 public:
-  std::string name;
+  static constexpr StmtKind KIND = StmtKind::Assign;
+  Symbol name;
   ExprPtr value;
 
-  AssignStmt(std::string n, ExprPtr val)
-      : name(std::move(n)), value(std::move(val)) {}
+  AssignStmt(Symbol n, ExprPtr val) : Stmt(KIND), name(n), value(val) {}
 };
 
 //{ stmt1; stmt2; ... }
 class BlockStmt : public Stmt {
 public:
-  std::vector<StmtPtr> statements;
+  static constexpr StmtKind KIND = StmtKind::Block;
+  Span<StmtPtr> statements;
 
-  explicit BlockStmt(std::vector<StmtPtr> stmts)
-      : statements(std::move(stmts)) {}
+  explicit BlockStmt(Span<StmtPtr> stmts) : Stmt(KIND), statements(stmts) {}
 };
 
 // if (condition) thenBranch else elseBranch
 class IfStmt : public Stmt {
 public:
+  static constexpr StmtKind KIND = StmtKind::If;
   ExprPtr condition;
   StmtPtr thenBranch;
   StmtPtr elseBranch; // can be nullptr
 
   IfStmt(ExprPtr cond, StmtPtr thenBr, StmtPtr elseBr = nullptr)
-      : condition(std::move(cond)), thenBranch(std::move(thenBr)),
-        elseBranch(std::move(elseBr)) {}
+      : Stmt(KIND), condition(cond), thenBranch(thenBr), elseBranch(elseBr) {
+  }
 };
 
 // while (condition) body
 class WhileStmt : public Stmt {
 public:
+  static constexpr StmtKind KIND = StmtKind::While;
   ExprPtr condition;
   StmtPtr body;
 
-  WhileStmt(ExprPtr cond, StmtPtr b)
-      : condition(std::move(cond)), body(std::move(b)) {}
+  WhileStmt(ExprPtr cond, StmtPtr b) : Stmt(KIND), condition(cond), body(b) {}
 };
 
 // Return statement: return expr;
 class ReturnStmt : public Stmt {
 public:
+  static constexpr StmtKind KIND = StmtKind::Return;
   ExprPtr value; // can be nullptr for void return
 
-  explicit ReturnStmt(ExprPtr val = nullptr) : value(std::move(val)) {}
+  explicit ReturnStmt(ExprPtr val = nullptr) : Stmt(KIND), value(val) {}
 };
 
 struct FunctionParam {
-  std::string name;
+  Symbol name;
   bool isConst;
+  Type type = Type::Unknown; // inferred from the call sites
 
-  FunctionParam(std::string n, bool constant = true)
-      : name(std::move(n)), isConst(constant) {}
+  FunctionParam(Symbol n, bool constant = true) : name(n), isConst(constant) {}
 };
 
 // Function definition: define foo(a, b) { body }
 // Or with mutable params: define foo(var a, var b) { body }
 class FunctionDef : public Stmt {
 public:
-  std::string name;
-  std::vector<FunctionParam> parameters;
+  static constexpr StmtKind KIND = StmtKind::FunctionDef;
+  Symbol name;
+  Span<FunctionParam> parameters;
   StmtPtr body;
+  Type returnType = Type::Unknown; // inferred from the return statements
 
-  FunctionDef(std::string n, std::vector<FunctionParam> params, StmtPtr b)
-      : name(std::move(n)), parameters(std::move(params)), body(std::move(b)) {}
+  FunctionDef(Symbol n, Span<FunctionParam> params, StmtPtr b)
+      : Stmt(KIND), name(n), parameters(params), body(b) {}
 };
 
 class Program {
 public:
-  static std::vector<StmtPtr> tokens_to_ast(const std::vector<Token> &tokens);
+  static Program tokens_to_ast(TokenCursor &tokens);
+  static Program tokens_to_ast(const TokenBuffer &tokens);
+  // Parse top-level `define`s on up to `threads` threads. The result is
+  // identical to the serial parse, including the error for invalid input.
+  static Program tokens_to_ast(const TokenBuffer &tokens, unsigned threads);
   std::vector<StmtPtr> statements;
+  Arena arena; // owns every node reachable from statements
 
-  explicit Program(std::vector<StmtPtr> stmts) : statements(std::move(stmts)) {}
+  Program() = default;
+  Program(std::vector<StmtPtr> stmts, Arena nodes)
+      : statements(std::move(stmts)), arena(std::move(nodes)) {}
 };
 
+// Checked downcast: the node as T if it is one, nullptr otherwise
+template <typename T> T *node_as(Expr *expr) {
+  return expr && expr->kind == T::KIND ? static_cast<T *>(expr) : nullptr;
+}
+template <typename T> const T *node_as(const Expr *expr) {
+  return expr && expr->kind == T::KIND ? static_cast<const T *>(expr)
+                                       : nullptr;
+}
+template <typename T> T *node_as(Stmt *stmt) {
+  return stmt && stmt->kind == T::KIND ? static_cast<T *>(stmt) : nullptr;
+}
+template <typename T> const T *node_as(const Stmt *stmt) {
+  return stmt && stmt->kind == T::KIND ? static_cast<const T *>(stmt)
+                                       : nullptr;
+}
+
+// Downcast for code that has already switched on the kind
+template <typename T> T *node_cast(Expr *expr) {
+  return static_cast<T *>(expr);
+}
+template <typename T> const T *node_cast(const Expr *expr) {
+  return static_cast<const T *>(expr);
+}
+template <typename T> T *node_cast(Stmt *stmt) {
+  return static_cast<T *>(stmt);
+}
+template <typename T> const T *node_cast(const Stmt *stmt) {
+  return static_cast<const T *>(stmt);
+}
+
 void printExpr(std::ostream &out, const Expr *expr, int indent);
 void printStmt(std::ostream &out, const Stmt *stmt, int indent);
@@ -0,0 +1,542 @@
+#include "ast_cache.hpp"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+namespace {
+
+// Bump whenever the parser's output changes for the same source
+constexpr uint32_t CACHE_VERSION = 2;
+constexpr char CACHE_MAGIC[4] = {'F', 'A', 'S', 'T'};
+
+// Node images are only meaningful to a build with the same class layouts
+constexpr uint64_t layoutSignature() {
+  uint64_t sig = sizeof(void *);
+  auto mix = [&sig](size_t size, size_t align) {
+    sig = sig * 1000003 + size * 31 + align;
+  };
+  mix(sizeof(LiteralExpr), alignof(LiteralExpr));
+  mix(sizeof(IdentifierExpr), alignof(IdentifierExpr));
+  mix(sizeof(BinaryExpr), alignof(BinaryExpr));
+  mix(sizeof(UnaryExpr), alignof(UnaryExpr));
+  mix(sizeof(CallExpr), alignof(CallExpr));
+  mix(sizeof(ExprStmt), alignof(ExprStmt));
+  mix(sizeof(VarDeclStmt), alignof(VarDeclStmt));
+  mix(sizeof(AssignStmt), alignof(AssignStmt));
+  mix(sizeof(BlockStmt), alignof(BlockStmt));
+  mix(sizeof(IfStmt), alignof(IfStmt));
+  mix(sizeof(WhileStmt), alignof(WhileStmt));
+  mix(sizeof(ReturnStmt), alignof(ReturnStmt));
+  mix(sizeof(FunctionParam), alignof(FunctionParam));
+  mix(sizeof(FunctionDef), alignof(FunctionDef));
+  return sig;
+}
+
+struct CacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t layout;
+  uint64_t source_hash;
+  uint64_t source_size;
+  uint64_t image_size;      // size of the whole file
+  uint64_t image_hash;      // hashSource of everything after the header
+  uint64_t statements;      // offset of the top-level StmtPtr array
+  uint64_t symbols;         // offset of the name table
+  uint32_t statement_count;
+  uint32_t symbol_count;
+};
+
+// Offsets stand in for pointers inside the image. Offset 0 is the header, so
+// it doubles as nullptr.
+template <typename T> T *fromOffset(uint64_t offset) {
+  return reinterpret_cast<T *>(static_cast<uintptr_t>(offset));
+}
+
+// Serializes a Program bottom-up: children are written before their parent,
+// so a node is copied into the image once with its offsets already known.
+class ImageWriter {
+public:
+  std::vector<char> image;
+  std::vector<Symbol> names; // local index -> symbol
+
+  ImageWriter() { image.resize(sizeof(CacheHeader)); }
+
+  uint64_t expr(const Expr *expr) {
+    if (!expr)
+      return 0;
+    switch (expr->kind) {
+    case ExprKind::Literal: {
+      LiteralExpr node = *node_cast<LiteralExpr>(expr);
+      if (auto *text = std::get_if<std::string_view>(&node.value))
+        node.value = std::string_view(
+            fromOffset<const char>(bytes(text->data(), text->size())),
+            text->size());
+      return put(node);
+    }
+    case ExprKind::Identifier: {
+      IdentifierExpr node = *node_cast<IdentifierExpr>(expr);
+      node.name = symbol(node.name);
+      return put(node);
+    }
+    case ExprKind::Binary: {
+      BinaryExpr node = *node_cast<BinaryExpr>(expr);
+      node.left = fromOffset<Expr>(this->expr(node.left));
+      node.right = fromOffset<Expr>(this->expr(node.right));
+      return put(node);
+    }
+    case ExprKind::Unary: {
+      UnaryExpr node = *node_cast<UnaryExpr>(expr);
+      node.operand = fromOffset<Expr>(this->expr(node.operand));
+      return put(node);
+    }
+    case ExprKind::Call: {
+      CallExpr node = *node_cast<CallExpr>(expr);
+      node.function = symbol(node.function);
+      node.arguments = list(node.arguments);
+      return put(node);
+    }
+    }
+    return 0;
+  }
+
+  uint64_t stmt(const Stmt *stmt) {
+    if (!stmt)
+      return 0;
+    switch (stmt->kind) {
+    case StmtKind::Expr: {
+      ExprStmt node = *node_cast<ExprStmt>(stmt);
+      node.expression = fromOffset<Expr>(expr(node.expression));
+      return put(node);
+    }
+    case StmtKind::VarDecl: {
+      VarDeclStmt node = *node_cast<VarDeclStmt>(stmt);
+      node.name = symbol(node.name);
+      node.initializer = fromOffset<Expr>(expr(node.initializer));
+      return put(node);
+    }
+    case StmtKind::Assign: {
+      AssignStmt node = *node_cast<AssignStmt>(stmt);
+      node.name = symbol(node.name);
+      node.value = fromOffset<Expr>(expr(node.value));
+      return put(node);
+    }
+    case StmtKind::Block: {
+      BlockStmt node = *node_cast<BlockStmt>(stmt);
+      node.statements = list(node.statements);
+      return put(node);
+    }
+    case StmtKind::If: {
+      IfStmt node = *node_cast<IfStmt>(stmt);
+      node.condition = fromOffset<Expr>(expr(node.condition));
+      node.thenBranch = fromOffset<Stmt>(this->stmt(node.thenBranch));
+      node.elseBranch = fromOffset<Stmt>(this->stmt(node.elseBranch));
+      return put(node);
+    }
+    case StmtKind::While: {
+      WhileStmt node = *node_cast<WhileStmt>(stmt);
+      node.condition = fromOffset<Expr>(expr(node.condition));
+      node.body = fromOffset<Stmt>(this->stmt(node.body));
+      return put(node);
+    }
+    case StmtKind::Return: {
+      ReturnStmt node = *node_cast<ReturnStmt>(stmt);
+      node.value = fromOffset<Expr>(expr(node.value));
+      return put(node);
+    }
+    case StmtKind::FunctionDef: {
+      FunctionDef node = *node_cast<FunctionDef>(stmt);
+      node.name = symbol(node.name);
+      std::vector<FunctionParam> params(node.parameters.begin(),
+                                        node.parameters.end());
+      for (FunctionParam &param : params)
+        param.name = symbol(param.name);
+      node.parameters = Span<FunctionParam>(
+          fromOffset<FunctionParam>(array(params.data(), params.size())),
+          static_cast<uint32_t>(params.size()));
+      node.body = fromOffset<Stmt>(this->stmt(node.body));
+      return put(node);
+    }
+    }
+    return 0;
+  }
+
+  // Encoded copy of a list of child nodes
+  Span<ExprPtr> list(Span<ExprPtr> nodes) {
+    std::vector<ExprPtr> encoded;
+    encoded.reserve(nodes.size());
+    for (const Expr *node : nodes)
+      encoded.push_back(fromOffset<Expr>(expr(node)));
+    return Span<ExprPtr>(
+        fromOffset<ExprPtr>(array(encoded.data(), encoded.size())),
+        static_cast<uint32_t>(encoded.size()));
+  }
+
+  Span<StmtPtr> list(Span<StmtPtr> nodes) {
+    std::vector<StmtPtr> encoded;
+    encoded.reserve(nodes.size());
+    for (const Stmt *node : nodes)
+      encoded.push_back(fromOffset<Stmt>(stmt(node)));
+    return Span<StmtPtr>(
+        fromOffset<StmtPtr>(array(encoded.data(), encoded.size())),
+        static_cast<uint32_t>(encoded.size()));
+  }
+
+  template <typename T> uint64_t array(const T *items, size_t count) {
+    if (count == 0)
+      return 0;
+    uint64_t offset = reserve(sizeof(T) * count, alignof(T));
+    memcpy(image.data() + offset, items, sizeof(T) * count);
+    return offset;
+  }
+
+  uint64_t bytes(const char *data, size_t size) {
+    return array(data, size);
+  }
+
+private:
+  template <typename T> uint64_t put(const T &node) {
+    uint64_t offset = reserve(sizeof(T), alignof(T));
+    memcpy(image.data() + offset, static_cast<const void *>(&node), sizeof(T));
+    return offset;
+  }
+
+  uint64_t reserve(size_t size, size_t align) {
+    size_t offset = (image.size() + align - 1) & ~(align - 1);
+    image.resize(offset + size);
+    return offset;
+  }
+
+  Symbol symbol(Symbol sym) {
+    auto [it, inserted] =
+        local_ids.emplace(sym.id, static_cast<uint32_t>(names.size()));
+    if (inserted)
+      names.push_back(sym);
+    return Symbol{it->second};
+  }
+
+  std::unordered_map<uint32_t, uint32_t> local_ids;
+};
+
+// Turns offsets back into pointers and local symbol indices back into
+// symbols of this process. The image is checksummed, but every offset is
+// still bounds-checked so a bad entry is rejected rather than followed.
+class ImageLoader {
+public:
+  ImageLoader(char *base, size_t size, std::vector<Symbol> symbols)
+      : base(base), size(size), symbols(std::move(symbols)) {}
+
+  bool failed = false;
+
+  ExprPtr expr(ExprPtr encoded) {
+    Expr *expr = at<Expr>(encoded, sizeof(Expr));
+    if (!expr)
+      return nullptr;
+    switch (expr->kind) {
+    case ExprKind::Literal: {
+      auto *node = checked<LiteralExpr>(expr);
+      if (!node)
+        break;
+      if (auto *text = std::get_if<std::string_view>(&node->value))
+        *text = std::string_view(
+            text->empty() ? nullptr : at<const char>(text->data(), text->size()),
+            text->size());
+      break;
+    }
+    case ExprKind::Identifier:
+      if (auto *node = checked<IdentifierExpr>(expr))
+        node->name = symbol(node->name);
+      break;
+    case ExprKind::Binary:
+      if (auto *node = checked<BinaryExpr>(expr)) {
+        node->left = this->expr(node->left);
+        node->right = this->expr(node->right);
+      }
+      break;
+    case ExprKind::Unary:
+      if (auto *node = checked<UnaryExpr>(expr))
+        node->operand = this->expr(node->operand);
+      break;
+    case ExprKind::Call:
+      if (auto *node = checked<CallExpr>(expr)) {
+        node->function = symbol(node->function);
+        node->arguments = list(node->arguments);
+      }
+      break;
+    default:
+      failed = true;
+      break;
+    }
+    return expr;
+  }
+
+  StmtPtr stmt(StmtPtr encoded) {
+    Stmt *stmt = at<Stmt>(encoded, sizeof(Stmt));
+    if (!stmt)
+      return nullptr;
+    switch (stmt->kind) {
+    case StmtKind::Expr:
+      if (auto *node = checked<ExprStmt>(stmt))
+        node->expression = expr(node->expression);
+      break;
+    case StmtKind::VarDecl:
+      if (auto *node = checked<VarDeclStmt>(stmt)) {
+        node->name = symbol(node->name);
+        node->initializer = expr(node->initializer);
+      }
+      break;
+    case StmtKind::Assign:
+      if (auto *node = checked<AssignStmt>(stmt)) {
+        node->name = symbol(node->name);
+        node->value = expr(node->value);
+      }
+      break;
+    case StmtKind::Block:
+      if (auto *node = checked<BlockStmt>(stmt))
+        node->statements = list(node->statements);
+      break;
+    case StmtKind::If:
+      if (auto *node = checked<IfStmt>(stmt)) {
+        node->condition = expr(node->condition);
+        node->thenBranch = this->stmt(node->thenBranch);
+        node->elseBranch = this->stmt(node->elseBranch);
+      }
+      break;
+    case StmtKind::While:
+      if (auto *node = checked<WhileStmt>(stmt)) {
+        node->condition = expr(node->condition);
+        node->body = this->stmt(node->body);
+      }
+      break;
+    case StmtKind::Return:
+      if (auto *node = checked<ReturnStmt>(stmt))
+        node->value = expr(node->value);
+      break;
+    case StmtKind::FunctionDef:
+      if (auto *node = checked<FunctionDef>(stmt)) {
+        node->name = symbol(node->name);
+        FunctionParam *params = at<FunctionParam>(
+            node->parameters.begin(),
+            sizeof(FunctionParam) * node->parameters.size());
+        node->parameters = Span<FunctionParam>(
+            params, params ? static_cast<uint32_t>(node->parameters.size()) : 0);
+        for (FunctionParam &param : node->parameters)
+          param.name = symbol(param.name);
+        node->body = this->stmt(node->body);
+      }
+      break;
+    default:
+      failed = true;
+      break;
+    }
+    return stmt;
+  }
+
+  template <typename T> Span<T> list(Span<T> encoded) {
+    T *items = at<T>(encoded.begin(), sizeof(T) * encoded.size());
+    if (!items)
+      return Span<T>();
+    Span<T> span(items, static_cast<uint32_t>(encoded.size()));
+    for (T &item : span) {
+      if constexpr (std::is_same_v<T, ExprPtr>)
+        item = expr(item);
+      else
+        item = stmt(item);
+    }
+    return span;
+  }
+
+  // Rebase an encoded pointer to `bytes` bytes; nullptr for null or when the
+  // range is outside the image
+  template <typename T, typename U> T *at(U *encoded, size_t bytes) {
+    uint64_t offset = reinterpret_cast<uintptr_t>(encoded);
+    if (offset == 0 || failed)
+      return nullptr;
+    if (offset < sizeof(CacheHeader) || offset > size || bytes > size - offset) {
+      failed = true;
+      return nullptr;
+    }
+    return reinterpret_cast<T *>(base + offset);
+  }
+
+private:
+  // The full node behind a base pointer, once its kind is known
+  template <typename T, typename Base> T *checked(Base *node) {
+    uint64_t offset = reinterpret_cast<char *>(node) - base;
+    if (sizeof(T) > size - offset) {
+      failed = true;
+      return nullptr;
+    }
+    return node_cast<T>(node);
+  }
+
+  Symbol symbol(Symbol local) {
+    if (local.id >= symbols.size()) {
+      failed = true;
+      return builtin::None;
+    }
+    return symbols[local.id];
+  }
+
+  char *base;
+  size_t size;
+  std::vector<Symbol> symbols;
+};
+
+} // namespace
+
+uint64_t hashSource(std::string_view text) {
+  // Word-at-a-time multiply/rotate, finished with the murmur3 avalanche
+  const uint64_t K = 0x9e3779b97f4a7c15ull;
+  uint64_t h = text.size() * K;
+  size_t i = 0;
+  for (; i + 8 <= text.size(); i += 8) {
+    uint64_t word;
+    memcpy(&word, text.data() + i, 8);
+    h ^= word;
+    h = ((h << 29) | (h >> 35)) * K;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, text.data() + i, text.size() - i);
+  h ^= tail;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+std::string astCachePath(const std::string &cache_dir,
+                         std::string_view source) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.ast",
+           static_cast<unsigned long long>(hashSource(source)));
+  return (std::filesystem::path(cache_dir) / name).string();
+}
+
+bool saveAstCache(const std::string &path, std::string_view source,
+                  const Program &program) {
+  ImageWriter writer;
+  std::vector<StmtPtr> statements;
+  statements.reserve(program.statements.size());
+  for (const Stmt *stmt : program.statements)
+    statements.push_back(fromOffset<Stmt>(writer.stmt(stmt)));
+  uint64_t statements_offset =
+      writer.array(statements.data(), statements.size());
+
+  uint64_t symbols_offset = writer.image.size();
+  for (Symbol sym : writer.names) {
+    std::string_view name = symbols().name(sym);
+    uint32_t length = static_cast<uint32_t>(name.size());
+    const char *raw = reinterpret_cast<const char *>(&length);
+    writer.image.insert(writer.image.end(), raw, raw + sizeof(length));
+    writer.image.insert(writer.image.end(), name.begin(), name.end());
+  }
+
+  CacheHeader header{};
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version = CACHE_VERSION;
+  header.layout = layoutSignature();
+  header.source_hash = hashSource(source);
+  header.source_size = source.size();
+  header.image_size = writer.image.size();
+  header.image_hash = hashSource(
+      std::string_view(writer.image.data() + sizeof(header),
+                       writer.image.size() - sizeof(header)));
+  header.statements = statements_offset;
+  header.symbols = symbols_offset;
+  header.statement_count = static_cast<uint32_t>(statements.size());
+  header.symbol_count = static_cast<uint32_t>(writer.names.size());
+  memcpy(writer.image.data(), &header, sizeof(header));
+
+  std::error_code ec;
+  std::filesystem::path target(path);
+  if (target.has_parent_path())
+    std::filesystem::create_directories(target.parent_path(), ec);
+
+  std::string temp = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream out(temp, std::ios::binary);
+    if (!out)
+      return false;
+    out.write(writer.image.data(), writer.image.size());
+    if (!out)
+      return false;
+  }
+  if (std::rename(temp.c_str(), path.c_str()) != 0) {
+    std::remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool loadAstCache(const std::string &path, std::string_view source,
+                  Program &program) {
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in)
+    return false;
+  std::streamoff file_size = in.tellg();
+  if (file_size < static_cast<std::streamoff>(sizeof(CacheHeader)))
+    return false;
+
+  CacheHeader header;
+  in.seekg(0);
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CACHE_VERSION || header.layout != layoutSignature() ||
+      header.image_size != static_cast<uint64_t>(file_size) ||
+      header.source_size != source.size() ||
+      header.source_hash != hashSource(source) ||
+      header.symbols > header.image_size)
+    return false;
+
+  // The whole image becomes the program's arena
+  Arena arena;
+  size_t size = header.image_size;
+  char *base = static_cast<char *>(arena.allocate(size, alignof(CacheHeader)));
+  in.seekg(0);
+  in.read(base, size);
+  if (!in || hashSource(std::string_view(base + sizeof(header),
+                                         size - sizeof(header))) !=
+                 header.image_hash)
+    return false;
+
+  std::vector<Symbol> names;
+  names.reserve(header.symbol_count);
+  size_t pos = header.symbols;
+  for (uint32_t i = 0; i < header.symbol_count; i++) {
+    uint32_t length;
+    if (sizeof(length) > size - pos)
+      return false;
+    memcpy(&length, base + pos, sizeof(length));
+    pos += sizeof(length);
+    if (length > size - pos)
+      return false;
+    names.push_back(symbols().intern(std::string_view(base + pos, length)));
+    pos += length;
+  }
+
+  ImageLoader loader(base, size, std::move(names));
+  std::vector<StmtPtr> statements;
+  if (header.statement_count > 0) {
+    StmtPtr *roots =
+        loader.at<StmtPtr>(fromOffset<StmtPtr>(header.statements),
+                           sizeof(StmtPtr) * header.statement_count);
+    if (!roots)
+      return false;
+    statements.reserve(header.statement_count);
+    for (uint32_t i = 0; i < header.statement_count; i++)
+      statements.push_back(loader.stmt(roots[i]));
+  }
+  if (loader.failed)
+    return false;
+
+  program = Program(std::move(statements), std::move(arena));
+  return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "ast.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// On-disk cache of parsed programs, keyed by a hash of the source bytes.
+//
+// A cache file is an image of the AST nodes exactly as they sit in memory,
+// with every pointer replaced by its offset into the file and every symbol by
+// an index into a name table at the end. Loading reads the file into one
+// arena allocation and rebases the pointers in a single walk over the tree;
+// nothing is re-parsed.
+
+// 64-bit hash of a source file's contents
+uint64_t hashSource(std::string_view text);
+
+// Path of the cache entry for `source` inside cache_dir
+std::string astCachePath(const std::string &cache_dir, std::string_view source);
+
+// Load the program cached at path for `source`. Returns false (leaving
+// program untouched) when there is no usable entry: missing file, different
+// source, or a cache written by an incompatible compiler build.
+bool loadAstCache(const std::string &path, std::string_view source,
+                  Program &program);
+
+// Write program to path, creating the cache directory if needed. The entry
+// is written to a temporary file and renamed into place, so concurrent
+// compilers never see a partial entry. Returns false if it can't be written.
+bool saveAstCache(const std::string &path, std::string_view source,
+                  const Program &program);
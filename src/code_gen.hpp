@@ -1,4 +1,18 @@
 #pragma once
-#include "ast.hpp"
+#include "IR/ir.hpp"
+#include <cstdint>
 #include <iostream>
-void ast_to_bin(std::ostream &out, const Program &program);
+#include <vector>
+
+struct CodegenOptions {
+  // Multiply and divide by constants with shifts, lea and multiply-high
+  // sequences instead of imul and idiv
+  bool strength_reduction = true;
+  // When set, the number of rewrites by each rule of peephole_rules
+  // (CogeGen/peephole.hpp) is added to it
+  std::vector<uint32_t> *peephole_hits = nullptr;
+};
+
+// Emit an optimised module (pass.hpp) as x86_64 NASM assembly
+void ir_to_bin(std::ostream &out, const ir::Module &module,
+               const CodegenOptions &options = {});
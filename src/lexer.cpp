@@ -1,145 +1,390 @@
 #include "lexer.hpp"
+#include "parallel.hpp"
 #include "token.hpp"
-#include <cctype>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <fstream>
-#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
-static bool isAtEnd(size_t pos, string_view source) {
-  return pos >= source.length();
+// Character classes used by the scanner. Every byte of the input is mapped to
+// exactly one class so the main loop dispatches on a single table lookup
+// instead of calling isspace/isdigit/isalnum for every character.
+enum CharClass : uint8_t {
+  CC_Other,    // anything we don't know about -> Unknown token
+  CC_Space,    // ' ', \t, \v, \f, \r
+  CC_Newline,  // \n
+  CC_Digit,    // 0-9
+  CC_Alpha,    // a-z, A-Z
+  CC_Quote,    // "
+  CC_Operator, // = ! < > & | (may start a two character operator)
+  CC_Single,   // single character token, kind in singleCharKind
+};
+
+static constexpr array<uint8_t, 256> makeCharClassTable() {
+  array<uint8_t, 256> table{};
+  for (int c = 0; c < 256; c++)
+    table[c] = CC_Other;
+  table[' '] = table['\t'] = table['\v'] = table['\f'] = table['\r'] = CC_Space;
+  table['\n'] = CC_Newline;
+  for (int c = '0'; c <= '9'; c++)
+    table[c] = CC_Digit;
+  for (int c = 'a'; c <= 'z'; c++)
+    table[c] = CC_Alpha;
+  for (int c = 'A'; c <= 'Z'; c++)
+    table[c] = CC_Alpha;
+  table['"'] = CC_Quote;
+  for (char c : {'=', '!', '<', '>', '&', '|'})
+    table[static_cast<uint8_t>(c)] = CC_Operator;
+  for (char c : {'{', '}', '(', ')', ';', ',', '+', '-', '*', '/', '%'})
+    table[static_cast<uint8_t>(c)] = CC_Single;
+  return table;
+}
+
+static constexpr array<TokenKind, 256> makeSingleCharKindTable() {
+  array<TokenKind, 256> table{};
+  for (int c = 0; c < 256; c++)
+    table[c] = TokenKind::Unknown;
+  table['{'] = TokenKind::LBrace;
+  table['}'] = TokenKind::RBrace;
+  table['('] = TokenKind::Lpar;
+  table[')'] = TokenKind::Rpar;
+  table[';'] = TokenKind::Semicolon;
+  table[','] = TokenKind::Comma;
+  table['+'] = TokenKind::Plus;
+  table['-'] = TokenKind::Minus;
+  table['*'] = TokenKind::Multiply;
+  table['/'] = TokenKind::Divide;
+  table['%'] = TokenKind::Modulo;
+  table['='] = TokenKind::Equals;
+  table['<'] = TokenKind::Less;
+  table['>'] = TokenKind::Greater;
+  table['!'] = TokenKind::Not;
+  return table;
+}
+
+static constexpr array<uint8_t, 256> charClass = makeCharClassTable();
+static constexpr array<TokenKind, 256> singleCharKind =
+    makeSingleCharKindTable();
+
+static inline uint8_t classOf(char c) {
+  return charClass[static_cast<uint8_t>(c)];
+}
+
+// Kind of the two character operator starting with first, second; Unknown when
+// the pair is not an operator and first stands alone.
+static inline TokenKind twoCharOperator(char first, char second) {
+  switch (first) {
+  case '=':
+    return second == '=' ? TokenKind::EqualEqual : TokenKind::Unknown;
+  case '!':
+    return second == '=' ? TokenKind::NotEqual : TokenKind::Unknown;
+  case '<':
+    return second == '=' ? TokenKind::LessEqual : TokenKind::Unknown;
+  case '>':
+    return second == '=' ? TokenKind::GreaterEqual : TokenKind::Unknown;
+  case '&':
+    return second == '&' ? TokenKind::And : TokenKind::Unknown;
+  case '|':
+    return second == '|' ? TokenKind::Or : TokenKind::Unknown;
+  default:
+    return TokenKind::Unknown;
+  }
+}
+
+static inline bool isIdentChar(char c) {
+  uint8_t cls = classOf(c);
+  return cls == CC_Alpha || cls == CC_Digit;
 }
 
-static char peek(size_t pos, string_view source) {
-  if (isAtEnd(pos, source))
-    return '\0';
-  return source[pos];
+// Keywords are recognised with a perfect hash on (first char, last char,
+// length). The seed is searched for at compile time and the static_assert
+// below fails the build if a new keyword introduces a collision.
+struct Keyword {
+  const char *text;
+  size_t length;
+  TokenKind kind;
+};
+
+static constexpr Keyword keywordList[] = {
+    {"if", 2, TokenKind::If},         {"else", 4, TokenKind::Else},
+    {"while", 5, TokenKind::While},   {"return", 6, TokenKind::Return},
+    {"var", 3, TokenKind::Var},       {"true", 4, TokenKind::True},
+    {"false", 5, TokenKind::False},   {"define", 6, TokenKind::Define},
+    {"const", 5, TokenKind::Const},
+};
+
+static constexpr size_t KEYWORD_TABLE_SIZE = 32;
+
+static constexpr size_t keywordHash(uint8_t first, uint8_t last, size_t length,
+                                    uint32_t seed) {
+  return ((first * seed) ^ (last + length * 7)) % KEYWORD_TABLE_SIZE;
 }
 
-// Peek ahead by offset
-static char peekNext(size_t pos, string_view source, int offset = 1) {
-  if (pos + offset >= source.length())
-    return '\0';
-  return source[pos + offset];
+static constexpr bool keywordSeedIsPerfect(uint32_t seed) {
+  bool used[KEYWORD_TABLE_SIZE] = {};
+  for (const Keyword &kw : keywordList) {
+    size_t h = keywordHash(static_cast<uint8_t>(kw.text[0]),
+                           static_cast<uint8_t>(kw.text[kw.length - 1]),
+                           kw.length, seed);
+    if (used[h])
+      return false;
+    used[h] = true;
+  }
+  return true;
 }
 
-static TokenKind matchKeyword(const string &text) {
-  static const map<string, TokenKind> keywords = {
-      {"if", TokenKind::If},       {"else", TokenKind::Else},
-      {"while", TokenKind::While}, {"return", TokenKind::Return},
-      {"var", TokenKind::Var},     {"true", TokenKind::True},
-      {"false", TokenKind::False}, {"define", TokenKind::Define},
-  };
+static constexpr uint32_t findKeywordSeed() {
+  for (uint32_t seed = 1; seed < 4096; seed++) {
+    if (keywordSeedIsPerfect(seed))
+      return seed;
+  }
+  return 0;
+}
 
-  auto it = keywords.find(text);
-  if (it != keywords.end())
-    return it->second;
+static constexpr uint32_t KEYWORD_SEED = findKeywordSeed();
+static_assert(KEYWORD_SEED != 0, "no perfect hash seed for the keyword set");
+
+static constexpr array<int8_t, KEYWORD_TABLE_SIZE> makeKeywordTable() {
+  array<int8_t, KEYWORD_TABLE_SIZE> table{};
+  for (size_t i = 0; i < KEYWORD_TABLE_SIZE; i++)
+    table[i] = -1;
+  for (size_t i = 0; i < sizeof(keywordList) / sizeof(keywordList[0]); i++) {
+    const Keyword &kw = keywordList[i];
+    table[keywordHash(static_cast<uint8_t>(kw.text[0]),
+                      static_cast<uint8_t>(kw.text[kw.length - 1]), kw.length,
+                      KEYWORD_SEED)] = static_cast<int8_t>(i);
+  }
+  return table;
+}
+
+static constexpr array<int8_t, KEYWORD_TABLE_SIZE> keywordTable =
+    makeKeywordTable();
+
+static TokenKind matchKeyword(string_view text) {
+  size_t h = keywordHash(static_cast<uint8_t>(text.front()),
+                         static_cast<uint8_t>(text.back()), text.size(),
+                         KEYWORD_SEED);
+  int8_t slot = keywordTable[h];
+  if (slot < 0)
+    return TokenKind::Identifier;
+  const Keyword &kw = keywordList[slot];
+  if (kw.length == text.size() && memcmp(kw.text, text.data(), kw.length) == 0)
+    return kw.kind;
   return TokenKind::Identifier;
 }
 
+// Block scanners. Each returns how many leading bytes of the block belong to
+// the run (whitespace or identifier characters); a full block means the run
+// continues past it.
+#if defined(__AVX2__)
+static constexpr size_t SIMD_WIDTH = 32;
+using SimdMask = uint32_t;
+
+static inline SimdMask whitespaceMask(const char *p, SimdMask &newlines) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  // \t..\r are 9..13; shift them down to the bottom of the signed range so a
+  // single signed compare catches the whole interval.
+  __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8(char(128 - 9)));
+  __m256i ctrl = _mm256_cmpgt_epi8(_mm256_set1_epi8(char(-128 + 5)), shifted);
+  __m256i space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+  newlines = static_cast<SimdMask>(_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+  return static_cast<SimdMask>(
+      _mm256_movemask_epi8(_mm256_or_si256(ctrl, space)));
+}
+
+static inline SimdMask identMask(const char *p) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  __m256i letter = _mm256_cmpgt_epi8(
+      _mm256_set1_epi8(char(-128 + 26)),
+      _mm256_add_epi8(lower, _mm256_set1_epi8(char(128 - 'a'))));
+  __m256i digit = _mm256_cmpgt_epi8(
+      _mm256_set1_epi8(char(-128 + 10)),
+      _mm256_add_epi8(v, _mm256_set1_epi8(char(128 - '0'))));
+  return static_cast<SimdMask>(
+      _mm256_movemask_epi8(_mm256_or_si256(letter, digit)));
+}
+#elif defined(__SSE2__)
+static constexpr size_t SIMD_WIDTH = 16;
+using SimdMask = uint32_t;
+
+static inline SimdMask whitespaceMask(const char *p, SimdMask &newlines) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  // \t..\r are 9..13; shift them down to the bottom of the signed range so a
+  // single signed compare catches the whole interval.
+  __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8(char(128 - 9)));
+  __m128i ctrl = _mm_cmplt_epi8(shifted, _mm_set1_epi8(char(-128 + 5)));
+  __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+  newlines = static_cast<SimdMask>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+  return static_cast<SimdMask>(_mm_movemask_epi8(_mm_or_si128(ctrl, space)));
+}
+
+static inline SimdMask identMask(const char *p) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i letter =
+      _mm_cmplt_epi8(_mm_add_epi8(lower, _mm_set1_epi8(char(128 - 'a'))),
+                     _mm_set1_epi8(char(-128 + 26)));
+  __m128i digit =
+      _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8(char(128 - '0'))),
+                     _mm_set1_epi8(char(-128 + 10)));
+  return static_cast<SimdMask>(_mm_movemask_epi8(_mm_or_si128(letter, digit)));
+}
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+static constexpr SimdMask FULL_MASK =
+    SIMD_WIDTH == 32 ? ~SimdMask(0) : SimdMask((1u << SIMD_WIDTH) - 1);
+#endif
+
+// Skip a run of whitespace starting at pos, counting newlines.
+static void skipWhitespace(string_view source, size_t &pos, int &line) {
+#if defined(__AVX2__) || defined(__SSE2__)
+  while (pos + SIMD_WIDTH <= source.size()) {
+    SimdMask newlines;
+    SimdMask ws = whitespaceMask(source.data() + pos, newlines);
+    if (ws == FULL_MASK) {
+      line += __builtin_popcount(newlines);
+      pos += SIMD_WIDTH;
+      continue;
+    }
+    unsigned run = __builtin_ctz(~ws);
+    line += __builtin_popcount(newlines & ((SimdMask(1) << run) - 1));
+    pos += run;
+    return;
+  }
+#endif
+  while (pos < source.size()) {
+    uint8_t cls = classOf(source[pos]);
+    if (cls == CC_Newline)
+      line++;
+    else if (cls != CC_Space)
+      return;
+    pos++;
+  }
+}
+
+// Skip a run of identifier characters (letters and digits) starting at pos.
+static void skipIdentChars(string_view source, size_t &pos) {
+#if defined(__AVX2__) || defined(__SSE2__)
+  while (pos + SIMD_WIDTH <= source.size()) {
+    SimdMask ident = identMask(source.data() + pos);
+    if (ident == FULL_MASK) {
+      pos += SIMD_WIDTH;
+      continue;
+    }
+    pos += __builtin_ctz(~ident);
+    return;
+  }
+#endif
+  while (pos < source.size() && isIdentChar(source[pos]))
+    pos++;
+}
+
+static void skipDigits(string_view source, size_t &pos) {
+  while (pos < source.size() && classOf(source[pos]) == CC_Digit)
+    pos++;
+}
+
 static Token scanNumber(string_view source, size_t &pos, int line) {
   Token tok;
   tok.pos.line = line;
   tok.kind = TokenKind::Number;
 
   size_t start = pos;
-  while (!isAtEnd(pos, source) && isdigit(peek(pos, source))) {
-    pos++;
-  }
+  skipDigits(source, pos);
+  size_t integer_end = pos;
 
   // Handle decimal point
-  if (peek(pos, source) == '.' && isdigit(peekNext(pos, source))) {
+  if (pos + 1 < source.size() && source[pos] == '.' &&
+      classOf(source[pos + 1]) == CC_Digit) {
     pos++; // consume '.'
-    while (!isAtEnd(pos, source) && isdigit(peek(pos, source))) {
-      pos++;
-    }
+    skipDigits(source, pos);
   }
 
-  tok.lexeme = string(source.substr(start, pos - start));
-  tok.literal =
-      stoi(tok.lexeme); // For now just use int, could be float later idfk
-  // Edit : Uhm well yeah fuck floating point values
+  tok.lexeme = source.substr(start, pos - start);
+
+  // Only the integer part is kept, floating point values are not supported
+  long long value = 0;
+  for (size_t i = start; i < integer_end; i++) {
+    value = value * 10 + (source[i] - '0');
+    if (value > INT32_MAX)
+      throw LexError("integer literal out of range at line " +
+                     to_string(line));
+  }
+  tok.literal = static_cast<int>(value);
   return tok;
 }
 
-// Scan a string literal
+// Scan a string literal. The lexeme is the raw text between the quotes;
+// escape sequences are left in place and handled by decodeString.
 static Token scanString(string_view source, size_t &pos, int &line) {
   Token tok;
   tok.pos.line = line;
   tok.kind = TokenKind::String;
 
   pos++; // consume opening quote
+  size_t start = pos;
 
-  string processed_string;
-
-  while (!isAtEnd(pos, source) && peek(pos, source) != '"') {
-    char c = peek(pos, source);
-
-    // Handle escape sequences
-    if (c == '\\' && !isAtEnd(pos + 1, source)) {
-      pos++; // consume backslash
-      char next = peek(pos, source);
-      switch (next) {
-      case 'n':
-        processed_string += '\n';
-        break;
-      case 't':
-        processed_string += '\t';
-        break;
-      case 'r':
-        processed_string += '\r';
-        break;
-      case '\\':
-        processed_string += '\\';
-        break;
-      case '"':
-        processed_string += '"';
-        break;
-      case '0':
-        processed_string += '\0';
-        break;
-      default:
-        // Unknown escape sequence, just include it as-is
-        processed_string += '\\';
-        processed_string += next;
-        break;
-      }
-      pos++;
-    } else {
-      if (c == '\n')
+  while (pos < source.size()) {
+    char c = source[pos];
+    if (c == '"')
+      break;
+    if (c == '\\' && pos + 1 < source.size()) {
+      // An escaped newline still moves us to the next source line
+      if (source[pos + 1] == '\n')
         line++;
-      processed_string += c;
-      pos++;
+      pos += 2;
+      continue;
     }
+    if (c == '\n')
+      line++;
+    pos++;
   }
 
-  if (isAtEnd(pos, source)) {
+  if (pos >= source.size()) {
+    // Keep the opening quote so the token still points into the source;
+    // its lexeme is reported as "unterminated string"
     tok.kind = TokenKind::Unknown;
-    tok.lexeme = "unterminated string";
+    tok.lexeme = source.substr(start - 1, 1);
     return tok;
   }
 
+  tok.lexeme = source.substr(start, pos - start);
   pos++; // consume closing quote
-  tok.lexeme = processed_string;
-  tok.literal = processed_string;
   return tok;
 }
 
-static Token scanIdentifier(string_view source, size_t &pos, int line) {
+static Token scanIdentifier(string_view source, size_t &pos, int line,
+                            LocalSymbols *names) {
   Token tok;
   tok.pos.line = line;
 
   size_t start = pos;
-  while (!isAtEnd(pos, source) && isalnum(peek(pos, source))) {
-    pos++;
-  }
+  skipIdentChars(source, pos);
 
-  tok.lexeme = string(source.substr(start, pos - start));
+  tok.lexeme = source.substr(start, pos - start);
   tok.kind = matchKeyword(tok.lexeme);
 
-  if (tok.kind == TokenKind::True)
+  if (tok.kind == TokenKind::Identifier)
+    tok.literal = names ? Symbol{names->intern(tok.lexeme)}
+                        : symbols().intern(tok.lexeme);
+  else if (tok.kind == TokenKind::True)
     tok.literal = true;
   else if (tok.kind == TokenKind::False)
     tok.literal = false;
@@ -147,171 +392,398 @@ static Token scanIdentifier(string_view source, size_t &pos, int line) {
   return tok;
 }
 
-vector<Token> lex(string_view source) {
-  vector<Token> tokens;
-  size_t pos = 0;
-  int line = 1;
+static const string_view UNTERMINATED_STRING = "unterminated string";
+
+static void append(TokenBuffer &buffer, const Token &tok) {
+  uint32_t offset =
+      static_cast<uint32_t>(tok.lexeme.data() - buffer.source.data());
+  if (tok.kind == TokenKind::Number)
+    buffer.pushWithPayload(tok.kind, offset, tok.pos.line,
+                           get<int>(tok.literal));
+  else if (tok.kind == TokenKind::Identifier)
+    buffer.pushWithPayload(tok.kind, offset, tok.pos.line,
+                           static_cast<int>(get<Symbol>(tok.literal).id));
+  else
+    buffer.push(tok.kind, offset, tok.pos.line);
+}
 
-  while (!isAtEnd(pos, source)) {
-    char c = peek(pos, source);
+Lexer::Lexer(string_view source) : source(source) {
+  if (source.size() > UINT32_MAX)
+    throw LexError("source file larger than 4 GiB");
+}
 
-    // Skip whitespace
-    if (isspace(c)) {
-      if (c == '\n')
-        line++;
-      pos++;
-      continue;
-    }
+Lexer::Lexer(string_view source, size_t begin, size_t end, int line,
+             LocalSymbols *names)
+    : source(source.substr(0, end)), pos(begin), line(line), names(names) {
+  if (source.size() > UINT32_MAX)
+    throw LexError("source file larger than 4 GiB");
+}
 
-    Token tok;
-    tok.pos.line = line;
+static Token simpleToken(string_view source, TokenKind kind, size_t pos,
+                         size_t length, int line) {
+  Token tok;
+  tok.pos.line = line;
+  tok.kind = kind;
+  tok.lexeme = source.substr(pos, length);
+  return tok;
+}
 
-    // Single-character tokens
-    switch (c) {
-    case '{':
-      tok.kind = TokenKind::LBrace;
-      tok.lexeme = "{";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+Token Lexer::next() {
+  while (pos < source.size()) {
+    char c = source[pos];
 
-    case '}':
-      tok.kind = TokenKind::RBrace;
-      tok.lexeme = "}";
-      pos++;
-      tokens.push_back(tok);
+    switch (classOf(c)) {
+    case CC_Space:
+    case CC_Newline:
+      skipWhitespace(source, pos, line);
       continue;
 
-    case '(':
-      tok.kind = TokenKind::Lpar;
-      tok.lexeme = "(";
+    case CC_Single:
       pos++;
-      tokens.push_back(tok);
-      continue;
+      return simpleToken(source, singleCharKind[static_cast<uint8_t>(c)],
+                         pos - 1, 1, line);
 
-    case ')':
-      tok.kind = TokenKind::Rpar;
-      tok.lexeme = ")";
+    case CC_Operator: {
+      char second = pos + 1 < source.size() ? source[pos + 1] : '\0';
+      TokenKind pair = twoCharOperator(c, second);
+      if (pair != TokenKind::Unknown) {
+        pos += 2;
+        return simpleToken(source, pair, pos - 2, 2, line);
+      }
+      // A lone & or | has no single character meaning and stays Unknown
       pos++;
-      tokens.push_back(tok);
-      continue;
+      return simpleToken(source, singleCharKind[static_cast<uint8_t>(c)],
+                         pos - 1, 1, line);
+    }
 
-    case ';':
-      tok.kind = TokenKind::Semicolon;
-      tok.lexeme = ";";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+    case CC_Quote:
+      return scanString(source, pos, line);
 
-    case ',':
-      tok.kind = TokenKind::Comma;
-      tok.lexeme = ",";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+    case CC_Digit:
+      return scanNumber(source, pos, line);
 
-    case '+':
-      tok.kind = TokenKind::Plus;
-      tok.lexeme = "+";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+    case CC_Alpha:
+      return scanIdentifier(source, pos, line, names);
 
-    case '-':
-      tok.kind = TokenKind::Minus;
-      tok.lexeme = "-";
+    default:
+      // Unknown character
       pos++;
-      tokens.push_back(tok);
-      continue;
+      return simpleToken(source, TokenKind::Unknown, pos - 1, 1, line);
+    }
+  }
 
-    case '*':
-      tok.kind = TokenKind::Multiply;
-      tok.lexeme = "*";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+  return simpleToken(source, TokenKind::EndOfFile, pos, 0, line);
+}
 
-    case '/':
-      tok.kind = TokenKind::Divide;
-      tok.lexeme = "/";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+static void reserveFor(TokenBuffer &buffer, size_t bytes) {
+  // Generated sources average a little under five bytes per token
+  size_t expected = bytes / 5 + 1;
+  buffer.kinds.reserve(expected);
+  buffer.offsets.reserve(expected);
+  buffer.lines.reserve(expected);
+}
 
-    case '%':
-      tok.kind = TokenKind::Modulo;
-      tok.lexeme = "%";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+// Lex every token of the lexer's range into buffer, without the trailing
+// EndOfFile token.
+static void lexRange(Lexer &lexer, TokenBuffer &buffer) {
+  for (;;) {
+    Token tok = lexer.next();
+    if (tok.kind == TokenKind::EndOfFile)
+      return;
+    append(buffer, tok);
+  }
+}
 
-    case '<':
-      tok.kind = TokenKind::Less;
-      tok.lexeme = "<";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+TokenBuffer lex(string_view source) {
+  Lexer lexer(source);
+  TokenBuffer buffer;
+  buffer.source = source;
+  reserveFor(buffer, source.size());
 
-    case '>':
-      tok.kind = TokenKind::Greater;
-      tok.lexeme = ">";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+  lexRange(lexer, buffer);
+  buffer.push(TokenKind::EndOfFile, source.size(), lexer.currentLine());
+  return buffer;
+}
 
-    case '!':
-      tok.kind = TokenKind::Not;
-      tok.lexeme = "!";
-      pos++;
-      tokens.push_back(tok);
-      continue;
+// Chunks smaller than this aren't worth a thread
+static constexpr size_t MIN_CHUNK_BYTES = 256 * 1024;
 
-    case '=':
-      // Check for ==
-      if (peekNext(pos, source) == '=') {
-        tok.kind = TokenKind::EqualEqual;
-        tok.lexeme = "==";
-        pos += 2;
-      } else {
-        tok.kind = TokenKind::Equals;
-        tok.lexeme = "=";
-        pos++;
-      }
-      tokens.push_back(tok);
+// Whether the last token is a string literal cut off by the end of the range
+static bool endsInsideString(const TokenBuffer &tokens) {
+  if (tokens.size() == 0)
+    return false;
+  size_t last = tokens.size() - 1;
+  return tokens.kinds[last] == TokenKind::Unknown &&
+         tokens.source[tokens.offsets[last]] == '"';
+}
+
+namespace {
+// Tokens of one chunk, lexed as if the chunk started outside of any string
+// literal. Lines are relative to the start of the chunk (first line is 1).
+struct LexedChunk {
+  size_t begin = 0;
+  size_t end = 0;
+  TokenBuffer tokens;
+  int end_line = 1;
+  exception_ptr error;
+  LocalSymbols names; // identifier payloads are ids in here
+};
+
+// A run of tokens that ends up in the final buffer, with the amount to add
+// to its line numbers and the global symbol of each local identifier id
+// (empty when the identifiers already are global symbols).
+struct LexedPart {
+  const TokenBuffer *tokens;
+  size_t count;
+  int line_delta;
+  vector<Symbol> symbols;
+};
+} // namespace
+
+TokenBuffer lex(string_view source, unsigned threads) {
+  size_t chunk_count = min<size_t>(threads, source.size() / MIN_CHUNK_BYTES);
+  if (chunk_count < 2)
+    return lex(source);
+  if (source.size() > UINT32_MAX)
+    throw LexError("source file larger than 4 GiB");
+
+  // Split at newline boundaries. Nothing but a string literal can span a
+  // newline, so every chunk starts between tokens unless it starts inside a
+  // multi-line string, which is repaired below.
+  vector<LexedChunk> chunks;
+  size_t begin = 0;
+  for (size_t i = 1; i <= chunk_count && begin < source.size(); i++) {
+    size_t end = source.size();
+    if (i < chunk_count) {
+      size_t newline = source.find('\n', source.size() * i / chunk_count);
+      end = newline == string_view::npos ? source.size() : newline + 1;
+    }
+    if (end <= begin)
       continue;
+    LexedChunk &chunk = chunks.emplace_back();
+    chunk.begin = begin;
+    chunk.end = end;
+    begin = end;
+  }
 
-    case '"':
-      tokens.push_back(scanString(source, pos, line));
+  parallelFor(chunks.size(), threads, [&](size_t i, unsigned) {
+    LexedChunk &chunk = chunks[i];
+    chunk.tokens.source = source;
+    reserveFor(chunk.tokens, chunk.end - chunk.begin);
+    try {
+      Lexer lexer(source, chunk.begin, chunk.end, 1, &chunk.names);
+      lexRange(lexer, chunk.tokens);
+      chunk.end_line = lexer.currentLine();
+    } catch (...) {
+      // Only fatal if this chunk's tokens are actually used
+      chunk.error = current_exception();
+    }
+  });
+
+  // Stitch the chunks together. When a chunk ends inside a string literal
+  // the following chunk was lexed from the wrong state, so everything from
+  // the opening quote on is re-lexed serially until a chunk ends cleanly.
+  // A chunk's names go to the global table as its part is taken, so symbols
+  // are numbered in order of first appearance just as by the serial lex().
+  vector<LexedPart> parts;
+  vector<unique_ptr<TokenBuffer>> relexed;
+  int line = 1; // line the next chunk starts on
+  for (size_t i = 0; i < chunks.size();) {
+    LexedChunk &chunk = chunks[i];
+    if (chunk.error)
+      rethrow_exception(chunk.error);
+
+    if (!endsInsideString(chunk.tokens) || i + 1 == chunks.size()) {
+      parts.push_back({&chunk.tokens, chunk.tokens.size(), line - 1,
+                       symbols().intern(chunk.names)});
+      line += chunk.end_line - 1;
+      i++;
       continue;
     }
 
-    // Numbers
-    if (isdigit(c)) {
-      tokens.push_back(scanNumber(source, pos, line));
-      continue;
+    size_t quote = chunk.tokens.size() - 1;
+    parts.push_back(
+        {&chunk.tokens, quote, line - 1, symbols().intern(chunk.names)});
+    size_t restart = chunk.tokens.offsets[quote];
+    int restart_line = static_cast<int>(chunk.tokens.lines[quote]) + line - 1;
+
+    auto &tail = relexed.emplace_back(make_unique<TokenBuffer>());
+    size_t next = i + 1;
+    for (;;) {
+      *tail = TokenBuffer();
+      tail->source = source;
+      Lexer lexer(source, restart, chunks[next].end, restart_line);
+      lexRange(lexer, *tail);
+      line = lexer.currentLine();
+      if (!endsInsideString(*tail) || next + 1 == chunks.size())
+        break;
+      next++;
     }
+    parts.push_back({tail.get(), tail->size(), 0, {}});
+    i = next + 1;
+  }
 
-    // Identifiers and keywords
-    if (isalpha(c)) {
-      tokens.push_back(scanIdentifier(source, pos, line));
-      continue;
+  // Copy the parts into place in parallel
+  vector<size_t> starts(parts.size() + 1, 0);
+  size_t literal_total = 0;
+  for (size_t i = 0; i < parts.size(); i++) {
+    starts[i + 1] = starts[i] + parts[i].count;
+    literal_total += parts[i].tokens->literal_tokens.size();
+  }
+
+  TokenBuffer buffer;
+  buffer.source = source;
+  buffer.kinds.resize(starts.back());
+  buffer.offsets.resize(starts.back());
+  buffer.lines.resize(starts.back());
+
+  parallelFor(parts.size(), threads, [&](size_t i, unsigned) {
+    const LexedPart &part = parts[i];
+    const TokenBuffer &src = *part.tokens;
+    size_t at = starts[i];
+    copy_n(src.kinds.begin(), part.count, buffer.kinds.begin() + at);
+    copy_n(src.offsets.begin(), part.count, buffer.offsets.begin() + at);
+    for (size_t t = 0; t < part.count; t++)
+      buffer.lines[at + t] = src.lines[t] + part.line_delta;
+  });
+
+  buffer.literal_tokens.reserve(literal_total);
+  buffer.literal_values.reserve(literal_total);
+  for (size_t i = 0; i < parts.size(); i++) {
+    const LexedPart &part = parts[i];
+    const TokenBuffer &src = *part.tokens;
+    for (size_t l = 0; l < src.literal_tokens.size(); l++) {
+      uint32_t token = src.literal_tokens[l];
+      if (token >= part.count)
+        break;
+      int value = src.literal_values[l];
+      if (!part.symbols.empty() && src.kinds[token] == TokenKind::Identifier)
+        value = static_cast<int>(part.symbols[value].id);
+      buffer.literal_tokens.push_back(token + starts[i]);
+      buffer.literal_values.push_back(value);
     }
+  }
 
-    // Unknown character
-    tok.kind = TokenKind::Unknown;
-    tok.lexeme = string(1, c);
-    tokens.push_back(tok);
-    pos++;
+  buffer.push(TokenKind::EndOfFile, source.size(), line);
+  return buffer;
+}
+
+string_view TokenBuffer::lexeme(size_t index) const {
+  size_t start = offsets[index];
+  size_t pos = start;
+  int line = 0;
+
+  switch (kinds[index]) {
+  case TokenKind::Identifier:
+  case TokenKind::True:
+  case TokenKind::False:
+  case TokenKind::If:
+  case TokenKind::Else:
+  case TokenKind::While:
+  case TokenKind::Return:
+  case TokenKind::Var:
+  case TokenKind::Define:
+  case TokenKind::Const:
+    skipIdentChars(source, pos);
+    return source.substr(start, pos - start);
+  case TokenKind::Number:
+    return scanNumber(source, pos, line).lexeme;
+  case TokenKind::String:
+    pos--; // back onto the opening quote
+    return scanString(source, pos, line).lexeme;
+  case TokenKind::EqualEqual:
+  case TokenKind::NotEqual:
+  case TokenKind::LessEqual:
+  case TokenKind::GreaterEqual:
+  case TokenKind::And:
+  case TokenKind::Or:
+    return source.substr(start, 2);
+  case TokenKind::EndOfFile:
+    return source.substr(start, 0);
+  case TokenKind::Unknown:
+    if (source[start] == '"')
+      return UNTERMINATED_STRING;
+    return source.substr(start, 1);
+  default:
+    return source.substr(start, 1);
   }
+}
 
-  // Add EOF token
-  Token eof;
-  eof.pos.line = line;
-  eof.kind = TokenKind::EndOfFile;
-  eof.lexeme = "";
-  tokens.push_back(eof);
+LiteralValue TokenBuffer::literal(size_t index) const {
+  switch (kinds[index]) {
+  case TokenKind::Number:
+  case TokenKind::Identifier: {
+    auto it = lower_bound(literal_tokens.begin(), literal_tokens.end(),
+                          static_cast<uint32_t>(index));
+    int payload = literal_values[it - literal_tokens.begin()];
+    if (kinds[index] == TokenKind::Identifier)
+      return Symbol{static_cast<uint32_t>(payload)};
+    return payload;
+  }
+  case TokenKind::True:
+    return true;
+  case TokenKind::False:
+    return false;
+  default:
+    return monostate{};
+  }
+}
 
-  return tokens;
+Token TokenBuffer::at(size_t index) const {
+  Token tok;
+  tok.pos.line = static_cast<int>(lines[index]);
+  tok.kind = kinds[index];
+  tok.lexeme = lexeme(index);
+  tok.literal = literal(index);
+  return tok;
+}
+
+bool stringNeedsDecoding(string_view raw) {
+  return raw.find('\\') != string_view::npos;
+}
+
+// Decode the escape sequences of a raw string literal lexeme
+string decodeString(string_view raw) {
+  string processed_string;
+  processed_string.reserve(raw.size());
+
+  for (size_t pos = 0; pos < raw.size(); pos++) {
+    char c = raw[pos];
+    if (c != '\\' || pos + 1 >= raw.size()) {
+      processed_string += c;
+      continue;
+    }
+
+    pos++; // consume backslash
+    char next = raw[pos];
+    switch (next) {
+    case 'n':
+      processed_string += '\n';
+      break;
+    case 't':
+      processed_string += '\t';
+      break;
+    case 'r':
+      processed_string += '\r';
+      break;
+    case '\\':
+      processed_string += '\\';
+      break;
+    case '"':
+      processed_string += '"';
+      break;
+    case '0':
+      processed_string += '\0';
+      break;
+    default:
+      // Unknown escape sequence, just include it as-is
+      processed_string += '\\';
+      processed_string += next;
+      break;
+    }
+  }
+
+  return processed_string;
 }
 
 string tokenKindToString(TokenKind kind) {
@@ -350,6 +822,8 @@ string tokenKindToString(TokenKind kind) {
     return "Var";
   case TokenKind::Define:
     return "Define";
+  case TokenKind::Const:
+    return "Const";
   case TokenKind::Plus:
     return "Plus";
   case TokenKind::Minus:
@@ -364,10 +838,16 @@ string tokenKindToString(TokenKind kind) {
     return "Equals";
   case TokenKind::EqualEqual:
     return "EqualEqual";
+  case TokenKind::NotEqual:
+    return "NotEqual";
   case TokenKind::Less:
     return "Less";
+  case TokenKind::LessEqual:
+    return "LessEqual";
   case TokenKind::Greater:
     return "Greater";
+  case TokenKind::GreaterEqual:
+    return "GreaterEqual";
   case TokenKind::Not:
     return "Not";
   case TokenKind::And:
@@ -383,23 +863,29 @@ string tokenKindToString(TokenKind kind) {
   }
 }
 
-void output_lex(basic_ofstream<char> &outputFile, std::vector<Token> tokens) {
+void output_lex(basic_ofstream<char> &outputFile, const TokenBuffer &tokens) {
 
   for (size_t i = 0; i < tokens.size(); i++) {
-    const Token &tok = tokens[i];
+    const Token tok = tokens.at(i);
+    string decoded;
+    if (tok.kind == TokenKind::String)
+      decoded = decodeString(tok.lexeme);
+
     outputFile << "Token " << i << ":\n";
     outputFile << "  Kind: " << tokenKindToString(tok.kind) << "\n";
-    outputFile << "  Lexeme: \"" << tok.lexeme << "\"\n";
+    if (tok.kind == TokenKind::String)
+      outputFile << "  Lexeme: \"" << decoded << "\"\n";
+    else
+      outputFile << "  Lexeme: \"" << tok.lexeme << "\"\n";
     outputFile << "  Line: " << tok.pos.line << "\n";
 
-    if (holds_alternative<int>(tok.literal)) {
+    if (tok.kind == TokenKind::String) {
+      outputFile << "  Literal (string): \"" << decoded << "\"\n";
+    } else if (holds_alternative<int>(tok.literal)) {
       outputFile << "  Literal (int): " << get<int>(tok.literal) << "\n";
     } else if (holds_alternative<bool>(tok.literal)) {
       outputFile << "  Literal (bool): "
                  << (get<bool>(tok.literal) ? "true" : "false") << "\n";
-    } else if (holds_alternative<string>(tok.literal)) {
-      outputFile << "  Literal (string): \"" << get<string>(tok.literal)
-                 << "\"\n";
     }
 
     outputFile << "\n";
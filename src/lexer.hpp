@@ -1,7 +1,100 @@
 #pragma once
 #include "token.hpp"
 #include <fstream>
+#include <stdexcept>
 #include <vector>
 using namespace std;
-vector<Token> lex(string_view SourceCode);
-void output_lex(basic_ofstream<char> &outputFile, vector<Token> tokens);
+
+class LexError : public runtime_error {
+public:
+  using runtime_error::runtime_error;
+};
+
+// Incremental lexer: every call to next() scans exactly one token, so a
+// parser can pull tokens as it needs them instead of lexing the whole file
+// up front. Returns EndOfFile forever once the input is exhausted.
+class Lexer {
+public:
+  explicit Lexer(string_view source);
+  // Lex only [begin, end) of source, starting at the given line number.
+  // Offsets in the produced tokens stay relative to the start of source.
+  // With `names`, identifiers carry ids of that local table instead of
+  // global symbols.
+  Lexer(string_view source, size_t begin, size_t end, int line,
+        LocalSymbols *names = nullptr);
+  Token next();
+  int currentLine() const { return line; }
+
+private:
+  string_view source;
+  size_t pos = 0;
+  int line = 1;
+  LocalSymbols *names = nullptr;
+};
+
+// Forward-only view over a token stream with one token of lookahead and the
+// previously consumed token. Backed either by a Lexer (streaming, only three
+// tokens resident) or by an already lexed TokenBuffer.
+class TokenCursor {
+public:
+  explicit TokenCursor(Lexer &lexer) : lexer(&lexer) { current = pull(); }
+  explicit TokenCursor(const TokenBuffer &buffer)
+      : TokenCursor(buffer, 0, buffer.size() - 1) {}
+  // Tokens [begin, end) of buffer, followed by an EndOfFile token positioned
+  // at token `end`
+  TokenCursor(const TokenBuffer &buffer, size_t begin, size_t end)
+      : buffer(&buffer), next_index(begin), end_index(end) {
+    end_token = buffer.at(end);
+    end_token.kind = TokenKind::EndOfFile;
+    end_token.lexeme = string_view();
+    end_token.literal = monostate();
+    current = pull();
+  }
+
+  const Token &peek() const { return current; }
+  const Token &previous() const { return last; }
+
+  const Token &peekNext() {
+    if (!has_lookahead) {
+      lookahead = pull();
+      has_lookahead = true;
+    }
+    return lookahead;
+  }
+
+  void advance() {
+    last = current;
+    if (has_lookahead) {
+      current = lookahead;
+      has_lookahead = false;
+    } else {
+      current = pull();
+    }
+  }
+
+private:
+  Token pull() {
+    if (lexer)
+      return lexer->next();
+    if (next_index < end_index)
+      return buffer->at(next_index++);
+    return end_token; // stay on EndOfFile
+  }
+
+  Lexer *lexer = nullptr;
+  const TokenBuffer *buffer = nullptr;
+  size_t next_index = 0;
+  size_t end_index = 0;
+  Token end_token{};
+  Token last{};
+  Token current{};
+  Token lookahead{};
+  bool has_lookahead = false;
+};
+TokenBuffer lex(string_view SourceCode);
+// Lex on up to `threads` threads by splitting the input at newlines. The
+// result is identical to the serial lex().
+TokenBuffer lex(string_view SourceCode, unsigned threads);
+bool stringNeedsDecoding(string_view raw);
+string decodeString(string_view raw);
+void output_lex(basic_ofstream<char> &outputFile, const TokenBuffer &tokens);
@@ -0,0 +1,25 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Run body(index, worker) for every index in [0, count) on up to `threads`
+// threads, the calling thread included. Indices are handed out one at a time
+// so uneven items balance out; worker (0 .. threads-1) identifies the thread
+// running the call, for per-thread state.
+inline void parallelFor(size_t count, unsigned threads,
+                        const std::function<void(size_t, unsigned)> &body) {
+  std::atomic<size_t> next{0};
+  auto worker = [&](unsigned id) {
+    for (size_t i = next++; i < count; i = next++)
+      body(i, id);
+  };
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < threads && t < count; t++)
+    pool.emplace_back(worker, t);
+  worker(0);
+  for (auto &th : pool)
+    th.join();
+}
@@ -3,4 +3,4 @@
 #include "token.hpp"
 #include <vector>
 
-ExprPtr parse(const std::vector<Token> &tokens);
+ExprPtr parse(const TokenBuffer &tokens);
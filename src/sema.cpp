@@ -0,0 +1,331 @@
+#include "sema.hpp"
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+namespace {
+
+// Least upper bound: Unknown below everything, Int above everything
+Type join(Type a, Type b) {
+  if (a == Type::Unknown)
+    return b;
+  if (b == Type::Unknown || a == b)
+    return a;
+  return Type::Int;
+}
+
+class TypeInference {
+public:
+  explicit TypeInference(Program &p) : program(p) {}
+
+  void run() {
+    for (StmtPtr stmt : program.statements)
+      if (auto func = node_as<FunctionDef>(stmt))
+        functions.emplace(func->name, func); // first definition wins
+
+    // Every join only moves a slot up a lattice of height three, so this
+    // settles after a handful of rounds
+    do {
+      changed = false;
+      walkProgram();
+    } while (changed);
+
+    for (auto &entry : functions) {
+      FunctionDef *func = entry.second;
+      for (FunctionParam &param : func->parameters)
+        if (param.type == Type::Unknown)
+          param.type = Type::Int;
+      if (func->returnType == Type::Unknown)
+        func->returnType = Type::Int;
+    }
+    // One more walk so expressions that depended on the defaults see them
+    walkProgram();
+  }
+
+private:
+  Program &program;
+  std::unordered_map<Symbol, FunctionDef *, SymbolHash> functions;
+  struct Binding {
+    Type type;
+    LiteralExpr *constant; // folded value of a const, nullptr for variables
+  };
+  std::vector<std::unordered_map<Symbol, Binding, SymbolHash>> scopes;
+  FunctionDef *current = nullptr; // function whose body is being walked
+  bool changed = false;
+
+  void update(Type &slot, Type type) {
+    Type joined = join(slot, type);
+    if (joined != slot) {
+      slot = joined;
+      changed = true;
+    }
+  }
+
+  const Binding *lookup(Symbol name) const {
+    for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+      auto it = scope->find(name);
+      if (it != scope->end())
+        return &it->second;
+    }
+    return nullptr;
+  }
+
+  LiteralExpr *makeLiteral(std::variant<int, bool, std::string_view> value) {
+    LiteralExpr *lit = program.arena.make<LiteralExpr>(value);
+    walkExpr(lit);
+    return lit;
+  }
+
+  static bool isInteger(const LiteralExpr *lit) {
+    return !std::holds_alternative<std::string_view>(lit->value);
+  }
+
+  // Integers and booleans as the code generator sees them: 64-bit values,
+  // booleans being 0 or 1
+  static int64_t integerValue(const LiteralExpr *lit) {
+    if (std::holds_alternative<bool>(lit->value))
+      return std::get<bool>(lit->value) ? 1 : 0;
+    return std::get<int>(lit->value);
+  }
+
+  // Literals hold 32 bits, so a folded value outside them is no constant;
+  // overflowed records why
+  LiteralExpr *makeInteger(int64_t value) {
+    if (value < std::numeric_limits<int>::min() ||
+        value > std::numeric_limits<int>::max()) {
+      overflowed = true;
+      return nullptr;
+    }
+    return makeLiteral(static_cast<int>(value));
+  }
+
+  // Set by makeInteger when evaluate gave up on a value too wide for a
+  // literal
+  bool overflowed = false;
+
+  // Evaluate expr at compile time, or return nullptr if it depends on
+  // anything but literals and other constants
+  LiteralExpr *evaluate(Expr *expr) {
+    switch (expr->kind) {
+    case ExprKind::Literal:
+      return node_cast<LiteralExpr>(expr);
+    case ExprKind::Identifier: {
+      const Binding *binding = lookup(node_cast<IdentifierExpr>(expr)->name);
+      return binding ? binding->constant : nullptr;
+    }
+    case ExprKind::Unary: {
+      auto unary = node_cast<UnaryExpr>(expr);
+      LiteralExpr *operand = evaluate(unary->operand);
+      if (!operand || !isInteger(operand))
+        return nullptr;
+      if (unary->op == UnaryOp::Not)
+        return makeLiteral(integerValue(operand) == 0);
+      return makeInteger(-integerValue(operand));
+    }
+    case ExprKind::Binary: {
+      auto bin = node_cast<BinaryExpr>(expr);
+      LiteralExpr *left = evaluate(bin->left);
+      LiteralExpr *right = evaluate(bin->right);
+      if (!left || !right)
+        return nullptr;
+      if (!isInteger(left) || !isInteger(right)) {
+        // Only concatenation is defined on strings
+        if (bin->op != BinaryOp::Add || isInteger(left) || isInteger(right))
+          return nullptr;
+        std::string text(std::get<std::string_view>(left->value));
+        text += std::get<std::string_view>(right->value);
+        return makeLiteral(program.arena.copyString(text));
+      }
+      int64_t a = integerValue(left);
+      int64_t b = integerValue(right);
+      switch (bin->op) {
+      case BinaryOp::Add:
+        return makeInteger(a + b);
+      case BinaryOp::Sub:
+        return makeInteger(a - b);
+      case BinaryOp::Mul:
+        return makeInteger(a * b);
+      case BinaryOp::Div:
+        return b == 0 ? nullptr : makeInteger(a / b);
+      case BinaryOp::Mod:
+        return b == 0 ? nullptr : makeInteger(a % b);
+      case BinaryOp::Equal:
+        return makeLiteral(a == b);
+      case BinaryOp::NotEqual:
+        return makeLiteral(a != b);
+      case BinaryOp::Less:
+        return makeLiteral(a < b);
+      case BinaryOp::LessEqual:
+        return makeLiteral(a <= b);
+      case BinaryOp::Greater:
+        return makeLiteral(a > b);
+      case BinaryOp::GreaterEqual:
+        return makeLiteral(a >= b);
+      case BinaryOp::And:
+        return makeLiteral(a != 0 && b != 0);
+      case BinaryOp::Or:
+        return makeLiteral(a != 0 || b != 0);
+      }
+      return nullptr;
+    }
+    case ExprKind::Call:
+      return nullptr;
+    }
+    return nullptr;
+  }
+
+  // Mirrors code generation: each function body sees only its parameters
+  // and locals, top-level code only its own variables
+  void walkProgram() {
+    for (auto &entry : functions) {
+      FunctionDef *func = entry.second;
+      current = func;
+      scopes.assign(1, {});
+      for (const FunctionParam &param : func->parameters)
+        scopes.back()[param.name] = {param.type, nullptr};
+      walkStmt(func->body);
+    }
+
+    current = nullptr;
+    scopes.assign(1, {});
+    for (StmtPtr stmt : program.statements)
+      walkStmt(stmt);
+  }
+
+  void walkStmt(Stmt *stmt) {
+    if (!stmt)
+      return;
+    switch (stmt->kind) {
+    case StmtKind::Expr:
+      walkExpr(node_cast<ExprStmt>(stmt)->expression);
+      break;
+    case StmtKind::VarDecl: {
+      auto decl = node_cast<VarDeclStmt>(stmt);
+      // A variable keeps the type of its initializer for its whole life
+      Type type = walkExpr(decl->initializer);
+      LiteralExpr *constant = nullptr;
+      if (decl->isConst) {
+        overflowed = false;
+        constant = evaluate(decl->initializer);
+        if (!constant && overflowed)
+          throw SemaError("value of const '" + symbols().str(decl->name) +
+                          "' does not fit in 32 bits");
+        if (!constant)
+          throw SemaError("initializer of const '" + symbols().str(decl->name) +
+                          "' is not a compile-time constant");
+        decl->initializer = constant;
+        type = constant->type;
+      }
+      scopes.back()[decl->name] = {type, constant};
+      break;
+    }
+    case StmtKind::Assign: {
+      auto assign = node_cast<AssignStmt>(stmt);
+      const Binding *binding = lookup(assign->name);
+      if (binding && binding->constant)
+        throw SemaError("cannot assign to const '" +
+                        symbols().str(assign->name) + "'");
+      walkExpr(assign->value);
+      break;
+    }
+    case StmtKind::Block:
+      scopes.emplace_back();
+      for (StmtPtr inner : node_cast<BlockStmt>(stmt)->statements)
+        walkStmt(inner);
+      scopes.pop_back();
+      break;
+    case StmtKind::If: {
+      auto ifStmt = node_cast<IfStmt>(stmt);
+      walkExpr(ifStmt->condition);
+      walkStmt(ifStmt->thenBranch);
+      walkStmt(ifStmt->elseBranch);
+      break;
+    }
+    case StmtKind::While: {
+      auto loop = node_cast<WhileStmt>(stmt);
+      walkExpr(loop->condition);
+      walkStmt(loop->body);
+      break;
+    }
+    case StmtKind::Return: {
+      auto ret = node_cast<ReturnStmt>(stmt);
+      Type type = ret->value ? walkExpr(ret->value) : Type::Int;
+      if (current)
+        update(current->returnType, type);
+      break;
+    }
+    case StmtKind::FunctionDef:
+      // Walked on their own in walkProgram; nested definitions are not
+      // compiled
+      break;
+    }
+  }
+
+  // Returns the inferred type, which may still be Unknown mid-iteration;
+  // the annotation stored on the node is always concrete
+  Type walkExpr(Expr *expr) {
+    Type type = inferExpr(expr);
+    expr->type = type == Type::Unknown ? Type::Int : type;
+    return type;
+  }
+
+  Type inferExpr(Expr *expr) {
+    switch (expr->kind) {
+    case ExprKind::Literal: {
+      auto lit = node_cast<LiteralExpr>(expr);
+      if (std::holds_alternative<bool>(lit->value))
+        return Type::Bool;
+      if (std::holds_alternative<std::string_view>(lit->value))
+        return Type::String;
+      return Type::Int;
+    }
+    case ExprKind::Identifier: {
+      const Binding *binding = lookup(node_cast<IdentifierExpr>(expr)->name);
+      return binding ? binding->type : Type::Unknown;
+    }
+    case ExprKind::Unary: {
+      auto unary = node_cast<UnaryExpr>(expr);
+      walkExpr(unary->operand);
+      return unary->op == UnaryOp::Not ? Type::Bool : Type::Int;
+    }
+    case ExprKind::Binary: {
+      auto bin = node_cast<BinaryExpr>(expr);
+      Type left = walkExpr(bin->left);
+      Type right = walkExpr(bin->right);
+      switch (bin->op) {
+      case BinaryOp::Add:
+        // + on a string operand is concatenation
+        return left == Type::String || right == Type::String ? Type::String
+                                                             : Type::Int;
+      case BinaryOp::Sub:
+      case BinaryOp::Mul:
+      case BinaryOp::Div:
+      case BinaryOp::Mod:
+        return Type::Int;
+      default:
+        return Type::Bool; // comparisons, && and ||
+      }
+    }
+    case ExprKind::Call: {
+      auto call = node_cast<CallExpr>(expr);
+      auto it = functions.find(call->function);
+      FunctionDef *callee = it == functions.end() ? nullptr : it->second;
+      for (size_t i = 0; i < call->arguments.size(); i++) {
+        Type arg = walkExpr(call->arguments[i]);
+        if (callee && i < callee->parameters.size())
+          update(callee->parameters[i].type, arg);
+      }
+      if (callee)
+        return callee->returnType;
+      return Type::Int; // print, or an undefined function
+    }
+    }
+    return Type::Unknown;
+  }
+};
+
+} // namespace
+
+void annotateTypes(Program &program) { TypeInference(program).run(); }
@@ -0,0 +1,25 @@
+#pragma once
+#include "ast.hpp"
+#include <stdexcept>
+#include <string>
+
+// Semantic pass, run once between parsing and code generation.
+//
+// Infers a type for every expression and stores it in Expr::type, so later
+// passes read it instead of working it out again. Function parameter types
+// are inferred from the arguments at the call sites and return types from the
+// return statements; both are iterated to a fixed point, since one function's
+// return type can feed another's arguments. Anything still undetermined
+// afterwards (a parameter that is never passed, a function that never returns
+// a value) is Int, as is any slot used with conflicting types.
+//
+// The initializer of every `const` declaration is evaluated here and replaced
+// by the resulting literal, so code generation can emit a constant as an
+// immediate wherever it is used. Throws SemaError when an initializer is not a
+// compile-time constant or a constant is assigned to.
+void annotateTypes(Program &program);
+
+class SemaError : public std::runtime_error {
+public:
+  explicit SemaError(const std::string &msg) : std::runtime_error(msg) {}
+};
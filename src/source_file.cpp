@@ -0,0 +1,43 @@
+#include "source_file.hpp"
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SourceFile::SourceFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Could not open input file: " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      // The lexer walks the file front to back exactly once
+      madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+      mapping = mapped;
+      data = static_cast<const char *>(mapped);
+      size = st.st_size;
+      close(fd);
+      return;
+    }
+  }
+  close(fd);
+
+  std::ifstream inputFileStream(path);
+  if (!inputFileStream)
+    throw std::runtime_error("Could not open input file: " + path);
+  std::stringstream buffer;
+  buffer << inputFileStream.rdbuf();
+  fallback = buffer.str();
+  data = fallback.data();
+  size = fallback.size();
+}
+
+SourceFile::~SourceFile() {
+  if (mapping)
+    munmap(mapping, size);
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// Read-only view of an input file. Regular files are memory-mapped so tokens
+// can point straight into the mapping; anything that can't be mapped (pipes,
+// special files) is read into an owned buffer instead.
+class SourceFile {
+public:
+  explicit SourceFile(const std::string &path);
+  ~SourceFile();
+
+  SourceFile(const SourceFile &) = delete;
+  SourceFile &operator=(const SourceFile &) = delete;
+
+  std::string_view text() const { return {data, size}; }
+
+private:
+  const char *data = nullptr;
+  size_t size = 0;
+  void *mapping = nullptr;
+  std::string fallback;
+};
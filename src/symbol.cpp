@@ -0,0 +1,66 @@
+#include "symbol.hpp"
+
+uint32_t LocalSymbols::intern(std::string_view text) {
+  auto [it, added] = ids.emplace(text, static_cast<uint32_t>(list.size()));
+  if (added)
+    list.push_back(text);
+  return it->second;
+}
+
+// Block and position in it of a name id
+static std::pair<int, uint32_t> locate(uint32_t id, uint32_t firstBlock) {
+  uint64_t slot = id / firstBlock + 1;
+  int block = 63 - __builtin_clzll(slot);
+  return {block, id - firstBlock * ((1u << block) - 1)};
+}
+
+SymbolTable::SymbolTable() {
+  intern("");
+  intern("print");
+}
+
+SymbolTable::~SymbolTable() {
+  for (auto &block : blocks)
+    delete[] block.load();
+}
+
+Symbol SymbolTable::append(std::string_view text) {
+  auto it = ids.find(text);
+  if (it != ids.end())
+    return Symbol{it->second};
+
+  uint32_t id = count++;
+  auto [block, offset] = locate(id, FIRST_BLOCK);
+  std::string *names = blocks[block].load(std::memory_order_relaxed);
+  if (!names) {
+    names = new std::string[static_cast<size_t>(FIRST_BLOCK) << block];
+    blocks[block].store(names, std::memory_order_release);
+  }
+  names[offset] = text;
+  ids.emplace(names[offset], id);
+  return Symbol{id};
+}
+
+Symbol SymbolTable::intern(std::string_view text) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return append(text);
+}
+
+std::vector<Symbol> SymbolTable::intern(const LocalSymbols &local) {
+  std::vector<Symbol> global;
+  global.reserve(local.names().size());
+  std::lock_guard<std::mutex> lock(mutex);
+  for (std::string_view text : local.names())
+    global.push_back(append(text));
+  return global;
+}
+
+std::string_view SymbolTable::name(Symbol sym) const {
+  auto [block, offset] = locate(sym.id, FIRST_BLOCK);
+  return blocks[block].load(std::memory_order_acquire)[offset];
+}
+
+SymbolTable &symbols() {
+  static SymbolTable table;
+  return table;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Interned identifier. Two symbols are equal exactly when their names are,
+// so name comparisons anywhere in the pipeline are integer compares.
+struct Symbol {
+  uint32_t id = 0;
+
+  bool operator==(Symbol other) const { return id == other.id; }
+  bool operator!=(Symbol other) const { return id != other.id; }
+};
+
+struct SymbolHash {
+  size_t operator()(Symbol sym) const { return sym.id; }
+};
+
+// Names that the compiler itself needs to recognise. They are interned first
+// so their ids are known at compile time.
+namespace builtin {
+constexpr Symbol None{0}; // the empty name
+constexpr Symbol Print{1};
+} // namespace builtin
+
+// Interning table private to one thread, such as a chunk worker of the
+// parallel lexer. Ids are dense in order of first appearance and only mean
+// something once mapped to global symbols with SymbolTable::intern. The
+// names are views into text that must outlive the table.
+class LocalSymbols {
+public:
+  uint32_t intern(std::string_view text);
+  const std::vector<std::string_view> &names() const { return list; }
+
+private:
+  std::vector<std::string_view> list;
+  std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+// Global interning table, filled by the lexer. intern takes a lock, so
+// threads intern into a LocalSymbols and hand its names over in one call.
+// name() takes none and may run while another thread interns.
+class SymbolTable {
+public:
+  SymbolTable();
+  ~SymbolTable();
+  SymbolTable(const SymbolTable &) = delete;
+  SymbolTable &operator=(const SymbolTable &) = delete;
+
+  Symbol intern(std::string_view text);
+  // The global symbol of every local id, interning the local names in id
+  // order
+  std::vector<Symbol> intern(const LocalSymbols &local);
+  std::string_view name(Symbol sym) const;
+  std::string str(Symbol sym) const { return std::string(name(sym)); }
+
+private:
+  Symbol append(std::string_view text); // mutex held
+
+  // Names live in blocks that never move: block b holds FIRST_BLOCK << b
+  // of them, enough blocks for every 32-bit id
+  static constexpr uint32_t FIRST_BLOCK = 64;
+  static constexpr int BLOCKS = 26;
+
+  std::mutex mutex;
+  std::atomic<std::string *> blocks[BLOCKS] = {};
+  uint32_t count = 0;
+  std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+SymbolTable &symbols();
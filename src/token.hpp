@@ -1,8 +1,11 @@
 #pragma once
-#include <string>
+#include "symbol.hpp"
+#include <cstdint>
+#include <string_view>
 #include <variant>
+#include <vector>
 #define DEBUG 1
-enum class TokenKind {
+enum class TokenKind : uint8_t {
   // Delimiters
   LBrace,
   RBrace,
@@ -25,6 +28,7 @@ enum class TokenKind {
   Return,
   Var,
   Define,
+  Const,
 
   // Operators
   Plus,
@@ -34,8 +38,11 @@ enum class TokenKind {
   Modulo,
   Equals,
   EqualEqual,
+  NotEqual,
   Less,
+  LessEqual,
   Greater,
+  GreaterEqual,
   Not,
   And,
   Or,
@@ -45,7 +52,10 @@ enum class TokenKind {
   Unknown
 };
 
-using LiteralValue = std::variant<std::monostate, int, bool, std::string>;
+// String literals carry no payload: their contents are the lexeme itself and
+// are only decoded (see decodeString) when they contain escape sequences.
+// Identifiers carry their interned Symbol.
+using LiteralValue = std::variant<std::monostate, int, bool, Symbol>;
 
 struct Position {
   int line = 1;
@@ -54,6 +64,42 @@ struct Position {
 struct Token {
   Position pos;
   TokenKind kind;
-  std::string lexeme;
+  std::string_view lexeme; // view into the source buffer, quotes excluded
   LiteralValue literal;
 };
+
+// Compact token storage: one byte of kind, a source offset and a line number
+// per token, kept in parallel arrays. Lexemes are recovered from the source
+// on demand and Number values and identifier symbols live in a side table, so
+// a token costs 9 bytes and nothing on the heap.
+class TokenBuffer {
+public:
+  std::string_view source;
+  std::vector<TokenKind> kinds;
+  std::vector<uint32_t> offsets; // start of the lexeme in source
+  std::vector<uint32_t> lines;
+
+  // Number values and Identifier symbol ids, sorted by the index of the
+  // token they belong to
+  std::vector<uint32_t> literal_tokens;
+  std::vector<int> literal_values;
+
+  size_t size() const { return kinds.size(); }
+
+  void push(TokenKind kind, uint32_t offset, uint32_t line) {
+    kinds.push_back(kind);
+    offsets.push_back(offset);
+    lines.push_back(line);
+  }
+
+  void pushWithPayload(TokenKind kind, uint32_t offset, uint32_t line,
+                       int payload) {
+    literal_tokens.push_back(static_cast<uint32_t>(kinds.size()));
+    literal_values.push_back(payload);
+    push(kind, offset, line);
+  }
+
+  std::string_view lexeme(size_t index) const; // defined in lexer.cpp
+  LiteralValue literal(size_t index) const;
+  Token at(size_t index) const;
+};